@@ -42,7 +42,7 @@ typedef std::chrono::monotonic_clock::duration steady_duration;
 
 // Callbacks are pervasive in the plugin and most of the times we have to copy them (moving is a hassle
 // generally and especially without support for moving into lambdas). This wrapper allocates std::functions
-// on heap, which should be easier to manage and faster.
+// on heap, which should be easier to manage and faster. Empty callbacks do not allocate anything.
 template<typename Signature>
 class function_ptr;
 
@@ -51,24 +51,22 @@ class function_ptr<R(ArgTypes...)>
 {
 public:
     function_ptr()
-        : m_function(new std::function<R(ArgTypes...)>(nullptr))
     {
     }
 
     function_ptr(std::nullptr_t)
-        : m_function(new std::function<R(ArgTypes...)>(nullptr))
     {
     }
 
     template<typename L>
     function_ptr(L l)
-        : m_function(new std::function<R(ArgTypes...)>(std::move(l)))
+        : m_function(std::make_shared<std::function<R(ArgTypes...)>>(std::move(l)))
     {
     }
 
     explicit operator bool() const
     {
-        return m_function->operator bool();
+        return m_function && m_function->operator bool();
     }
 
     template<typename... ParamArgTypes>
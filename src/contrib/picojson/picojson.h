@@ -4,7 +4,10 @@
  * The modifications to the file:
  *  * fixed the build warnings;
  *  * fixed parsing numbers in locales with different decimal point;
- *  * fixed serialization of numbers in locales with different decimal point.
+ *  * fixed serialization of numbers in locales with different decimal point;
+ *  * added input::pos(), returning the position of the next unread character;
+ *  * integer literals are parsed as int64_t (similar to PICOJSON_USE_INT64 in the later upstream
+ *    versions, but always enabled), any number may be retrieved with value::as_double().
  */
 
 // NOTE: Added in purple-vk-plugin to clean build warnings.
@@ -45,11 +48,13 @@
 
 #include <algorithm>
 #include <cassert>
+#include <cerrno>
 #include <clocale>
 #include <cmath>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <stdint.h>
 #include <iostream>
 #include <iterator>
 #include <map>
@@ -72,7 +77,8 @@ namespace picojson {
     number_type,
     string_type,
     array_type,
-    object_type
+    object_type,
+    int64_type
   };
   
   struct null {};
@@ -84,6 +90,7 @@ namespace picojson {
     union _storage {
       bool boolean_;
       double number_;
+      int64_t int64_;
       std::string* string_;
       array* array_;
       object* object_;
@@ -96,6 +103,7 @@ namespace picojson {
     value(int type, bool);
     explicit value(bool b);
     explicit value(double n);
+    explicit value(int64_t i);
     explicit value(const std::string& s);
     explicit value(const array& a);
     explicit value(const object& o);
@@ -108,6 +116,7 @@ namespace picojson {
     template <typename T> bool is() const;
     template <typename T> const T& get() const;
     template <typename T> T& get();
+    double as_double() const;
     bool evaluate_as_boolean() const;
     const value& get(size_t idx) const;
     const value& get(const std::string& key) const;
@@ -130,6 +139,7 @@ namespace picojson {
 #define INIT(p, v) case p##type: u_.p = v; break
       INIT(boolean_, false);
       INIT(number_, 0.0);
+      INIT(int64_, 0);
       INIT(string_, new std::string());
       INIT(array_, new array());
       INIT(object_, new object());
@@ -146,6 +156,10 @@ namespace picojson {
     u_.number_ = n;
   }
   
+  inline value::value(int64_t i) : type_(int64_type) {
+    u_.int64_ = i;
+  }
+  
   inline value::value(const std::string& s) : type_(string_type) {
     u_.string_ = new std::string(s);
   }
@@ -209,12 +223,19 @@ namespace picojson {
   }
   IS(null, null)
   IS(bool, boolean)
-  IS(int, number)
-  IS(double, number)
+  IS(int64_t, int64)
   IS(std::string, string)
   IS(array, array)
   IS(object, object)
 #undef IS
+  // All numbers are doubles for the type checks, but integers may be retrieved only with
+  // get<int64_t>() or as_double(), get<double>() works only for the numbers stored as double.
+  template <> inline bool value::is<int>() const {
+    return type_ == number_type || type_ == int64_type;
+  }
+  template <> inline bool value::is<double>() const {
+    return type_ == number_type || type_ == int64_type;
+  }
   
 #define GET(ctype, var)						\
   template <> inline const ctype& value::get<ctype>() const {	\
@@ -228,11 +249,28 @@ namespace picojson {
     return var;							\
   }
   GET(bool, u_.boolean_)
-  GET(double, u_.number_)
+  GET(int64_t, u_.int64_)
   GET(std::string, *u_.string_)
   GET(array, *u_.array_)
   GET(object, *u_.object_)
 #undef GET
+
+  template <> inline const double& value::get<double>() const {
+    assert("type mismatch! call as_double() for integers" && type_ == number_type);
+    return u_.number_;
+  }
+  template <> inline double& value::get<double>() {
+    assert("type mismatch! call as_double() for integers" && type_ == number_type);
+    return u_.number_;
+  }
+
+  // Returns any number as double. The stored value is never changed, so integers stay exact.
+  inline double value::as_double() const {
+    assert("type mismatch! call is<double>() before as_double()" && is<double>());
+    if (type_ == int64_type)
+      return static_cast<double>(u_.int64_);
+    return u_.number_;
+  }
   
   inline bool value::evaluate_as_boolean() const {
     switch (type_) {
@@ -242,6 +280,8 @@ namespace picojson {
       return u_.boolean_;
     case number_type:
       return u_.number_ != 0;
+    case int64_type:
+      return u_.int64_ != 0;
     case string_type:
       return ! u_.string_->empty();
     default:
@@ -307,6 +347,11 @@ namespace picojson {
       }
       return buf;
     }
+    case int64_type:     {
+      char buf[32];
+      SNPRINTF(buf, sizeof(buf), "%lld", (long long)u_.int64_);
+      return buf;
+    }
     case string_type:    return *u_.string_;
     case array_type:     return "array";
     case object_type:    return "object";
@@ -425,6 +470,7 @@ namespace picojson {
       }
     }
     Iter cur() const { return cur_; }
+    Iter pos() const { return ungot_ ? cur_ - 1 : cur_; }
     int line() const { return line_; }
     void skip_ws() {
       while (1) {
@@ -594,14 +640,20 @@ namespace picojson {
     return in.expect('}');
   }
   
-  template <typename Iter> inline bool _parse_number(double& out, input<Iter>& in) {
+  // Integers, which fit into int64_t, are stored in int_out and is_int is set, other numbers are
+  // stored in out.
+  template <typename Iter> inline bool _parse_number(double& out, int64_t& int_out, bool& is_int, input<Iter>& in) {
     std::string num_str;
+    is_int = true;
     while (1) {
       int ch = in.getc();
-      if (('0' <= ch && ch <= '9') || ch == '+' || ch == '-'
-	  || ch == 'e' || ch == 'E') {
+      if (('0' <= ch && ch <= '9') || ch == '+' || ch == '-') {
+	num_str.push_back(ch);
+      } else if (ch == 'e' || ch == 'E') {
+	is_int = false;
 	num_str.push_back(ch);
       } else if (ch == '.') {
+    is_int = false;
     for (const char* dp = localeconv()->decimal_point; *dp != '\0'; dp++) {
         num_str.push_back(*dp);
     }
@@ -611,6 +663,16 @@ namespace picojson {
       }
     }
     char* endp;
+    if (is_int) {
+      errno = 0;
+      long long ival = strtoll(num_str.c_str(), &endp, 10);
+      if (errno == 0 && endp == num_str.c_str() + num_str.size()) {
+	int_out = ival;
+	return true;
+      }
+      // Does not fit into int64_t.
+      is_int = false;
+    }
     out = strtod(num_str.c_str(), &endp);
     return endp == num_str.c_str() + num_str.size();
   }
@@ -639,8 +701,14 @@ namespace picojson {
       if (('0' <= ch && ch <= '9') || ch == '-') {
 	in.ungetc();
 	double f;
-	if (_parse_number(f, in)) {
-	  ctx.set_number(f);
+	int64_t i;
+	bool is_int;
+	if (_parse_number(f, i, is_int, in)) {
+	  if (is_int) {
+	    ctx.set_int64(i);
+	  } else {
+	    ctx.set_number(f);
+	  }
 	  return true;
 	} else {
 	  return false;
@@ -657,6 +725,7 @@ namespace picojson {
     bool set_null() { return false; }
     bool set_bool(bool) { return false; }
     bool set_number(double) { return false; }
+    bool set_int64(int64_t) { return false; }
     template <typename Iter> bool parse_string(input<Iter>&) { return false; }
     bool parse_array_start() { return false; }
     template <typename Iter> bool parse_array_item(input<Iter>&, size_t) {
@@ -685,6 +754,10 @@ namespace picojson {
       *out_ = value(f);
       return true;
     }
+    bool set_int64(int64_t i) {
+      *out_ = value(i);
+      return true;
+    }
     template<typename Iter> bool parse_string(input<Iter>& in) {
       *out_ = value(string_type, false);
       return _parse_string(out_->get<std::string>(), in);
@@ -723,6 +796,7 @@ namespace picojson {
     bool set_null() { return true; }
     bool set_bool(bool) { return true; }
     bool set_number(double) { return true; }
+    bool set_int64(int64_t) { return true; }
     template <typename Iter> bool parse_string(input<Iter>& in) {
       dummy_str s;
       return _parse_string(s, in);
@@ -793,11 +867,14 @@ namespace picojson {
   inline bool operator==(const value& x, const value& y) {
     if (x.is<null>())
       return y.is<null>();
+    if (x.is<int64_t>() && y.is<int64_t>())
+      return x.get<int64_t>() == y.get<int64_t>();
+    if (x.is<double>())
+      return y.is<double>() && x.as_double() == y.as_double();
 #define PICOJSON_CMP(type)					\
     if (x.is<type>())						\
       return y.is<type>() && x.get<type>() == y.get<type>()
     PICOJSON_CMP(bool);
-    PICOJSON_CMP(double);
     PICOJSON_CMP(std::string);
     PICOJSON_CMP(array);
     PICOJSON_CMP(object);
@@ -901,7 +978,7 @@ int main(void)
       ss << vi;
       picojson::value vo;
       ss >> vo;
-      double b = vo.get<double>();
+      double b = vo.as_double();
       if ((i < 53 && a != b) || fabs(a - b) / b > 1e-8) {
         printf("ng i=%d a=%.18e b=%.18e\n", i, a, b);
       }
@@ -956,7 +1033,7 @@ int main(void)
     is(v.get<picojson::array>().size(), size_t(3), "check array size");
     ok(v.contains(0), "check contains array[0]");
     ok(v.get(0).is<double>(), "check array[0] type");
-    is(v.get(0).get<double>(), 1.0, "check array[0] value");
+    is(v.get(0).as_double(), 1.0, "check array[0] value");
     ok(v.contains(1), "check contains array[1]");
     ok(v.get(1).is<bool>(), "check array[1] type");
     ok(v.get(1).get<bool>(), "check array[1] value");
@@ -4,6 +4,8 @@
  * The only modifications to the files concern fixing the build, making it clean (silencing
  * the warnings) and removing handling "expires" in Set-cookie header as it gets wrongly (?)
  * parsed and. therefore, makes cookies rejected.
+ *
+ * Functions, added in purple-vk-plugin, are marked in http.h.
  */
 
 /**
@@ -77,6 +79,23 @@ purple_ssl_input_remove(PurpleSslConnection *gsc)
 #define PURPLE_HTTP_MAX_RECV_BUFFER_LEN 10240
 #define PURPLE_HTTP_MAX_READ_BUFFER_LEN 10240
 #define PURPLE_HTTP_GZ_BUFF_LEN 1024
+// NOTE: Added in purple-vk-plugin. The size of the buffer for reading from
+// the socket starts with MIN_LEN and grows up to MAX_LEN according to
+// Content-Length or if the reads fill the whole buffer.
+#define PURPLE_HTTP_RECV_CHUNK_MIN_LEN 4096
+#define PURPLE_HTTP_RECV_CHUNK_MAX_LEN 65536
+// NOTE: Added in purple-vk-plugin. Expected ratio of decompressed to
+// compressed data, used to pre-size the buffer for the response contents.
+#define PURPLE_HTTP_GZ_RATIO_HINT 4
+// NOTE: Added in purple-vk-plugin. The amount of data requested from
+// contents_reader at once. Uploads are large, so larger chunks mean fewer
+// reader calls and socket writes.
+#define PURPLE_HTTP_CONTENTS_READER_CHUNK_LEN 65536
+// NOTE: Added in purple-vk-plugin. Idle keep-alive sockets are not watched,
+// so the ones closed by the server stay in the pool. The sockets, which have
+// been idle for longer than this (in seconds), are considered closed by
+// purple_http_keepalive_pool_prewarm.
+#define PURPLE_HTTP_KEEPALIVE_PREWARM_MAX_IDLE 30
 
 #define PURPLE_HTTP_REQUEST_DEFAULT_MAX_REDIRECTS 20
 #define PURPLE_HTTP_REQUEST_DEFAULT_TIMEOUT 30
@@ -112,6 +131,26 @@ struct _PurpleHttpSocket
 	PurpleInputFunction watch_cb;
 	PurpleHttpSocketConnectCb connect_cb;
 	gpointer cb_data;
+
+	// NOTE: Added in purple-vk-plugin. Pipelined connections, which have sent
+	// (or started sending) their requests over this socket, in the order of
+	// the responses. The first one reads the response.
+	GSList *pipeline;
+	// NOTE: Added in purple-vk-plugin. Set when the server has responded
+	// without closing the connection, so that further requests may be
+	// pipelined.
+	gboolean pipeline_allowed;
+	// NOTE: Added in purple-vk-plugin. Data, which has been read past the end
+	// of the response and belongs to the next pipelined response.
+	GString *read_buffer;
+	guint read_buffer_timeout;
+
+	// NOTE: Added in purple-vk-plugin. Set while the socket, opened by
+	// purple_http_keepalive_pool_prewarm, is connecting.
+	gboolean is_prewarming;
+	// NOTE: Added in purple-vk-plugin. Monotonic time (in microseconds),
+	// when the socket has been released to the pool the last time.
+	gint64 released_time;
 };
 
 struct _PurpleHttpRequest
@@ -135,6 +174,8 @@ struct _PurpleHttpRequest
 	int max_redirects;
 	gboolean http11;
 	guint max_length;
+	// NOTE: Added in purple-vk-plugin.
+	gboolean pipelining;
 };
 
 struct _PurpleHttpConnection
@@ -145,6 +186,11 @@ struct _PurpleHttpConnection
 	gboolean is_reading;
 	gboolean is_keepalive;
 	gboolean is_cancelling;
+	// NOTE: Added in purple-vk-plugin. can_pipeline is set if the request may
+	// be pipelined, is_pipelined is set if it has been sent while the response
+	// to the previous request was not received yet.
+	gboolean can_pipeline;
+	gboolean is_pipelined;
 
 	PurpleHttpURL *url;
 	PurpleHttpRequest *request;
@@ -158,6 +204,13 @@ struct _PurpleHttpConnection
 	gboolean main_header_got, headers_got;
 	GString *response_buffer;
 	PurpleHttpGzStream *gz_stream;
+	// NOTE: Added in purple-vk-plugin. Buffer for reading from the socket
+	// (see PURPLE_HTTP_RECV_CHUNK_MIN_LEN) and buffer for decompressed data,
+	// which is passed to response_writer.
+	gchar *recv_buffer;
+	gsize recv_buffer_len;
+	gboolean recv_buffer_filled;
+	GString *gz_buffer;
 
 	GString *contents_reader_buffer;
 	gboolean contents_reader_requested;
@@ -228,6 +281,8 @@ struct _PurpleHttpKeepaliveRequest
 
 	PurpleHttpKeepaliveHost *host;
 	PurpleHttpSocket *hs;
+	// NOTE: Added in purple-vk-plugin.
+	gboolean can_pipeline;
 };
 
 struct _PurpleHttpKeepaliveHost
@@ -242,6 +297,10 @@ struct _PurpleHttpKeepaliveHost
 
 	GSList *queue; /* list of PurpleHttpKeepaliveRequest */
 	guint process_queue_timeout;
+
+	// NOTE: Added in purple-vk-plugin. Set when the host has broken the
+	// pipeline, all further requests are sent serially.
+	gboolean pipelining_disabled;
 };
 
 struct _PurpleHttpKeepalivePool
@@ -251,6 +310,8 @@ struct _PurpleHttpKeepalivePool
 	int ref_count;
 
 	guint limit_per_host;
+	// NOTE: Added in purple-vk-plugin.
+	guint pipeline_depth;
 
 	/* key: purple_http_socket_hash, value: PurpleHttpKeepaliveHost */
 	GHashTable *by_hash;
@@ -295,11 +356,13 @@ gchar * purple_http_cookie_jar_dump(PurpleHttpCookieJar *cjar);
 static PurpleHttpKeepaliveRequest *
 purple_http_keepalive_pool_request(PurpleHttpKeepalivePool *pool,
 	PurpleConnection *gc, const gchar *host, int port, gboolean is_ssl,
-	PurpleHttpSocketConnectCb cb, gpointer user_data);
+	gboolean can_pipeline, PurpleHttpSocketConnectCb cb, gpointer user_data);
 static void
 purple_http_keepalive_pool_request_cancel(PurpleHttpKeepaliveRequest *req);
 static void
 purple_http_keepalive_pool_release(PurpleHttpSocket *hs, gboolean invalidate);
+static void
+purple_http_keepalive_host_process_queue(PurpleHttpKeepaliveHost *host);
 
 static void
 purple_http_connection_set_remove(PurpleHttpConnectionSet *set,
@@ -416,19 +479,22 @@ purple_http_gz_new(gsize max_output, gboolean is_deflate)
 	return gzs;
 }
 
-static GString *
-purple_http_gz_put(PurpleHttpGzStream *gzs, const gchar *buf, gsize len)
+// NOTE: Changed in purple-vk-plugin. Decompressed data is appended to out
+// directly, without intermediate buffers.
+static gboolean
+purple_http_gz_put(PurpleHttpGzStream *gzs, const gchar *buf, gsize len,
+	GString *out)
 {
 	const gchar *compressed_buff;
 	gsize compressed_len;
-	GString *ret;
 	z_stream *zs;
 
-	g_return_val_if_fail(gzs != NULL, NULL);
-	g_return_val_if_fail(buf != NULL, NULL);
+	g_return_val_if_fail(gzs != NULL, FALSE);
+	g_return_val_if_fail(buf != NULL, FALSE);
+	g_return_val_if_fail(out != NULL, FALSE);
 
 	if (gzs->failed)
-		return NULL;
+		return FALSE;
 
 	zs = &gzs->zs;
 
@@ -444,21 +510,28 @@ purple_http_gz_put(PurpleHttpGzStream *gzs, const gchar *buf, gsize len)
 	zs->next_in = (z_const Bytef*)compressed_buff;
 	zs->avail_in = compressed_len;
 
-	ret = g_string_new(NULL);
 	while (zs->avail_in > 0) {
 		int gzres;
-		gchar decompressed_buff[PURPLE_HTTP_GZ_BUFF_LEN];
-		gsize decompressed_len;
-
-		zs->next_out = (Bytef*)decompressed_buff;
-		zs->avail_out = sizeof(decompressed_buff);
-		decompressed_len = zs->avail_out = sizeof(decompressed_buff);
+		gsize out_len = out->len;
+		gsize avail, decompressed_len;
+
+		/* Inflate into all the free space of out, but not less than
+		 * PURPLE_HTTP_GZ_BUFF_LEN. */
+		avail = out->allocated_len - out_len - 1;
+		if (avail < PURPLE_HTTP_GZ_BUFF_LEN)
+			avail = PURPLE_HTTP_GZ_BUFF_LEN;
+		g_string_set_size(out, out_len + avail);
+
+		zs->next_out = (Bytef*)(out->str + out_len);
+		zs->avail_out = avail;
 		gzres = inflate(zs, Z_FULL_FLUSH);
-		decompressed_len -= zs->avail_out;
+		decompressed_len = avail - zs->avail_out;
 
 		if (gzres == Z_OK || gzres == Z_STREAM_END) {
-			if (decompressed_len == 0)
+			if (decompressed_len == 0) {
+				g_string_set_size(out, out_len);
 				break;
+			}
 			if (gzs->decompressed + decompressed_len >=
 				gzs->max_output)
 			{
@@ -469,16 +542,16 @@ purple_http_gz_put(PurpleHttpGzStream *gzs, const gchar *buf, gsize len)
 				gzres = Z_STREAM_END;
 			}
 			gzs->decompressed += decompressed_len;
-			g_string_append_len(ret, decompressed_buff,
-				decompressed_len);
+			g_string_set_size(out, out_len + decompressed_len);
 			if (gzres == Z_STREAM_END)
 				break;
 		} else {
+			g_string_set_size(out, out_len);
 			purple_debug_error("http",
 				"Decompression failed (%d): %s\n", gzres,
 				zs->msg);
 			gzs->failed = TRUE;
-			return NULL;
+			return FALSE;
 		}
 	}
 
@@ -492,7 +565,7 @@ purple_http_gz_put(PurpleHttpGzStream *gzs, const gchar *buf, gsize len)
 			zs->avail_in);
 	}
 
-	return ret;
+	return TRUE;
 }
 
 static void
@@ -603,6 +676,15 @@ purple_http_socket_read(PurpleHttpSocket *hs, gchar *buf, size_t len)
 	g_return_val_if_fail(hs != NULL, -1);
 	g_return_val_if_fail(buf != NULL, -1);
 
+	// NOTE: Added in purple-vk-plugin.
+	if (hs->read_buffer != NULL && hs->read_buffer->len > 0) {
+		if (len > hs->read_buffer->len)
+			len = hs->read_buffer->len;
+		memcpy(buf, hs->read_buffer->str, len);
+		g_string_erase(hs->read_buffer, 0, len);
+		return len;
+	}
+
 	if (hs->is_ssl)
 		return purple_ssl_read(hs->ssl_connection, buf, len);
 	else
@@ -699,6 +781,13 @@ purple_http_socket_close_free(PurpleHttpSocket *hs)
 	if (hs->inpa != 0)
 		purple_input_remove(hs->inpa);
 
+	// NOTE: Added in purple-vk-plugin.
+	if (hs->read_buffer_timeout != 0)
+		purple_timeout_remove(hs->read_buffer_timeout);
+	if (hs->read_buffer != NULL)
+		g_string_free(hs->read_buffer, TRUE);
+	g_slist_free(hs->pipeline);
+
 	if (hs->is_ssl) {
 		if (hs->ssl_connection != NULL)
 			purple_ssl_close(hs->ssl_connection);
@@ -907,6 +996,12 @@ static void _purple_http_send(gpointer _hc, gint fd, PurpleInputCondition cond);
  * request */
 static gboolean _purple_http_reconnect(PurpleHttpConnection *hc);
 
+// NOTE: Added in purple-vk-plugin.
+static void _purple_http_pipeline_unread(PurpleHttpSocket *hs,
+	const gchar *buf, int len);
+static void _purple_http_pipeline_leave(PurpleHttpConnection *hc,
+	gboolean is_graceful);
+
 static void _purple_http_error(PurpleHttpConnection *hc, const char *format,
 	...) G_GNUC_PRINTF(2, 3);
 
@@ -1132,10 +1227,26 @@ static gboolean _purple_http_recv_headers(PurpleHttpConnection *hc,
 	return TRUE;
 }
 
+// NOTE: Added in purple-vk-plugin. Returns the initial size of the buffer
+// for the response contents.
+static gsize _purple_http_contents_size_hint(PurpleHttpConnection *hc)
+{
+	gsize hint;
+
+	if (hc->length_expected <= 0)
+		return 0;
+
+	hint = hc->length_expected;
+	if (hc->gz_stream != NULL)
+		hint *= PURPLE_HTTP_GZ_RATIO_HINT;
+	return MIN(hint, hc->request->max_length) + 1;
+}
+
 static gboolean _purple_http_recv_body_data(PurpleHttpConnection *hc,
 	const gchar *buf, int len)
 {
-	GString *decompressed = NULL;
+	GString *out = NULL;
+	gsize out_len = 0;
 
 	if (hc->length_expected >= 0 &&
 		len + hc->length_got > (guint)hc->length_expected)
@@ -1145,15 +1256,34 @@ static gboolean _purple_http_recv_body_data(PurpleHttpConnection *hc,
 
 	hc->length_got += len;
 
-	if (hc->gz_stream != NULL) {
-		decompressed = purple_http_gz_put(hc->gz_stream, buf, len);
-		if (decompressed == NULL) {
-			_purple_http_error(hc,
-                _("Error while decompressing data"));
-			return FALSE;
+	// NOTE: Changed in purple-vk-plugin. The data is decompressed (or
+	// copied) right into the response contents. The data for response_writer
+	// is passed as is or decompressed into the reused gz_buffer.
+	if (hc->request->response_writer == NULL) {
+		if (hc->response->contents == NULL) {
+			hc->response->contents = g_string_sized_new(
+				_purple_http_contents_size_hint(hc));
 		}
-		buf = decompressed->str;
-		len = decompressed->len;
+		out = hc->response->contents;
+	} else if (hc->gz_stream != NULL) {
+		if (hc->gz_buffer == NULL)
+			hc->gz_buffer = g_string_sized_new(
+				PURPLE_HTTP_GZ_BUFF_LEN);
+		out = hc->gz_buffer;
+	}
+
+	if (out != NULL) {
+		out_len = out->len;
+		if (hc->gz_stream != NULL) {
+			if (!purple_http_gz_put(hc->gz_stream, buf, len, out)) {
+				_purple_http_error(hc,
+					_("Error while decompressing data"));
+				return FALSE;
+			}
+		} else
+			g_string_append_len(out, buf, len);
+		buf = out->str + out_len;
+		len = out->len - out_len;
 	}
 
 	g_assert(hc->request->max_length <=
@@ -1163,46 +1293,40 @@ static gboolean _purple_http_recv_body_data(PurpleHttpConnection *hc,
 			"Maximum length exceeded, truncating\n");
 		len = hc->request->max_length - hc->length_got_decompressed;
 		hc->length_expected = hc->length_got;
+		if (out != NULL)
+			g_string_truncate(out, out_len + len);
 	}
 	hc->length_got_decompressed += len;
 
-	if (len == 0) {
-		if (decompressed != NULL)
-			g_string_free(decompressed, TRUE);
+	if (len == 0)
 		return TRUE;
-	}
 
 	if (hc->request->response_writer != NULL) {
 		gboolean succ;
 		succ = hc->request->response_writer(hc, hc->response, buf,
 			hc->length_got_decompressed, len,
 			hc->request->response_writer_data);
+		if (out != NULL)
+			g_string_truncate(out, 0);
 		if (!succ) {
-			if (decompressed != NULL)
-				g_string_free(decompressed, TRUE);
 			purple_debug_error("http",
 				"Cannot write using callback\n");
 			_purple_http_error(hc,
                 _("Error handling retrieved data"));
 			return FALSE;
 		}
-	} else {
-		if (hc->response->contents == NULL)
-			hc->response->contents = g_string_new("");
-		g_string_append_len(hc->response->contents, buf, len);
 	}
 
-	if (decompressed != NULL)
-		g_string_free(decompressed, TRUE);
-
 	purple_http_conn_notify_progress_watcher(hc);
 	return TRUE;
 }
 
+// NOTE: Changed in purple-vk-plugin. The chunk data is passed on right from
+// buf, only the chunk size lines are collected in response_buffer.
 static gboolean _purple_http_recv_body_chunked(PurpleHttpConnection *hc,
 	const gchar *buf, int len)
 {
-	gchar *eol, *line;
+	const gchar *eol;
 	int line_len;
 
 	if (hc->chunks_done)
@@ -1210,38 +1334,29 @@ static gboolean _purple_http_recv_body_chunked(PurpleHttpConnection *hc,
 	if (!hc->response_buffer)
 		hc->response_buffer = g_string_new("");
 
-	g_string_append_len(hc->response_buffer, buf, len);
-	if (hc->response_buffer->len > PURPLE_HTTP_MAX_RECV_BUFFER_LEN) {
-		purple_debug_error("http",
-			"Buffer too big when searching for chunk\n");
-        _purple_http_error(hc, _("Error parsing HTTP"));
-		return FALSE;
-	}
-
-	while (hc->response_buffer->len > 0) {
+	while (len > 0) {
 		if (hc->in_chunk) {
-			int got_now = hc->response_buffer->len;
+			int got_now = len;
 			if (hc->chunk_got + got_now > hc->chunk_length)
 				got_now = hc->chunk_length - hc->chunk_got;
 			hc->chunk_got += got_now;
-			
-			if (!_purple_http_recv_body_data(hc,
-				hc->response_buffer->str, got_now))
+
+			if (!_purple_http_recv_body_data(hc, buf, got_now))
 				return FALSE;
 
-			g_string_erase(hc->response_buffer, 0, got_now);
+			buf += got_now;
+			len -= got_now;
 			hc->in_chunk = (hc->chunk_got < hc->chunk_length);
 
 			continue;
 		}
 
-		line = hc->response_buffer->str;
-		eol = strstr(line, "\r\n");
-		if (eol == line) {
-			g_string_erase(hc->response_buffer, 0, 2);
-			line = hc->response_buffer->str;
-			eol = strstr(line, "\r\n");
-		}
+		eol = memchr(buf, '\n', len);
+		line_len = (eol != NULL) ? (eol - buf + 1) : len;
+		g_string_append_len(hc->response_buffer, buf, line_len);
+		buf += line_len;
+		len -= line_len;
+
 		if (eol == NULL) {
 			/* waiting for more data (unlikely, but possible) */
 			if (hc->response_buffer->len > 20) {
@@ -1252,30 +1367,39 @@ static gboolean _purple_http_recv_body_chunked(PurpleHttpConnection *hc,
 			}
 			return TRUE;
 		}
-		line_len = eol - line;
 
-		if (1 != sscanf(line, "%x", &hc->chunk_length)) {
+		/* The line break after the previous chunk. */
+		if (strcmp(hc->response_buffer->str, "\r\n") == 0) {
+			g_string_truncate(hc->response_buffer, 0);
+			continue;
+		}
+
+		if (1 != sscanf(hc->response_buffer->str, "%x",
+			&hc->chunk_length))
+		{
 			if (purple_debug_is_unsafe())
 				purple_debug_warning("http",
 					"Chunk length not found in [%s]\n",
-					line);
+					hc->response_buffer->str);
 			else
 				purple_debug_warning("http",
 					"Chunk length not found\n");
 			_purple_http_error(hc, _("Error parsing HTTP"));
 			return FALSE;
 		}
+		g_string_truncate(hc->response_buffer, 0);
 		hc->chunk_got = 0;
 		hc->in_chunk = TRUE;
 
 		if (purple_debug_is_verbose())
 			purple_debug_misc("http", "Found chunk of length %d\n", hc->chunk_length);
 
-		g_string_erase(hc->response_buffer, 0, line_len + 2);
-
 		if (hc->chunk_length == 0) {
 			hc->chunks_done = TRUE;
 			hc->in_chunk = FALSE;
+			/* Keep the rest (the final line break and the
+			 * pipelined responses). */
+			g_string_append_len(hc->response_buffer, buf, len);
 			return TRUE;
 		}
 	}
@@ -1289,17 +1413,58 @@ static gboolean _purple_http_recv_body(PurpleHttpConnection *hc,
 	if (hc->is_chunked)
 		return _purple_http_recv_body_chunked(hc, buf, len);
 
+	// NOTE: Added in purple-vk-plugin. The rest of the data belongs to
+	// the next pipelined response.
+	if (hc->socket->pipeline != NULL && hc->length_expected >= 0 &&
+		len + hc->length_got > (guint)hc->length_expected)
+	{
+		int body_len = hc->length_expected - hc->length_got;
+		_purple_http_pipeline_unread(hc->socket, buf + body_len,
+			len - body_len);
+	}
+
 	return _purple_http_recv_body_data(hc, buf, len);
 }
 
+// NOTE: Added in purple-vk-plugin. Grows the buffer for reading from the
+// socket, so that large responses are read in fewer calls.
+static void _purple_http_recv_buffer_adjust(PurpleHttpConnection *hc)
+{
+	gsize len = hc->recv_buffer_len;
+
+	if (len == 0)
+		len = PURPLE_HTTP_RECV_CHUNK_MIN_LEN;
+	if (hc->headers_got && hc->length_expected > 0 &&
+		(guint)hc->length_expected > hc->length_got &&
+		hc->length_expected - hc->length_got > len)
+	{
+		len = hc->length_expected - hc->length_got;
+	}
+	if (hc->recv_buffer_filled)
+		len *= 2;
+	if (len > PURPLE_HTTP_RECV_CHUNK_MAX_LEN)
+		len = PURPLE_HTTP_RECV_CHUNK_MAX_LEN;
+
+	if (len <= hc->recv_buffer_len)
+		return;
+
+	g_free(hc->recv_buffer);
+	hc->recv_buffer = g_malloc(len);
+	hc->recv_buffer_len = len;
+}
+
 static gboolean _purple_http_recv_loopbody(PurpleHttpConnection *hc, gint fd)
 {
 	int len;
-	gchar buf[4096];
+	gchar *buf;
 	gboolean got_anything;
 
-	len = purple_http_socket_read(hc->socket, buf, sizeof(buf));
+	_purple_http_recv_buffer_adjust(hc);
+	buf = hc->recv_buffer;
+
+	len = purple_http_socket_read(hc->socket, buf, hc->recv_buffer_len);
 	got_anything = (len > 0);
+	hc->recv_buffer_filled = (len == (int)hc->recv_buffer_len);
 
 	if (len < 0 && errno == EAGAIN)
 		return FALSE;
@@ -1381,8 +1546,13 @@ static gboolean _purple_http_recv_loopbody(PurpleHttpConnection *hc, gint fd)
 			hc->response_buffer->len > 0) {
 			int buffer_len = hc->response_buffer->len;
 			gchar *buffer = g_string_free(hc->response_buffer, FALSE);
+			gboolean body_ok;
 			hc->response_buffer = NULL;
-			_purple_http_recv_body(hc, buffer, buffer_len);
+			body_ok = _purple_http_recv_body(hc, buffer, buffer_len);
+			g_free(buffer);
+			/* The connection is terminated on errors. */
+			if (!body_ok)
+				return FALSE;
 		}
 		if (!hc->headers_got)
 			return got_anything;
@@ -1416,6 +1586,21 @@ static gboolean _purple_http_recv_loopbody(PurpleHttpConnection *hc, gint fd)
 			return FALSE;
 		}
 
+		// NOTE: Added in purple-vk-plugin.
+		if (hc->socket->pipeline != NULL) {
+			if (hc->is_chunked && hc->response_buffer &&
+				hc->response_buffer->len > 0)
+			{
+				_purple_http_pipeline_unread(hc->socket,
+					hc->response_buffer->str,
+					hc->response_buffer->len);
+				g_string_truncate(hc->response_buffer, 0);
+			}
+			hc->socket->pipeline_allowed =
+				!purple_http_headers_match(
+				hc->response->headers, "Connection", "close");
+		}
+
 		if (purple_debug_is_unsafe() && purple_debug_is_verbose()) {
 			gchar *hdrs = purple_http_headers_dump(
 				hc->response->headers);
@@ -1538,12 +1723,13 @@ static void _purple_http_send(gpointer _hc, gint fd, PurpleInputCondition cond)
 			hc->contents_reader_buffer = g_string_new("");
 		if (hc->contents_reader_buffer->len == 0) {
 			hc->contents_reader_requested = TRUE;
+			// NOTE: Changed in purple-vk-plugin. Request larger chunks.
 			g_string_set_size(hc->contents_reader_buffer,
-				PURPLE_HTTP_MAX_READ_BUFFER_LEN);
+				PURPLE_HTTP_CONTENTS_READER_CHUNK_LEN);
 			hc->request->contents_reader(hc,
 				hc->contents_reader_buffer->str,
 				hc->request_contents_written,
-				PURPLE_HTTP_MAX_READ_BUFFER_LEN,
+				PURPLE_HTTP_CONTENTS_READER_CHUNK_LEN,
 				hc->request->contents_reader_data,
 				_purple_http_send_got_data);
 			return;
@@ -1607,6 +1793,11 @@ static void _purple_http_send(gpointer _hc, gint fd, PurpleInputCondition cond)
 	hc->is_reading = TRUE;
 	purple_http_socket_watch(hc->socket, PURPLE_INPUT_READ,
 		_purple_http_recv, hc);
+
+	// NOTE: Added in purple-vk-plugin. The next requests may be pipelined
+	// after this one.
+	if (hc->socket->pipeline != NULL)
+		purple_http_keepalive_host_process_queue(hc->socket->host);
 }
 
 static void _purple_http_disconnect(PurpleHttpConnection *hc,
@@ -1624,12 +1815,172 @@ static void _purple_http_disconnect(PurpleHttpConnection *hc,
 
 	if (hc->socket_request)
 		purple_http_keepalive_pool_request_cancel(hc->socket_request);
-	else {
+	else if (hc->socket != NULL &&
+		g_slist_find(hc->socket->pipeline, hc) != NULL)
+	{
+		_purple_http_pipeline_leave(hc, is_graceful);
+	} else {
 		purple_http_keepalive_pool_release(hc->socket, !is_graceful);
 		hc->socket = NULL;
 	}
 }
 
+/*** HTTP pipelining **********************************************************/
+
+// NOTE: Added in purple-vk-plugin. Pipelining is done on top of keep-alive
+// pool: the first pipelinable connection on the socket starts the pipeline
+// and is processed as usual, the next ones are attached to the busy socket
+// (see purple_http_keepalive_host_find_pipeline) and write their requests
+// right away. Each connection reads its response, when it becomes the first
+// in the pipeline. If the pipeline breaks, the requests, which are still
+// waiting for responses, are retried on the other sockets and the host falls
+// back to serial requests.
+
+// Returns the data, which has been read past the end of the response, so that
+// the next pipelined connection reads it first.
+static void _purple_http_pipeline_unread(PurpleHttpSocket *hs,
+	const gchar *buf, int len)
+{
+	if (len <= 0)
+		return;
+
+	if (hs->read_buffer == NULL)
+		hs->read_buffer = g_string_new("");
+	g_string_prepend_len(hs->read_buffer, buf, len);
+}
+
+static gboolean _purple_http_pipeline_read_buffer_cb(gpointer _hs)
+{
+	PurpleHttpSocket *hs = _hs;
+
+	hs->read_buffer_timeout = 0;
+	if (hs->pipeline != NULL)
+		_purple_http_recv(hs->pipeline->data, hs->fd,
+			PURPLE_INPUT_READ);
+
+	return FALSE;
+}
+
+// Lets the first connection in the pipeline proceed.
+static void _purple_http_pipeline_next(PurpleHttpSocket *hs)
+{
+	PurpleHttpConnection *hc = hs->pipeline->data;
+
+	purple_http_socket_dontwatch(hs);
+
+	if (!hc->is_reading) {
+		/* The request has not been completely written, when it was
+		 * attached. */
+		purple_http_socket_watch(hs, PURPLE_INPUT_WRITE,
+			_purple_http_send, hc);
+		return;
+	}
+
+	purple_http_socket_watch(hs, PURPLE_INPUT_READ, _purple_http_recv, hc);
+	/* The response may have already been read completely. */
+	if (hs->read_buffer != NULL && hs->read_buffer->len > 0 &&
+		hs->read_buffer_timeout == 0)
+	{
+		hs->read_buffer_timeout = purple_timeout_add(0,
+			_purple_http_pipeline_read_buffer_cb, hs);
+	}
+}
+
+// Writes the request of the connection, which has been attached to the
+// socket with pending responses. Whatever cannot be written now is written
+// by _purple_http_send when the connection becomes the first in the pipeline.
+static void _purple_http_pipeline_attach(PurpleHttpSocket *hs,
+	PurpleHttpConnection *hc)
+{
+	int written;
+
+	if (purple_debug_is_verbose())
+		purple_debug_misc("http", "pipelining request %p on socket "
+			"%p\n", hc, hs);
+
+	hc->is_pipelined = TRUE;
+	hs->pipeline = g_slist_append(hs->pipeline, hc);
+
+	_purple_http_gen_headers(hc);
+
+	written = purple_http_socket_write(hs, hc->request_header->str,
+		hc->request_header->len);
+	if (written <= 0)
+		return;
+	hc->request_header_written = written;
+	if (hc->request_header_written < hc->request_header->len)
+		return;
+
+	if (hc->request->contents_length > 0) {
+		written = purple_http_socket_write(hs, hc->request->contents,
+			hc->request->contents_length);
+		if (written <= 0)
+			return;
+		hc->request_contents_written = written;
+		if (hc->request_contents_written <
+			(guint)hc->request->contents_length)
+		{
+			return;
+		}
+	}
+
+	hc->is_reading = TRUE;
+	purple_http_conn_notify_progress_watcher(hc);
+}
+
+// Removes the connection from the pipeline of its socket.
+static void _purple_http_pipeline_leave(PurpleHttpConnection *hc,
+	gboolean is_graceful)
+{
+	PurpleHttpSocket *hs = hc->socket;
+	gboolean was_first = (hs->pipeline->data == hc);
+	GSList *rest, *it;
+
+	hs->pipeline = g_slist_remove(hs->pipeline, hc);
+	hc->socket = NULL;
+
+	if (is_graceful && was_first) {
+		if (hs->pipeline == NULL) {
+			if (hs->read_buffer != NULL)
+				g_string_truncate(hs->read_buffer, 0);
+			purple_http_keepalive_pool_release(hs, FALSE);
+			return;
+		}
+		if (hs->pipeline_allowed) {
+			_purple_http_pipeline_next(hs);
+			purple_http_keepalive_host_process_queue(hs->host);
+			return;
+		}
+		/* The server is going to close the connection, so the rest
+		 * of the requests must be sent again. */
+	}
+
+	/* Responses, which are still to be received, cannot be matched to the
+	 * requests anymore. */
+	rest = hs->pipeline;
+	hs->pipeline = NULL;
+
+	if (!(is_graceful && was_first) &&
+		(rest != NULL || hc->is_pipelined) &&
+		(hc->response->error != NULL || !hc->is_cancelling) &&
+		!hs->host->pipelining_disabled)
+	{
+		purple_debug_warning("http", "Pipelining to %s failed, falling "
+			"back to serial requests\n", hs->host->host);
+		hs->host->pipelining_disabled = TRUE;
+	}
+
+	purple_http_keepalive_pool_release(hs, TRUE);
+
+	for (it = rest; it != NULL; it = g_slist_next(it)) {
+		PurpleHttpConnection *pipelined_hc = it->data;
+
+		pipelined_hc->socket = NULL;
+		purple_http_conn_retry(pipelined_hc);
+	}
+	g_slist_free(rest);
+}
+
 static void  _purple_http_connected(PurpleHttpSocket *hs, const gchar *error, gpointer _hc)
 {
 	PurpleHttpConnection *hc = _hc;
@@ -1643,6 +1994,17 @@ static void  _purple_http_connected(PurpleHttpSocket *hs, const gchar *error, gp
 		return;
 	}
 
+	// NOTE: Added in purple-vk-plugin.
+	if (hs->pipeline != NULL) {
+		_purple_http_pipeline_attach(hs, hc);
+		return;
+	}
+	if (hc->can_pipeline && hs->host != NULL &&
+		!hs->host->pipelining_disabled)
+	{
+		hs->pipeline = g_slist_append(NULL, hc);
+	}
+
 	purple_http_socket_watch(hs, PURPLE_INPUT_WRITE, _purple_http_send, hc);
 }
 
@@ -1685,10 +2047,19 @@ static gboolean _purple_http_reconnect(PurpleHttpConnection *hc)
 		return FALSE;
 	}
 
+	// NOTE: Added in purple-vk-plugin.
+	hc->is_reading = FALSE;
+	hc->is_pipelined = FALSE;
+	hc->can_pipeline = hc->request->pipelining && hc->request->http11 &&
+		hc->request->contents_reader == NULL &&
+		hc->request->keepalive_pool != NULL &&
+		hc->request->keepalive_pool->pipeline_depth > 0;
+
 	if (hc->request->keepalive_pool != NULL) {
 		hc->socket_request = purple_http_keepalive_pool_request(
 			hc->request->keepalive_pool, hc->gc, url->host,
-			url->port, is_ssl, _purple_http_connected, hc);
+			url->port, is_ssl, hc->can_pipeline,
+			_purple_http_connected, hc);
 	} else {
 		hc->socket = purple_http_socket_connect_new(hc->gc, url->host,
 			url->port, is_ssl, _purple_http_connected, hc);
@@ -1815,6 +2186,23 @@ PurpleHttpConnection * purple_http_request(PurpleConnection *gc,
 	return hc;
 }
 
+void purple_http_request_fail(PurpleConnection *gc,
+	PurpleHttpRequest *request, const gchar *error,
+	PurpleHttpCallback callback, gpointer user_data)
+{
+	PurpleHttpConnection *hc;
+
+	g_return_if_fail(request != NULL);
+
+	hc = purple_http_connection_new(request, gc);
+	hc->callback = callback;
+	hc->user_data = user_data;
+	hc->response->code = 0;
+	hc->response->error = g_strdup(error);
+
+	purple_http_connection_terminate(hc);
+}
+
 /*** HTTP connection API ******************************************************/
 
 static void purple_http_connection_free(PurpleHttpConnection *hc);
@@ -1861,6 +2249,9 @@ static void purple_http_connection_free(PurpleHttpConnection *hc)
 	if (hc->contents_reader_buffer)
 		g_string_free(hc->contents_reader_buffer, TRUE);
 	purple_http_gz_free(hc->gz_stream);
+	g_free(hc->recv_buffer);
+	if (hc->gz_buffer)
+		g_string_free(hc->gz_buffer, TRUE);
 
 	if (hc->request_header)
 		g_string_free(hc->request_header, TRUE);
@@ -1941,14 +2332,23 @@ void purple_http_conn_cancel_all(PurpleConnection *gc)
 			"connections\n");
 	}
 
-	gc_list = g_hash_table_lookup(purple_http_hc_by_gc, gc);
-
 	g_hash_table_insert(purple_http_cancelling_gc, gc, GINT_TO_POINTER(TRUE));
 
-	while (gc_list) {
-		PurpleHttpConnection *hc = gc_list->data;
-		gc_list = g_list_next(gc_list);
-		purple_http_conn_cancel(hc);
+	// NOTE: Changed in purple-vk-plugin. Cancelling one connection may
+	// terminate others (e.g. the ones pipelined after it or waiting for
+	// the same keep-alive socket), which frees their list nodes. The list
+	// is looked up anew after each cancellation instead of keeping
+	// a pointer to the next node.
+	while (TRUE) {
+		gc_list = g_hash_table_lookup(purple_http_hc_by_gc, gc);
+		while (gc_list && ((PurpleHttpConnection *)gc_list->data)->
+			is_cancelling)
+		{
+			gc_list = g_list_next(gc_list);
+		}
+		if (gc_list == NULL)
+			break;
+		purple_http_conn_cancel(gc_list->data);
 	}
 
 	g_hash_table_remove(purple_http_cancelling_gc, gc);
@@ -1965,6 +2365,13 @@ gboolean purple_http_conn_is_running(PurpleHttpConnection *http_conn)
 	return (NULL != g_hash_table_lookup(purple_http_hc_by_ptr, http_conn));
 }
 
+gboolean purple_http_conn_is_cancelling(PurpleHttpConnection *http_conn)
+{
+	g_return_val_if_fail(http_conn != NULL, FALSE);
+
+	return http_conn->is_cancelling;
+}
+
 PurpleHttpRequest * purple_http_conn_get_request(PurpleHttpConnection *http_conn)
 {
 	g_return_val_if_fail(http_conn != NULL, NULL);
@@ -2357,23 +2764,14 @@ purple_http_keepalive_pool_unref(PurpleHttpKeepalivePool *pool)
 	return NULL;
 }
 
-static PurpleHttpKeepaliveRequest *
-purple_http_keepalive_pool_request(PurpleHttpKeepalivePool *pool,
-	PurpleConnection *gc, const gchar *host, int port, gboolean is_ssl,
-	PurpleHttpSocketConnectCb cb, gpointer user_data)
+// NOTE: Extracted from purple_http_keepalive_pool_request in purple-vk-plugin.
+static PurpleHttpKeepaliveHost *
+purple_http_keepalive_pool_get_host(PurpleHttpKeepalivePool *pool,
+	const gchar *host, int port, gboolean is_ssl)
 {
-	PurpleHttpKeepaliveRequest *req;
 	PurpleHttpKeepaliveHost *kahost;
 	gchar *hash;
 
-	g_return_val_if_fail(pool != NULL, NULL);
-	g_return_val_if_fail(host != NULL, NULL);
-
-	if (pool->is_destroying) {
-		purple_debug_error("http", "pool is destroying\n");
-		return NULL;
-	}
-
 	hash = purple_http_socket_hash(host, port, is_ssl);
 	kahost = g_hash_table_lookup(pool->by_hash, hash);
 
@@ -2389,11 +2787,33 @@ purple_http_keepalive_pool_request(PurpleHttpKeepalivePool *pool,
 
 	g_free(hash);
 
+	return kahost;
+}
+
+static PurpleHttpKeepaliveRequest *
+purple_http_keepalive_pool_request(PurpleHttpKeepalivePool *pool,
+	PurpleConnection *gc, const gchar *host, int port, gboolean is_ssl,
+	gboolean can_pipeline, PurpleHttpSocketConnectCb cb, gpointer user_data)
+{
+	PurpleHttpKeepaliveRequest *req;
+	PurpleHttpKeepaliveHost *kahost;
+
+	g_return_val_if_fail(pool != NULL, NULL);
+	g_return_val_if_fail(host != NULL, NULL);
+
+	if (pool->is_destroying) {
+		purple_debug_error("http", "pool is destroying\n");
+		return NULL;
+	}
+
+	kahost = purple_http_keepalive_pool_get_host(pool, host, port, is_ssl);
+
 	req = g_new0(PurpleHttpKeepaliveRequest, 1);
 	req->gc = gc;
 	req->cb = cb;
 	req->user_data = user_data;
 	req->host = kahost;
+	req->can_pipeline = can_pipeline;
 
 	kahost->queue = g_slist_append(kahost->queue, req);
 
@@ -2415,6 +2835,35 @@ _purple_http_keepalive_socket_connected(PurpleHttpSocket *hs,
 	g_free(req);
 }
 
+// NOTE: Added in purple-vk-plugin. Returns the busy socket, on which one more
+// request may be pipelined.
+static PurpleHttpSocket *
+purple_http_keepalive_host_find_pipeline(PurpleHttpKeepaliveHost *host)
+{
+	GSList *it;
+
+	if (host->pipelining_disabled || host->pool->pipeline_depth == 0)
+		return NULL;
+
+	for (it = host->sockets; it != NULL; it = g_slist_next(it)) {
+		PurpleHttpSocket *hs = it->data;
+		PurpleHttpConnection *last_hc;
+
+		if (hs->pipeline == NULL || !hs->pipeline_allowed)
+			continue;
+		if (g_slist_length(hs->pipeline) >= host->pool->pipeline_depth)
+			continue;
+		/* Requests must not be interleaved. */
+		last_hc = g_slist_last(hs->pipeline)->data;
+		if (!last_hc->is_reading)
+			continue;
+
+		return hs;
+	}
+
+	return NULL;
+}
+
 static gboolean
 _purple_http_keepalive_host_process_queue_cb(gpointer _host)
 {
@@ -2423,6 +2872,7 @@ _purple_http_keepalive_host_process_queue_cb(gpointer _host)
 	PurpleHttpSocket *hs = NULL;
 	GSList *it;
 	guint sockets_count;
+	gboolean prewarming;
 
 	g_return_val_if_fail(host != NULL, FALSE);
 
@@ -2432,11 +2882,13 @@ _purple_http_keepalive_host_process_queue_cb(gpointer _host)
 		return FALSE;
 
 	sockets_count = 0;
+	prewarming = FALSE;
 	it = host->sockets;
 	while (it != NULL) {
 		PurpleHttpSocket *hs_current = it->data;
 
 		sockets_count++;
+		prewarming = prewarming || hs_current->is_prewarming;
 
 		if (!hs_current->is_busy) {
 			hs = hs_current;
@@ -2446,6 +2898,13 @@ _purple_http_keepalive_host_process_queue_cb(gpointer _host)
 		it = g_slist_next(it);
 	}
 
+	req = host->queue->data;
+
+	// NOTE: Added in purple-vk-plugin. Pipelining on an established
+	// connection is preferred to opening a new one.
+	if (hs == NULL && req->can_pipeline)
+		hs = purple_http_keepalive_host_find_pipeline(host);
+
 	/* There are no free sockets and we cannot create another one. */
 	if (hs == NULL && sockets_count >= host->pool->limit_per_host &&
 		host->pool->limit_per_host > 0)
@@ -2453,7 +2912,11 @@ _purple_http_keepalive_host_process_queue_cb(gpointer _host)
 		return FALSE;
 	}
 
-	req = host->queue->data;
+	// NOTE: Added in purple-vk-plugin. The pre-warmed socket will be ready
+	// sooner than a new one.
+	if (hs == NULL && prewarming)
+		return FALSE;
+
 	host->queue = g_slist_remove(host->queue, req);
 
 	if (hs != NULL) {
@@ -2533,6 +2996,7 @@ purple_http_keepalive_pool_release(PurpleHttpSocket *hs, gboolean invalidate)
 
 	purple_http_socket_dontwatch(hs);
 	hs->is_busy = FALSE;
+	hs->released_time = g_get_monotonic_time();
 	host = hs->host;
 
 	if (host == NULL) {
@@ -2565,6 +3029,115 @@ purple_http_keepalive_pool_get_limit_per_host(PurpleHttpKeepalivePool *pool)
 	return pool->limit_per_host;
 }
 
+static void
+_purple_http_keepalive_socket_prewarmed(PurpleHttpSocket *hs,
+	const gchar *error, gpointer _host)
+{
+	PurpleHttpKeepaliveHost *host = _host;
+
+	hs->is_prewarming = FALSE;
+
+	if (error != NULL) {
+		purple_debug_warning("http", "Unable to pre-warm connection to "
+			"%s: %s\n", host->host, error);
+		host->sockets = g_slist_remove(host->sockets, hs);
+		purple_http_socket_close_free(hs);
+		purple_http_keepalive_host_process_queue(host);
+		return;
+	}
+
+	if (purple_debug_is_verbose())
+		purple_debug_misc("http", "pre-warmed socket: %p\n", hs);
+
+	/* The server may close the socket before it is used, so the first
+	 * request on it must be retried in this case, just like on a reused
+	 * socket. */
+	hs->use_count++;
+	purple_http_keepalive_pool_release(hs, FALSE);
+}
+
+void
+purple_http_keepalive_pool_prewarm(PurpleHttpKeepalivePool *pool,
+	PurpleConnection *gc, const gchar *url)
+{
+	PurpleHttpURL *parsed_url;
+	PurpleHttpKeepaliveHost *kahost;
+	PurpleHttpSocket *hs;
+	GSList *it;
+	gboolean is_ssl;
+
+	g_return_if_fail(pool != NULL);
+	g_return_if_fail(url != NULL);
+
+	if (pool->is_destroying)
+		return;
+
+	parsed_url = purple_http_url_parse(url);
+	if (parsed_url == NULL || parsed_url->host == NULL ||
+		parsed_url->host[0] == '\0')
+	{
+		purple_debug_error("http", "Invalid URL to pre-warm.\n");
+		purple_http_url_free(parsed_url);
+		return;
+	}
+
+	is_ssl = (g_ascii_strcasecmp(parsed_url->protocol, "https") == 0);
+	kahost = purple_http_keepalive_pool_get_host(pool, parsed_url->host,
+		parsed_url->port, is_ssl);
+	purple_http_url_free(parsed_url);
+
+	/* The server has most likely closed the sockets, which have been idle
+	 * for long, drop them so that the new one is opened. */
+	it = kahost->sockets;
+	while (it != NULL) {
+		PurpleHttpSocket *idle_hs = it->data;
+		it = g_slist_next(it);
+
+		if (idle_hs->is_busy || g_get_monotonic_time() -
+			idle_hs->released_time <
+			PURPLE_HTTP_KEEPALIVE_PREWARM_MAX_IDLE * G_USEC_PER_SEC)
+		{
+			continue;
+		}
+
+		if (purple_debug_is_verbose())
+			purple_debug_misc("http", "dropping idle socket: %p\n",
+				idle_hs);
+		kahost->sockets = g_slist_remove(kahost->sockets, idle_hs);
+		purple_http_socket_close_free(idle_hs);
+	}
+
+	/* Either there is a connection already, or a request is going to open
+	 * one. */
+	if (kahost->sockets != NULL || kahost->queue != NULL)
+		return;
+
+	hs = purple_http_socket_connect_new(gc, kahost->host, kahost->port,
+		is_ssl, _purple_http_keepalive_socket_prewarmed, kahost);
+	if (hs == NULL) {
+		purple_debug_warning("http", "Unable to pre-warm connection to "
+			"%s\n", kahost->host);
+		return;
+	}
+
+	if (purple_debug_is_verbose())
+		purple_debug_misc("http", "pre-warming socket: %p\n", hs);
+
+	hs->is_busy = TRUE;
+	hs->is_prewarming = TRUE;
+	hs->host = kahost;
+	kahost->sockets = g_slist_append(kahost->sockets, hs);
+}
+
+void
+purple_http_keepalive_pool_set_pipeline_depth(PurpleHttpKeepalivePool *pool,
+	guint depth)
+{
+	g_return_if_fail(pool != NULL);
+
+	pool->pipeline_depth = depth;
+}
+
 /*** HTTP connection set API **************************************************/
 
 PurpleHttpConnectionSet *
@@ -2877,6 +3450,14 @@ void purple_http_request_set_http11(PurpleHttpRequest *request, gboolean http11)
 	request->http11 = http11;
 }
 
+void purple_http_request_set_pipelining(PurpleHttpRequest *request,
+	gboolean pipelining)
+{
+	g_return_if_fail(request != NULL);
+
+	request->pipelining = pipelining;
+}
+
 gboolean purple_http_request_is_http11(PurpleHttpRequest *request)
 {
 	g_return_val_if_fail(request != NULL, FALSE);
@@ -3034,6 +3615,26 @@ const gchar * purple_http_response_get_data(PurpleHttpResponse *response, size_t
 	return ret;
 }
 
+gchar * purple_http_response_steal_data(PurpleHttpResponse *response, size_t *len)
+{
+	gchar *ret;
+
+	g_return_val_if_fail(response != NULL, NULL);
+
+	if (response->contents == NULL) {
+		if (len)
+			*len = 0;
+		return g_strdup("");
+	}
+
+	if (len)
+		*len = response->contents->len;
+	ret = g_string_free(response->contents, FALSE);
+	response->contents = NULL;
+
+	return ret;
+}
+
 const GList * purple_http_response_get_all_headers(PurpleHttpResponse *response)
 {
 	g_return_val_if_fail(response != NULL, NULL);
@@ -179,6 +179,22 @@ PurpleHttpConnection * purple_http_request(PurpleConnection *gc,
 	PurpleHttpRequest *request, PurpleHttpCallback callback,
 	gpointer user_data);
 
+/**
+ * Fails a HTTP request without connecting anywhere. The callback is called
+ * immediately with an unsuccessful response, containing the error.
+ *
+ * NOTE: Added in purple-vk-plugin.
+ *
+ * @param gc        The connection for which the request is needed, or NULL.
+ * @param request   The request.
+ * @param error     The error message.
+ * @param callback  The callback function.
+ * @param user_data The user data to pass to the callback function.
+ */
+void purple_http_request_fail(PurpleConnection *gc,
+	PurpleHttpRequest *request, const gchar *error,
+	PurpleHttpCallback callback, gpointer user_data);
+
 /**************************************************************************/
 /** @name HTTP connection API                                             */
 /**************************************************************************/
@@ -206,6 +222,18 @@ void purple_http_conn_cancel_all(PurpleConnection *gc);
  */
 gboolean purple_http_conn_is_running(PurpleHttpConnection *http_conn);
 
+/**
+ * Checks, if provided HTTP request has been cancelled with
+ * purple_http_conn_cancel. Such requests finish with response code 0, just
+ * like the ones, which have failed because of network errors.
+ *
+ * NOTE: Added in purple-vk-plugin.
+ *
+ * @param http_conn The HTTP connection.
+ * @return          TRUE, if the request has been cancelled.
+ */
+gboolean purple_http_conn_is_cancelling(PurpleHttpConnection *http_conn);
+
 /**
  * Gets PurpleHttpRequest used for specified HTTP connection.
  *
@@ -622,6 +650,21 @@ void purple_http_request_set_http11(PurpleHttpRequest *request,
  */
 gboolean purple_http_request_is_http11(PurpleHttpRequest *request);
 
+/**
+ * Allows sending the request over a keep-alive connection before the responses
+ * to the previous requests are received (see
+ * purple_http_keepalive_pool_set_pipeline_depth). The request may be sent again
+ * if the pipeline breaks, so only the requests, which can be safely repeated,
+ * should be pipelined.
+ *
+ * NOTE: Added in purple-vk-plugin.
+ *
+ * @param request    The request.
+ * @param pipelining TRUE, if the request may be pipelined.
+ */
+void purple_http_request_set_pipelining(PurpleHttpRequest *request,
+	gboolean pipelining);
+
 /**
  * Sets maximum length of response content to read.
  *
@@ -729,6 +772,37 @@ purple_http_keepalive_pool_set_limit_per_host(PurpleHttpKeepalivePool *pool,
 guint
 purple_http_keepalive_pool_get_limit_per_host(PurpleHttpKeepalivePool *pool);
 
+/**
+ * Opens a connection to the host of the URL in advance, so that the next
+ * request to it does not wait for DNS lookup and TCP and TLS handshakes. Does
+ * nothing if the pool already has a connection to the host, which has been
+ * used recently. The connections, which have been idle for long, are dropped,
+ * because the server has most likely closed them.
+ *
+ * NOTE: Added in purple-vk-plugin.
+ *
+ * @param pool The HTTP Keep-Alive pool.
+ * @param gc   The connection for which the request is needed, or NULL.
+ * @param url  The URL, only the protocol, host and port are used.
+ */
+void
+purple_http_keepalive_pool_prewarm(PurpleHttpKeepalivePool *pool,
+	PurpleConnection *gc, const gchar *url);
+
+/**
+ * Sets maximum number of pipelined requests, which may wait for responses on
+ * one connection. The host falls back to sending requests serially if it
+ * breaks the pipeline.
+ *
+ * NOTE: Added in purple-vk-plugin.
+ *
+ * @param pool  The HTTP Keep-Alive pool.
+ * @param depth The new maximum, 0 disables pipelining (default).
+ */
+void
+purple_http_keepalive_pool_set_pipeline_depth(PurpleHttpKeepalivePool *pool,
+	guint depth);
+
 /*@}*/
 
 
@@ -798,6 +872,18 @@ gsize purple_http_response_get_data_len(PurpleHttpResponse *response);
  */
 const gchar * purple_http_response_get_data(PurpleHttpResponse *response, size_t *len);
 
+/**
+ * Takes HTTP response data without copying it. The response contains no data
+ * afterwards.
+ *
+ * NOTE: Added in purple-vk-plugin.
+ *
+ * @param response The response.
+ * @param len      Return address for the size of the data.  Can be NULL.
+ * @return         The data, which must be g_free'd.
+ */
+gchar * purple_http_response_steal_data(PurpleHttpResponse *response, size_t *len);
+
 /**
  * Gets all headers got with response.
  *
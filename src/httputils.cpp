@@ -1,47 +1,217 @@
+#include <algorithm>
+#include <cstring>
+#include <random>
+
 #include "vk-common.h"
 
 #include "httputils.h"
 #include "miscutils.h"
 
-PurpleHttpConnection* http_get(PurpleConnection* gc, const string& url, const HttpCallback& callback)
+PurpleHttpConnection* http_get(PurpleConnection* gc, const string& url, const HttpCallback& callback,
+                               VkHttpPool pool)
 {
     PurpleHttpRequest* request = purple_http_request_new(url.data());
-    PurpleHttpConnection* hc = http_request(gc, request, callback);
-    if (!hc)
-        return nullptr;
+    PurpleHttpConnection* hc = http_request(gc, request, callback, pool);
     purple_http_request_unref(request);
     return hc;
 }
 
+// Circuit breaker for one host. After BREAKER_FAILURE_THRESHOLD consecutive failed requests
+// the breaker opens and all requests to the host fail immediately for BREAKER_OPEN_TIME. After
+// that one probe request is sent: the breaker closes if it succeeds and opens again otherwise.
+// If the probe does not report back during BREAKER_PROBE_TIMEOUT, another probe is sent.
+struct HttpCircuitBreaker
+{
+    enum State {
+        CLOSED,
+        OPEN,
+        // The probe request is running.
+        HALF_OPEN
+    };
+
+    State state = CLOSED;
+    unsigned failures = 0;
+    steady_time_point open_until;
+    // The time, after which the running probe is considered lost.
+    steady_time_point probe_until;
+};
+
+struct HttpCircuitBreakers
+{
+    map<string, HttpCircuitBreaker> hosts;
+};
+
 namespace
 {
 
 struct HttpUserData
 {
     HttpCallback callback;
+    string host;
     int retries;
+    // True if this request is a probe for the open circuit breaker.
+    bool is_probe;
 };
 
 const int MAX_HTTP_RETRIES = 3;
+// The delay before the first retry in milliseconds, doubled with each following retry.
+const unsigned HTTP_RETRY_BASE_DELAY = 1000;
+
+// The number of consecutive failed requests to the host, after which the circuit breaker opens.
+const unsigned BREAKER_FAILURE_THRESHOLD = 5;
+// The time in seconds, during which the requests to the host fail immediately.
+const int BREAKER_OPEN_TIME = 30;
+// The time in seconds, during which we wait for the probe request. It is a bit longer than
+// the default timeout of HTTP requests.
+const int BREAKER_PROBE_TIMEOUT = 45;
+
+// Returns the delay in milliseconds before the retry. Half of the delay is random, so that
+// the requests, which failed at the same time, do not get retried at the same time too.
+unsigned get_retry_delay(int retries)
+{
+    static std::random_device rd;
+    static std::default_random_engine re(rd());
+
+    unsigned delay = HTTP_RETRY_BASE_DELAY << retries;
+    std::uniform_int_distribution<unsigned> jitter(0, delay / 2);
+    return delay / 2 + jitter(re);
+}
+
+string get_url_host(const char* url)
+{
+    PurpleHttpURL* parsed_url = purple_http_url_parse(url);
+    if (!parsed_url)
+        return string();
+    const char* host = purple_http_url_get_host(parsed_url);
+    string ret = host ? host : "";
+    purple_http_url_free(parsed_url);
+    return ret;
+}
+
+HttpCircuitBreaker& get_breaker(PurpleConnection* gc, const string& host)
+{
+    VkData& gc_data = get_data(gc);
+    if (!gc_data.http_circuit_breakers)
+        gc_data.http_circuit_breakers.reset(new HttpCircuitBreakers());
+    return gc_data.http_circuit_breakers->hosts[host];
+}
+
+// Returns true if the request to the host may be sent. Sets is_probe if the request must be
+// the probe request.
+bool breaker_allows_request(PurpleConnection* gc, const string& host, bool& is_probe)
+{
+    HttpCircuitBreaker& breaker = get_breaker(gc, host);
+    is_probe = false;
+    switch (breaker.state) {
+    case HttpCircuitBreaker::CLOSED:
+        return true;
+    case HttpCircuitBreaker::OPEN:
+        if (steady_clock::now() < breaker.open_until)
+            return false;
+        vkcom_debug_info("Circuit breaker for %s is half-open, sending probe request\n", host.data());
+        breaker.state = HttpCircuitBreaker::HALF_OPEN;
+        breaker.probe_until = steady_clock::now() + std::chrono::seconds(BREAKER_PROBE_TIMEOUT);
+        is_probe = true;
+        return true;
+    case HttpCircuitBreaker::HALF_OPEN:
+        // The probe may have been cancelled or lost, so it never reports back.
+        if (steady_clock::now() < breaker.probe_until)
+            return false;
+        vkcom_debug_info("Probe request for %s has not finished in time, sending another one\n",
+                         host.data());
+        breaker.probe_until = steady_clock::now() + std::chrono::seconds(BREAKER_PROBE_TIMEOUT);
+        is_probe = true;
+        return true;
+    }
+    return true;
+}
+
+// Updates the circuit breaker with the result of the request.
+void breaker_report_result(PurpleConnection* gc, const string& host, bool success, bool is_probe)
+{
+    HttpCircuitBreaker& breaker = get_breaker(gc, host);
+    if (success) {
+        if (breaker.state != HttpCircuitBreaker::CLOSED)
+            vkcom_debug_info("Circuit breaker for %s is closed\n", host.data());
+        breaker.state = HttpCircuitBreaker::CLOSED;
+        breaker.failures = 0;
+        return;
+    }
+
+    breaker.failures++;
+    if (is_probe || (breaker.state == HttpCircuitBreaker::CLOSED
+                     && breaker.failures >= BREAKER_FAILURE_THRESHOLD)) {
+        vkcom_debug_error("Circuit breaker for %s is open after %d failed requests, failing "
+                          "all requests for %d seconds\n", host.data(), breaker.failures,
+                          BREAKER_OPEN_TIME);
+        breaker.state = HttpCircuitBreaker::OPEN;
+        breaker.open_until = steady_clock::now() + std::chrono::seconds(BREAKER_OPEN_TIME);
+    }
+}
+
+// Returns true if the callback must not be called, because the connection is being closed.
+// All running requests are cancelled upon logout and the callbacks must not run then: they may
+// access the data, which is being destroyed, or show errors for the connection, which no longer
+// exists. Everything captured by the callback is released along with HttpUserData.
+bool is_callback_suppressed(PurpleConnection* gc)
+{
+    return get_data(gc).is_closing();
+}
+
+// Callback helper for the requests, failed by the circuit breaker.
+void http_fail_cb(PurpleHttpConnection* http_conn, PurpleHttpResponse* response, void* user_data)
+{
+    HttpUserData* data = (HttpUserData*)user_data;
+    if (!is_callback_suppressed(purple_http_conn_get_purple_connection(http_conn)))
+        data->callback(http_conn, response);
+    delete data;
+}
 
 // Callback helper for http_request.
+void http_cb(PurpleHttpConnection* http_conn, PurpleHttpResponse* response, void* user_data);
+
+// Either sends the request or fails it if the circuit breaker for the host is open. The latter
+// calls the callback immediately.
+void send_or_fail_request(PurpleConnection* gc, PurpleHttpRequest* request, HttpUserData* data)
+{
+    if (breaker_allows_request(gc, data->host, data->is_probe))
+        purple_http_request(gc, request, http_cb, data);
+    else
+        purple_http_request_fail(gc, request, "Host is unavailable", http_fail_cb, data);
+}
+
 void http_cb(PurpleHttpConnection* http_conn, PurpleHttpResponse* response, void* user_data)
 {
     HttpUserData* data = (HttpUserData*)user_data;
     PurpleConnection* gc = purple_http_conn_get_purple_connection(http_conn);
+    if (is_callback_suppressed(gc)) {
+        delete data;
+        return;
+    }
+
+    // Cancelled requests say nothing about the host and must not be retried.
+    if (purple_http_conn_is_cancelling(http_conn)) {
+        data->callback(http_conn, response);
+        delete data;
+        return;
+    }
+
     int response_code = purple_http_response_get_code(response);
-    if ((response_code == 0 || response_code >= 500) && data->retries < MAX_HTTP_RETRIES
-            && !get_data(gc).is_closing()) {
-        vkcom_debug_error("HTTP error %d, retrying %d time\n",
-                           purple_http_response_get_code(response), data->retries + 1);
+    bool failed = response_code == 0 || response_code >= 500;
+    breaker_report_result(gc, data->host, !failed, data->is_probe);
+
+    if (failed && data->retries < MAX_HTTP_RETRIES) {
+        unsigned delay = get_retry_delay(data->retries);
+        vkcom_debug_error("HTTP error %d, retrying %d time in %d msec\n", response_code,
+                          data->retries + 1, delay);
 
         // We've got a network error or Vk.com server error and have not given up retrying.
         PurpleHttpRequest* request = purple_http_conn_get_request(http_conn);
         // Reference the request, so that it does not die with http_conn
         purple_http_request_ref(request);
-        timeout_add(gc, 1000, [=] {
+        timeout_add(gc, delay, [=] {
             data->retries++;
-            purple_http_request(gc, request, http_cb, data);
+            send_or_fail_request(gc, request, data);
             purple_http_request_unref(request);
             return false;
         });
@@ -54,7 +224,7 @@ void http_cb(PurpleHttpConnection* http_conn, PurpleHttpResponse* response, void
 } // End anonymous namespace
 
 PurpleHttpConnection* http_request(PurpleConnection* gc, PurpleHttpRequest* request,
-                                   const HttpCallback& callback)
+                                   const HttpCallback& callback, VkHttpPool pool)
 {
     VkData& gc_data = get_data(gc);
     if (gc_data.is_closing()) {
@@ -62,10 +232,25 @@ PurpleHttpConnection* http_request(PurpleConnection* gc, PurpleHttpRequest* requ
         return nullptr;
     }
 
-    purple_http_request_set_keepalive_pool(request, gc_data.get_keepalive_pool());
+    purple_http_request_set_keepalive_pool(request, gc_data.get_keepalive_pool(pool));
     HttpUserData* data = new HttpUserData();
     data->callback = callback;
+    data->host = get_url_host(purple_http_request_get_url(request));
     data->retries = 0;
+    data->is_probe = false;
+
+    if (!breaker_allows_request(gc, data->host, data->is_probe)) {
+        vkcom_debug_info("Circuit breaker for %s is open, failing request\n", data->host.data());
+        // The callback must not be called before we return.
+        purple_http_request_ref(request);
+        timeout_add(gc, 0, [=] {
+            purple_http_request_fail(gc, request, "Host is unavailable", http_fail_cb, data);
+            purple_http_request_unref(request);
+            return false;
+        });
+        return nullptr;
+    }
+
     PurpleHttpConnection* hc = purple_http_request(gc, request, http_cb, data);
     return hc;
 }
@@ -73,35 +258,266 @@ PurpleHttpConnection* http_request(PurpleConnection* gc, PurpleHttpRequest* requ
 namespace
 {
 
-// A helper callback for purple_http_request_update_on_redirect. TODO: check for infinite loops.
-void http_request_redirect_cb(PurpleHttpConnection* http_conn, PurpleHttpResponse* response,
-                              const HttpCallback& callback)
+// Response writer for http_request_streaming.
+gboolean http_chunk_writer(PurpleHttpConnection*, PurpleHttpResponse* response, const gchar* buffer,
+                           size_t offset, size_t length, gpointer user_data)
 {
-    if (purple_http_response_get_code(response) == 302) {
-        PurpleConnection* gc = purple_http_conn_get_purple_connection(http_conn);
-        PurpleHttpRequest* request = purple_http_conn_get_request(http_conn);
-        const char* new_url = purple_http_response_get_header(response, "Location");
-        purple_http_request_set_url(request, new_url);
-        http_request(gc, request, [=](PurpleHttpConnection* new_http_conn, PurpleHttpResponse* new_response) {
-            http_request_redirect_cb(new_http_conn, new_response, callback);
+    // Bodies of redirects and error pages are not interesting.
+    if (purple_http_response_get_code(response) != 200)
+        return TRUE;
+
+    const HttpChunkCallback& chunk_cb = *(const HttpChunkCallback*)user_data;
+    // offset is the length of the body received so far, including this chunk.
+    return chunk_cb(buffer, length, offset == length);
+}
+
+} // End anonymous namespace
+
+PurpleHttpConnection* http_request_streaming(PurpleConnection* gc, PurpleHttpRequest* request,
+                                             const HttpChunkCallback& chunk_cb,
+                                             const HttpCallback& callback, VkHttpPool pool)
+{
+    // The writer must live as long as the request may be retried, i.e. until the final callback.
+    shared_ptr<HttpChunkCallback> writer_cb(new HttpChunkCallback(chunk_cb));
+    purple_http_request_set_response_writer(request, http_chunk_writer, writer_cb.get());
+    return http_request(gc, request,
+    [writer_cb, callback](PurpleHttpConnection* http_conn, PurpleHttpResponse* response) {
+        purple_http_request_set_response_writer(purple_http_conn_get_request(http_conn), nullptr, nullptr);
+        callback(http_conn, response);
+    }, pool);
+}
+
+void http_request_detached(PurpleConnection* gc, PurpleHttpRequest* request, int timeout,
+                           VkHttpPool pool)
+{
+    // The request holds a reference to the pool, so the keep-alive connection outlives VkData.
+    purple_http_request_set_keepalive_pool(request, get_data(gc).get_keepalive_pool(pool));
+    purple_http_request_set_timeout(request, timeout);
+    // Without gc the request uses the global proxy settings if it has to open a new connection.
+    purple_http_request(nullptr, request, nullptr, nullptr);
+}
+
+// Redirects, which are known to be stable, mapped from the original URL to the location.
+struct HttpRedirectCache
+{
+    struct Entry
+    {
+        string location;
+        steady_time_point expires;
+    };
+
+    map<string, Entry> entries;
+};
+
+namespace
+{
+
+// The maximum number of redirects, which are followed for one request.
+const size_t MAX_REDIRECTS = 10;
+// The maximum number of cached redirects.
+const size_t REDIRECT_CACHE_SIZE = 32;
+// The time in seconds, during which permanent redirects without explicit max-age are reused.
+const int PERMANENT_REDIRECT_CACHE_TIME = 60 * 60;
+// The maximum time in seconds, during which any redirect is reused.
+const int MAX_REDIRECT_CACHE_TIME = 24 * 60 * 60;
+
+// URLs, which have been requested while following the redirects for one request.
+typedef shared_ptr<set<string>> VisitedUrls;
+
+HttpRedirectCache& get_redirect_cache(PurpleConnection* gc)
+{
+    VkData& gc_data = get_data(gc);
+    if (!gc_data.http_redirect_cache)
+        gc_data.http_redirect_cache.reset(new HttpRedirectCache());
+    return *gc_data.http_redirect_cache;
+}
+
+bool is_redirect(int code)
+{
+    return code == 301 || code == 302 || code == 303 || code == 307 || code == 308;
+}
+
+// Returns the time in seconds, during which the redirect may be reused, or zero if it must
+// not be cached.
+int redirect_cache_time(PurpleHttpRequest* request, PurpleHttpResponse* response)
+{
+    // Redirects in response to POST depend on the submitted data (e.g. the login form).
+    const char* method = purple_http_request_get_method(request);
+    if (method && strcmp(method, "GET") != 0)
+        return 0;
+
+    const char* cache_control = purple_http_response_get_header(response, "Cache-Control");
+    if (cache_control) {
+        string value = str_lowered(cache_control);
+        if (value.find("no-store") != string::npos || value.find("no-cache") != string::npos
+                || value.find("private") != string::npos)
+            return 0;
+        size_t max_age = value.find("max-age=");
+        if (max_age != string::npos)
+            return std::min(atoi(value.data() + max_age + 8), MAX_REDIRECT_CACHE_TIME);
+    }
+
+    // Permanent redirects may be cached by default, temporary ones only if explicitly allowed.
+    int code = purple_http_response_get_code(response);
+    if (code == 301 || code == 308)
+        return PERMANENT_REDIRECT_CACHE_TIME;
+    return 0;
+}
+
+void store_redirect(PurpleConnection* gc, const string& url, const string& location, int cache_time)
+{
+    HttpRedirectCache& cache = get_redirect_cache(gc);
+    steady_time_point now = steady_clock::now();
+
+    erase_if(cache.entries, [=](const pair<const string, HttpRedirectCache::Entry>& p) {
+        return p.second.expires <= now;
+    });
+    // Evict the entry, which expires first.
+    if (cache.entries.size() >= REDIRECT_CACHE_SIZE && !contains(cache.entries, url)) {
+        auto oldest = std::min_element(cache.entries.begin(), cache.entries.end(),
+                                       [](const pair<const string, HttpRedirectCache::Entry>& a,
+                                          const pair<const string, HttpRedirectCache::Entry>& b) {
+            return a.second.expires < b.second.expires;
         });
-    } else {
+        cache.entries.erase(oldest);
+    }
+
+    HttpRedirectCache::Entry& entry = cache.entries[url];
+    entry.location = location;
+    entry.expires = now + std::chrono::seconds(cache_time);
+}
+
+// Follows the cached redirects, starting from url, and returns the final location. All the URLs
+// along the way are added to visited.
+string find_cached_location(PurpleConnection* gc, const string& url, set<string>& visited)
+{
+    HttpRedirectCache& cache = get_redirect_cache(gc);
+    steady_time_point now = steady_clock::now();
+
+    string location = url;
+    visited.insert(location);
+    while (visited.size() <= MAX_REDIRECTS) {
+        auto it = cache.entries.find(location);
+        if (it == cache.entries.end() || it->second.expires <= now)
+            break;
+        // Cached redirects should never loop, but let's be safe.
+        if (contains(visited, it->second.location)) {
+            cache.entries.erase(it);
+            break;
+        }
+        location = it->second.location;
+        visited.insert(location);
+    }
+    return location;
+}
+
+// Returns the absolute URL for the location, which may be relative to base_url.
+string resolve_location(const char* base_url, const char* location)
+{
+    if (strstr(location, "://"))
+        return location;
+
+    PurpleHttpURL* url = purple_http_url_parse(base_url);
+    PurpleHttpURL* relative_url = purple_http_url_parse(location);
+    string ret = location;
+    if (url && relative_url) {
+        purple_http_url_relative(url, relative_url);
+        char* url_str = purple_http_url_print(url);
+        ret = url_str;
+        g_free(url_str);
+    }
+    if (url)
+        purple_http_url_free(url);
+    if (relative_url)
+        purple_http_url_free(relative_url);
+    return ret;
+}
+
+// Switches the request to GET without body if the redirect requires it. Browsers re-issue
+// the request as GET for 303 and, for historical reasons, for 301 and 302 after POST (e.g.
+// the login form), only 307 and 308 repeat the request as is.
+void update_method_on_redirect(PurpleHttpRequest* request, int code)
+{
+    const char* method = purple_http_request_get_method(request);
+    if (!method)
+        method = "GET";
+    bool is_post = g_ascii_strcasecmp(method, "POST") == 0;
+    bool is_head = g_ascii_strcasecmp(method, "HEAD") == 0;
+    bool change_to_get = (code == 303 && !is_head) || ((code == 301 || code == 302) && is_post);
+    if (!change_to_get || g_ascii_strcasecmp(method, "GET") == 0)
+        return;
+
+    vkcom_debug_info("Changing %s to GET after redirect %d\n", method, code);
+    purple_http_request_set_method(request, "GET");
+    purple_http_request_set_contents(request, nullptr, 0);
+    purple_http_request_header_set(request, "Content-Type", nullptr);
+    purple_http_request_header_set(request, "Content-Length", nullptr);
+}
+
+// A helper callback for purple_http_request_update_on_redirect.
+void http_request_redirect_cb(PurpleHttpConnection* http_conn, PurpleHttpResponse* response,
+                              const HttpCallback& callback, const VisitedUrls& visited,
+                              VkHttpPool pool)
+{
+    const char* location = purple_http_response_get_header(response, "Location");
+    int code = purple_http_response_get_code(response);
+    if (!is_redirect(code) || !location) {
+        callback(http_conn, response);
+        return;
+    }
+
+    PurpleConnection* gc = purple_http_conn_get_purple_connection(http_conn);
+    PurpleHttpRequest* request = purple_http_conn_get_request(http_conn);
+    string url = purple_http_request_get_url(request);
+    string new_url = resolve_location(url.data(), location);
+    // The caller receives the redirect response itself if we go in circles.
+    if (contains(*visited, new_url) || visited->size() > MAX_REDIRECTS) {
+        vkcom_debug_error("Redirect loop detected at %s\n", url.data());
         callback(http_conn, response);
+        return;
     }
+    visited->insert(new_url);
+
+    int cache_time = redirect_cache_time(request, response);
+    if (cache_time > 0)
+        store_redirect(gc, url, new_url, cache_time);
+
+    purple_http_request_set_url(request, new_url.data());
+    update_method_on_redirect(request, code);
+    http_request(gc, request, [=](PurpleHttpConnection* new_http_conn, PurpleHttpResponse* new_response) {
+        http_request_redirect_cb(new_http_conn, new_response, callback, visited, pool);
+    }, pool);
 }
 
 } // End anonymous namespace
 
 PurpleHttpConnection* http_request_update_on_redirect(PurpleConnection* gc, PurpleHttpRequest* request,
-                                                      const HttpCallback& callback)
+                                                      const HttpCallback& callback, VkHttpPool pool)
 {
     purple_http_request_set_max_redirects(request, 0);
 
+    // Go straight to the final location if the redirects are known.
+    VisitedUrls visited{ new set<string>() };
+    string url = purple_http_request_get_url(request);
+    string location = find_cached_location(gc, url, *visited);
+    if (location != url) {
+        vkcom_debug_info("Using cached redirect from %s to %s\n", url.data(), location.data());
+        purple_http_request_set_url(request, location.data());
+    }
+
     return http_request(gc, request, [=](PurpleHttpConnection* http_conn, PurpleHttpResponse* response) {
-        http_request_redirect_cb(http_conn, response, callback);
-    });
+        http_request_redirect_cb(http_conn, response, callback, visited, pool);
+    }, pool);
 }
 
+void http_prewarm(PurpleConnection* gc, const string& url, VkHttpPool pool)
+{
+    VkData& gc_data = get_data(gc);
+    if (gc_data.is_closing())
+        return;
+
+    purple_http_keepalive_pool_prewarm(gc_data.get_keepalive_pool(pool), gc, url.data());
+}
 
 void http_request_copy_cookie_jar(PurpleHttpRequest* target, PurpleHttpConnection* source_conn)
 {
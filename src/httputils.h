@@ -8,19 +8,65 @@
 
 typedef function_ptr<void(PurpleHttpConnection *http_conn, PurpleHttpResponse *response)> HttpCallback;
 
+// Classes of HTTP traffic. Each class has its own keep-alive pool and limit of connections
+// per host, so that e.g. downloading a lot of buddy icons does not delay API calls or
+// the long poll.
+enum VkHttpPool {
+    // API calls and authentication.
+    VK_HTTP_POOL_API,
+    // Long poll requests, which may hang for up to 25 seconds.
+    VK_HTTP_POOL_LONG_POLL,
+    // Buddy icons, photos, thumbnails and captchas.
+    VK_HTTP_POOL_MEDIA,
+    // Uploading files to upload servers.
+    VK_HTTP_POOL_UPLOAD,
+
+    VK_HTTP_POOL_COUNT
+};
+
 // Utility function: run purple_http_get with keep-alive pool and add to connection set.
-PurpleHttpConnection* http_get(PurpleConnection *gc, const string& url, const HttpCallback& callback);
+PurpleHttpConnection* http_get(PurpleConnection *gc, const string& url, const HttpCallback& callback,
+                               VkHttpPool pool = VK_HTTP_POOL_API);
 
 // Utility function: run purple_http_get with keep-alive pool and add to connection set.
+// The callback is not called for the requests, which are cancelled upon logout, so it must not
+// be the only owner of any resources: they should be held by the captured objects (which are
+// destroyed either way) or released upon closing the connection.
 PurpleHttpConnection* http_request(PurpleConnection* gc, PurpleHttpRequest* request,
-                                   const HttpCallback& callback);
+                                   const HttpCallback& callback, VkHttpPool pool = VK_HTTP_POOL_API);
+
+// Callback, which receives the body of the successful response in chunks as soon as they arrive.
+// The chunks are already decompressed. restart is true for the first chunk of the body: if
+// the request is retried, the body is received anew. Returning false aborts the request.
+typedef function_ptr<bool(const char* data, size_t len, bool restart)> HttpChunkCallback;
+
+// Same as http_request, but passes the response body to chunk_cb instead of storing it, so
+// that it can be processed while the rest of the response is still being received. The body
+// is not available in callback.
+PurpleHttpConnection* http_request_streaming(PurpleConnection* gc, PurpleHttpRequest* request,
+                                             const HttpChunkCallback& chunk_cb,
+                                             const HttpCallback& callback,
+                                             VkHttpPool pool = VK_HTTP_POOL_API);
+
+// Sends the request, which must complete even if the connection gets closed right away (e.g.
+// setting offline upon logout). The request is not bound to gc, so it is not cancelled upon
+// logout, and there is no callback. It is aborted after timeout seconds.
+void http_request_detached(PurpleConnection* gc, PurpleHttpRequest* request, int timeout,
+                           VkHttpPool pool = VK_HTTP_POOL_API);
 
 // A wrapper around purple_http_request, which updates url in PurpleHttpRequest. This url can be
 // later retrieved inside the callback function. This differs from the standard purple_http_request
 // behaviour where only url inside PurpleConnection is updated (it is inaccessible to outside code).
-// Connection is run with keep-alive pool and added to connection set.
+// Connection is run with keep-alive pool and added to connection set. The redirects are requested
+// in the same pool. Like browsers do, 303 and 301 or 302 after POST are followed with GET without
+// the body.
 PurpleHttpConnection* http_request_update_on_redirect(PurpleConnection* gc, PurpleHttpRequest* request,
-                                                      const HttpCallback& callback);
+                                                      const HttpCallback& callback,
+                                                      VkHttpPool pool = VK_HTTP_POOL_API);
+
+// Opens a keep-alive connection to the host of url in advance, so that the next request to it
+// does not have to wait for DNS lookup and TCP and TLS handshakes.
+void http_prewarm(PurpleConnection* gc, const string& url, VkHttpPool pool = VK_HTTP_POOL_API);
 
 // Copy cookie-jar from already running connection to new request.
 void http_request_copy_cookie_jar(PurpleHttpRequest* target, PurpleHttpConnection* source_conn);
@@ -0,0 +1,134 @@
+#include "jsonutils.h"
+
+JsonItemsStream::JsonItemsStream(const vector<string>& path, const ItemCb& item_cb)
+    : m_path(path),
+      m_item_cb(item_cb)
+{
+    reset();
+}
+
+void JsonItemsStream::reset()
+{
+    m_rest.clear();
+    m_item.clear();
+    m_in_item = false;
+    m_stack.clear();
+    m_matched = 0;
+    m_in_string = false;
+    m_escape = false;
+    m_expect_key = false;
+    m_capture_key = false;
+    m_key.clear();
+    m_failed = false;
+}
+
+bool JsonItemsStream::in_items_array() const
+{
+    return m_matched == m_path.size() + 1 && m_stack.size() == m_matched;
+}
+
+bool JsonItemsStream::feed(const char* data, size_t len)
+{
+    if (m_failed)
+        return false;
+
+    const char* end = data + len;
+    // The beginning of the text, which has not been appended to m_item or m_rest yet.
+    const char* pending = data;
+    for (const char* p = data; p != end; p++) {
+        char c = *p;
+        if (m_in_string) {
+            if (m_escape) {
+                m_escape = false;
+            } else if (c == '\\') {
+                m_escape = true;
+            } else if (c == '"') {
+                m_in_string = false;
+                continue;
+            }
+            // Keys are compared without unescaping, the keys on the path never contain escapes.
+            if (m_capture_key)
+                m_key += c;
+            continue;
+        }
+
+        if (c == ' ' || c == '\t' || c == '\n' || c == '\r')
+            continue;
+
+        if (in_items_array()) {
+            if (m_in_item && (c == ',' || c == ']')) {
+                // The item has ended. Pass it right from the chunk if it has been received whole.
+                bool ok;
+                if (m_item.empty()) {
+                    ok = m_item_cb(pending, p);
+                } else {
+                    m_item.append(pending, p);
+                    ok = m_item_cb(m_item.data(), m_item.data() + m_item.size());
+                    m_item.clear();
+                }
+                if (!ok) {
+                    m_failed = true;
+                    return false;
+                }
+                m_in_item = false;
+                pending = p;
+            } else if (!m_in_item && c != ',' && c != ']') {
+                m_rest.append(pending, p);
+                pending = p;
+                m_in_item = true;
+            }
+
+            // Separators between the items are dropped.
+            if (c == ',') {
+                pending = p + 1;
+                continue;
+            }
+        }
+
+        switch (c) {
+        case '"':
+            m_in_string = true;
+            m_capture_key = m_expect_key && m_stack.size() == m_matched && m_matched <= m_path.size();
+            if (m_capture_key)
+                m_key.clear();
+            m_expect_key = false;
+            break;
+        case '{':
+        case '[': {
+            // The container lies on the path if its parent does and it is the value for the key
+            // from the path. The last container on the path must be the array.
+            size_t level = m_stack.size();
+            if (level == m_matched && level <= m_path.size()
+                    && (level == 0 || (m_stack.back() == '{' && m_key == m_path[level - 1]))
+                    && (c == '[') == (level == m_path.size()))
+                m_matched++;
+            m_stack += c;
+            m_expect_key = c == '{';
+            m_key.clear();
+            break;
+        }
+        case '}':
+        case ']':
+            if (m_stack.empty() || m_stack.back() != (c == '}' ? '{' : '[')) {
+                m_failed = true;
+                return false;
+            }
+            if (m_matched == m_stack.size())
+                m_matched--;
+            m_stack.erase(m_stack.size() - 1);
+            m_expect_key = false;
+            break;
+        case ',':
+            m_expect_key = !m_stack.empty() && m_stack.back() == '{';
+            break;
+        default:
+            break;
+        }
+    }
+
+    if (m_in_item)
+        m_item.append(pending, end);
+    else
+        m_rest.append(pending, end);
+    return true;
+}
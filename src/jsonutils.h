@@ -0,0 +1,338 @@
+// Utilities for event-driven JSON decoding. Instead of building picojson::value tree and walking
+// it afterwards, the decoder receives values directly from the parser and stores only the data
+// it needs.
+
+#pragma once
+
+#include <utility>
+
+using std::pair;
+
+#include "common.h"
+
+#include <contrib/picojson/picojson.h>
+
+// We always parse the contents of HTTP responses.
+typedef picojson::input<const char*> JsonInput;
+
+// Converts the number, which has not been parsed as an integer literal, to int64. Returns false
+// if it does not fit into int64, because the conversion would be undefined then.
+inline bool json_number_to_int64(double f, int64& out)
+{
+    // 2^63 is exactly representable as double, INT64_MAX is not. NaN fails both comparisons.
+    if (!(f >= -9223372036854775808.0 && f < 9223372036854775808.0))
+        return false;
+    out = (int64)f;
+    return true;
+}
+
+// Part of the text, which contains exactly one JSON value.
+typedef pair<const char*, const char*> JsonSpan;
+
+// Skips one JSON value.
+inline bool json_skip(JsonInput& in)
+{
+    picojson::null_parse_context ctx;
+    return picojson::_parse(ctx, in);
+}
+
+// Skips one JSON value and returns its span in span.
+inline bool json_skip_span(JsonInput& in, JsonSpan& span)
+{
+    in.skip_ws();
+    span.first = in.pos();
+    if (!json_skip(in))
+        return false;
+    span.second = in.pos();
+    return true;
+}
+
+// Base parse context, which skips any value. The derived contexts hide the methods for the types
+// they are interested in. Values of unexpected types are skipped rather than treated as errors,
+// because Vk.com is not always consistent in types of optional fields.
+class JsonSkipContext
+{
+public:
+    bool set_null() { return true; }
+    bool set_bool(bool) { return true; }
+    bool set_number(double) { return true; }
+    bool set_int64(int64) { return true; }
+    bool parse_string(JsonInput& in)
+    {
+        picojson::null_parse_context::dummy_str s;
+        return picojson::_parse_string(s, in);
+    }
+    bool parse_array_start() { return true; }
+    bool parse_array_item(JsonInput& in, size_t) { return json_skip(in); }
+    bool parse_object_start() { return true; }
+    bool parse_object_item(JsonInput& in, const string&) { return json_skip(in); }
+};
+
+// Parse context, which stores the string value. present is set to true if the value is a string.
+class JsonStringContext : public JsonSkipContext
+{
+public:
+    JsonStringContext(string& out, bool& present)
+        : m_out(out),
+          m_present(present)
+    {
+    }
+
+    bool parse_string(JsonInput& in)
+    {
+        m_out.clear();
+        m_present = true;
+        return picojson::_parse_string(m_out, in);
+    }
+
+private:
+    string& m_out;
+    bool& m_present;
+};
+
+// Parse context, which stores the numeric value. present is set to true if the value is a number.
+class JsonNumberContext : public JsonSkipContext
+{
+public:
+    JsonNumberContext(double& out, bool& present)
+        : m_out(out),
+          m_present(present)
+    {
+    }
+
+    bool set_number(double f)
+    {
+        m_out = f;
+        m_present = true;
+        return true;
+    }
+
+    bool set_int64(int64 i)
+    {
+        m_out = i;
+        m_present = true;
+        return true;
+    }
+
+private:
+    double& m_out;
+    bool& m_present;
+};
+
+// Parse context, which stores the integer value exactly. Non-integer numbers are truncated.
+// present is set to true if the value is a number, which fits into int64.
+class JsonInt64Context : public JsonSkipContext
+{
+public:
+    JsonInt64Context(int64& out, bool& present)
+        : m_out(out),
+          m_present(present)
+    {
+    }
+
+    bool set_number(double f)
+    {
+        if (json_number_to_int64(f, m_out))
+            m_present = true;
+        return true;
+    }
+
+    bool set_int64(int64 i)
+    {
+        m_out = i;
+        m_present = true;
+        return true;
+    }
+
+private:
+    int64& m_out;
+    bool& m_present;
+};
+
+// Parse context, which calls item_cb(in, key) for each key of the object. item_cb must parse
+// or skip the value.
+template<typename ItemCb>
+class JsonObjectContext : public JsonSkipContext
+{
+public:
+    JsonObjectContext(ItemCb item_cb, bool& present)
+        : m_item_cb(item_cb),
+          m_present(present)
+    {
+    }
+
+    bool parse_object_start()
+    {
+        m_present = true;
+        return true;
+    }
+
+    bool parse_object_item(JsonInput& in, const string& key)
+    {
+        return m_item_cb(in, key);
+    }
+
+private:
+    ItemCb m_item_cb;
+    bool& m_present;
+};
+
+// Parse context, which calls item_cb(in) for each item of the array. item_cb must parse
+// or skip the value.
+template<typename ItemCb>
+class JsonArrayContext : public JsonSkipContext
+{
+public:
+    JsonArrayContext(ItemCb item_cb, bool& present)
+        : m_item_cb(item_cb),
+          m_present(present)
+    {
+    }
+
+    bool parse_array_start()
+    {
+        m_present = true;
+        return true;
+    }
+
+    bool parse_array_item(JsonInput& in, size_t)
+    {
+        return m_item_cb(in);
+    }
+
+private:
+    ItemCb m_item_cb;
+    bool& m_present;
+};
+
+// Parses one value into picojson::value. Used for the parts of the text, which are easier
+// to process as a DOM.
+inline bool json_read_value(JsonInput& in, picojson::value& out)
+{
+    picojson::default_parse_context ctx(&out);
+    return picojson::_parse(ctx, in);
+}
+
+// Helper functions, which parse one value with the contexts above. Return false only
+// on syntax errors, present is set if the value had the expected type.
+
+inline bool json_read_string(JsonInput& in, string& out, bool& present)
+{
+    JsonStringContext ctx(out, present);
+    return picojson::_parse(ctx, in);
+}
+
+inline bool json_read_string(JsonInput& in, string& out)
+{
+    bool present = false;
+    return json_read_string(in, out, present);
+}
+
+inline bool json_read_number(JsonInput& in, double& out, bool& present)
+{
+    JsonNumberContext ctx(out, present);
+    return picojson::_parse(ctx, in);
+}
+
+inline bool json_read_int64(JsonInput& in, int64& out, bool& present)
+{
+    JsonInt64Context ctx(out, present);
+    return picojson::_parse(ctx, in);
+}
+
+template<typename ItemCb>
+bool json_read_object(JsonInput& in, ItemCb item_cb, bool& present)
+{
+    JsonObjectContext<ItemCb> ctx(item_cb, present);
+    return picojson::_parse(ctx, in);
+}
+
+template<typename ItemCb>
+bool json_read_object(JsonInput& in, ItemCb item_cb)
+{
+    bool present = false;
+    return json_read_object(in, item_cb, present);
+}
+
+template<typename ItemCb>
+bool json_read_array(JsonInput& in, ItemCb item_cb, bool& present)
+{
+    JsonArrayContext<ItemCb> ctx(item_cb, present);
+    return picojson::_parse(ctx, in);
+}
+
+template<typename ItemCb>
+bool json_read_array(JsonInput& in, ItemCb item_cb)
+{
+    bool present = false;
+    return json_read_array(in, item_cb, present);
+}
+
+// Parses the whole text with the given function, which must parse exactly one value. Returns
+// false if the text is not a valid JSON or contains anything besides the value.
+template<typename ParseFunc>
+bool json_parse_text(const char* begin, const char* end, ParseFunc parse_func)
+{
+    JsonInput in(begin, end);
+    if (!parse_func(in))
+        return false;
+    in.skip_ws();
+    return in.getc() == -1;
+}
+
+// Incremental splitter for the JSON text, which is received in chunks. Items of the array, which is
+// found by path (the sequence of keys of nested objects, starting from the root element), are
+// passed to item_cb as soon as each of them is complete, before the rest of the text arrives.
+// The items are not stored: the rest of the text is kept with the array left empty, so that
+// the other fields can be decoded with the functions above after the last chunk.
+//
+// The splitter only tracks nesting, strings and keys along the path, the items and the rest
+// of the text are validated when they are parsed.
+class JsonItemsStream
+{
+public:
+    // Called with the text of one item, which is valid only until the callback returns.
+    // Returning false stops the splitting.
+    typedef function_ptr<bool(const char* begin, const char* end)> ItemCb;
+
+    JsonItemsStream(const vector<string>& path, const ItemCb& item_cb);
+
+    // Processes the next chunk of the text. Returns false if item_cb has returned false
+    // or the text is not a valid JSON.
+    bool feed(const char* data, size_t len);
+    // Drops everything, which has been received so far, e.g. if the text is going to be
+    // received anew.
+    void reset();
+
+    // The text received so far without the items.
+    const string& rest() const
+    {
+        return m_rest;
+    }
+
+private:
+    vector<string> m_path;
+    ItemCb m_item_cb;
+
+    string m_rest;
+    // Beginning of the current item, which has been received in previous chunks.
+    string m_item;
+    bool m_in_item;
+
+    // Types of the containers ('{' or '['), which are currently open.
+    string m_stack;
+    // The number of outermost containers in m_stack, which lie on the path. If it equals
+    // m_path.size() + 1, we are inside the array with items.
+    size_t m_matched;
+    bool m_in_string;
+    bool m_escape;
+    // True if the next string is a key of the object.
+    bool m_expect_key;
+    // True if the current string is a key of the object on the path. The key is stored in m_key.
+    bool m_capture_key;
+    string m_key;
+    bool m_failed;
+
+    // Returns true if we are directly inside the array with items.
+    bool in_items_array() const;
+};
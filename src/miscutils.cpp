@@ -21,18 +21,17 @@ namespace
 template<typename Iter>
 string urlencode_form(Iter first, Iter last)
 {
-    string ret;
+    // Escape everything into one buffer instead of allocating a string per key and value.
+    GString* buf = g_string_sized_new(256);
     for (Iter it = first; it != last; it++) {
-        if (!ret.empty())
-            ret += '&';
-        char* tmp = g_uri_escape_string(it->first.data(), nullptr, true);
-        ret += tmp;
-        g_free(tmp);
-        ret += '=';
-        tmp = g_uri_escape_string(it->second.data(), nullptr, true);
-        ret += tmp;
-        g_free(tmp);
+        if (buf->len > 0)
+            g_string_append_c(buf, '&');
+        g_string_append_uri_escaped(buf, it->first.data(), nullptr, true);
+        g_string_append_c(buf, '=');
+        g_string_append_uri_escaped(buf, it->second.data(), nullptr, true);
     }
+    string ret(buf->str, buf->len);
+    g_string_free(buf, true);
     return ret;
 }
 
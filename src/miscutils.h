@@ -15,6 +15,8 @@ using std::map;
 #include <contrib/picojson/picojson.h>
 #include <contrib/purple/http.h>
 
+#include "jsonutils.h"
+
 // A nicer wrapper around xmlGetProp
 string get_xml_node_prop(xmlNode* node, const char* tag, const char* default_value = "");
 
@@ -38,6 +40,27 @@ bool field_is_present(const picojson::value& v, const string& key)
     return true;
 }
 
+// Returns the value of JSON number. Integers are returned exactly, other numbers are truncated.
+// v must be a number, i.e. v.is<double>() must be true. Numbers, which do not fit into int64,
+// are rejected and 0 is returned.
+inline int64 json_get_int64(const picojson::value& v)
+{
+    if (v.is<int64>())
+        return v.get<int64>();
+    int64 ret;
+    if (!json_number_to_int64(v.as_double(), ret))
+        return 0;
+    return ret;
+}
+
+// Same as json_get_int64, negative numbers are converted to uint64 as is. Integers above
+// INT64_MAX are parsed as double and could not be returned exactly, so they are rejected too
+// (Vk.com ids are far below that).
+inline uint64 json_get_uint64(const picojson::value& v)
+{
+    return (uint64)json_get_int64(v);
+}
+
 // A tiny wrapper around purple_unescape_html, accepting and returning string.
 string unescape_html(const char* text);
 string unescape_html(const string& text);
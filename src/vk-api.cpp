@@ -1,91 +1,1047 @@
+#include <algorithm>
+#include <deque>
+
 #include <request.h>
 
 #include <contrib/purple/http.h>
 
 #include "vk-common.h"
 #include "httputils.h"
+#include "jsonutils.h"
 #include "miscutils.h"
 
 #include "vk-api.h"
 
+using std::deque;
+
 const char api_version[] = "5.52";
 
 namespace
 {
 
-// We store call parameters, because we may need to repeat the call on error.
-struct VkCall
+// Callback, which receives the text of one item of "items" array in the result of the call
+// as soon as the item is received. Returning false aborts the call.
+typedef function_ptr<bool(const char* begin, const char* end)> CallRawItemCb;
+
+// Result of the call. value is set only if the call has asked for the result to be decoded
+// (see VkCall::value_cb) and it has been decoded while parsing the response, otherwise
+// the text has to be decoded separately.
+struct CallResult
+{
+    JsonSpan text;
+    const picojson::value* value;
+};
+
+// Method name and parameters of the call. We store them, because we may need to repeat the call
+// on error. They are built once and shared between all copies of the call (retries, batches,
+// captured callbacks) and its HTTP request.
+struct VkCallArgs
 {
     string method_name;
     CallParams params;
 };
 
-// Callback, which is called upon receiving response to API call.
-void on_vk_call_cb(PurpleHttpConnection* http_conn, PurpleHttpResponse* response, const VkCall& call,
-                   const CallSuccessCb& success_cb, const CallErrorCb& error_cb);
+// The callbacks of the caller are stored as is, so that issuing the call does not allocate
+// any wrappers.
+struct VkCall
+{
+    shared_ptr<const VkCallArgs> args;
+    // At most one of value_cb and raw_cb is set. If value_cb is set, the result is decoded
+    // into picojson::value in the same pass as the rest of the response, so that the callers,
+    // which need DOM, do not parse the text twice.
+    CallSuccessCb value_cb;
+    CallRawSuccessCb raw_cb;
+    CallErrorCb error_cb;
+    VkCallPriority priority;
+    // If set, the result is streamed: items of "items" array are passed to item_cb and the result,
+    // passed to raw_cb, has the array empty. Such calls are never batched.
+    CallRawItemCb item_cb;
+    // Set for the call, which identical calls wait for (see call_key). Its result is passed
+    // to all of them and is cached if ttl is positive.
+    string key;
+    int ttl = 0;
+};
+
+// Parts of "response", which must be decoded while parsing the response text (see ApiResponse).
+struct ResponseParsing
+{
+    // Decode the whole "response" into ApiResponse::response_value.
+    bool decode_response = false;
+    // Store the spans of the items if "response" is an array. Needed only for "execute".
+    bool collect_items = false;
+    // Indices of the items, which must be decoded into ApiResponse::item_values.
+    vector<bool> decode_items;
+};
+
+// Root element of the response to API request. "error" and "execute_errors" are always parsed,
+// for "response" we store its location in the response text and decode only what has been
+// requested in ResponseParsing, so that the result of each call is decoded only once, either
+// here or by the caller. All spans are valid only during ResponseCb.
+struct ApiResponse
+{
+    // The whole text of the response.
+    JsonSpan text;
+
+    bool has_response = false;
+    JsonSpan response;
+    picojson::value response_value;
+    // Spans of the items if "response" is an array and ResponseParsing::collect_items is set.
+    bool response_is_array = false;
+    vector<JsonSpan> response_items;
+    // Decoded items, the ones, which have not been requested, are left null.
+    vector<picojson::value> item_values;
+
+    bool has_error = false;
+    picojson::value error;
+    picojson::value execute_errors;
+};
+
+// Callback, which is called with the parsed root element of the response to API call.
+typedef function_ptr<void(const ApiResponse& response)> ResponseCb;
+// Callback, which is called when the call must be repeated.
+typedef function_ptr<void()> RetryCb;
+
+// Result of the call, which may be returned to the identical calls until it expires.
+struct VkCachedResult
+{
+    string text;
+    steady_time_point expires;
+};
+
+// HTTP request to API (either a single call or an "execute" with several calls), which waits
+// for its turn to be sent.
+struct VkApiRequest
+{
+    shared_ptr<const VkCallArgs> args;
+    // Urlencoded parameters.
+    string body;
+    ResponseCb response_cb;
+    CallErrorCb error_cb;
+    VkCallPriority priority;
+    steady_time_point queued_time;
+    // See VkCall::item_cb.
+    CallRawItemCb item_cb;
+    ResponseParsing parsing;
+};
+
+// Either returns the result from the cache, waits for the identical running call
+// or dispatches the call. The callbacks and the priority of the call are set by the caller.
+void call_api(PurpleConnection* gc, const char* method_name, CallParams&& params, VkCall&& call);
+
+// Passes the result to the call and to all identical calls, which wait for it.
+void complete_call(PurpleConnection* gc, const VkCall& call, const CallResult& result);
+
+// Passes the error to the call and to all identical calls, which wait for it.
+void fail_call(PurpleConnection* gc, const VkCall& call, const picojson::value& error);
+
+// Returns callback, which calls fail_call.
+CallErrorCb fail_call_cb(PurpleConnection* gc, const VkCall& call);
+
+// Sends the call right away, bypassing the batching.
+void send_call(PurpleConnection* gc, const VkCall& call);
+
+// Returns true if the method may be packed into "execute" along with other calls.
+bool is_batchable(const string& method_name);
+
+// Adds the call to the list of pending calls, which will be sent as a single "execute".
+void add_pending_call(PurpleConnection* gc, const VkCall& call);
+
+// Returns true if identical calls to the method, which are made while the first one is still
+// running, may share the result.
+bool is_deduplicatable(const string& method_name);
+
+// Returns the key, which is equal for calls with the same method and params. Must be called only
+// for deduplicatable methods.
+string call_key(const string& method_name, const CallParams& params);
+
+// Either batches or sends the call.
+void dispatch_call(PurpleConnection* gc, const VkCall& call);
+
+// Removes the call from running calls and returns the calls, waiting for its result.
+vector<VkCall> take_waiting_calls(PurpleConnection* gc, const string& key);
+
+// Returns the time in seconds, during which the results of calls to method may be reused,
+// or zero if the results must not be cached.
+int cache_ttl(const string& method_name);
+
+// Stores the result of the call in the cache.
+void store_cached_result(PurpleConnection* gc, const string& key, int ttl, const char* begin,
+                         const char* end);
+
+VkApiDispatcher& get_dispatcher(PurpleConnection* gc);
+
+// Sends as many queued requests as the rate limit allows and schedules sending the rest.
+void send_queued_requests(PurpleConnection* gc);
 
 } // End of anonymous namespace
 
-void vk_call_api(PurpleConnection* gc, const char* method_name, const CallParams& params,
-                 const CallSuccessCb& success_cb, const CallErrorCb& error_cb)
+// Calls, which have been issued but not yet sent. All calls, which are made during a short
+// period of time (API_BATCH_WINDOW) are sent together in one "execute" request.
+//
+// Vk.com limits the number of API requests to 3 per second, so no more than API_WINDOW_REQUESTS
+// requests are sent during any API_WINDOW_MSEC, the rest are queued. Queued requests are sent
+// in the order of priority.
+struct VkApiDispatcher
 {
-    vkcom_debug_info("    API call %s\n", method_name);
+    ~VkApiDispatcher();
+
+    vector<VkCall> pending_calls;
+    // True if flushing pending_calls has been scheduled.
+    bool flush_scheduled = false;
+
+    // Requests, waiting for their turn. Sorted by priority, requests with equal priority
+    // are sorted by queue time.
+    deque<VkApiRequest> queued_requests;
+    // Times of sending the last API_WINDOW_REQUESTS requests, the oldest first.
+    deque<steady_time_point> sent_times;
+    // True if sending queued_requests has been scheduled.
+    bool send_scheduled = false;
+    // True if the connection is being closed. All requests are sent right away without waiting
+    // for the response, see vk_call_api_flush_on_close.
+    bool closing = false;
+
+    // The part of request URL after the method name and the access token, for which it has
+    // been built. It is rebuilt only when the access token changes.
+    string url_suffix;
+    string url_suffix_token;
+
+    // Statistics, logged upon closing the connection.
+    unsigned requests_sent = 0;
+    unsigned requests_delayed = 0;
+    size_t max_queue_depth = 0;
+    steady_duration total_wait_time = steady_duration::zero();
+    steady_duration max_wait_time = steady_duration::zero();
 
+    // Calls, which are currently running, mapped to the calls, which have been made while
+    // the first one was running and which wait for its result. See call_key for the map key.
+    map<string, vector<VkCall>> running_calls;
+    // The number of calls, which have been attached to a running call, per method.
+    map<string, unsigned> deduplicated_calls;
+
+    // Recent results of calls to the methods, which may be cached (see cache_ttl). See call_key
+    // for the map key.
+    map<string, VkCachedResult> cached_results;
+    unsigned cache_hits = 0;
+    unsigned cache_misses = 0;
+};
+
+void vk_call_api(PurpleConnection* gc, const char* method_name, CallParams params,
+                 const CallSuccessCb& success_cb, const CallErrorCb& error_cb,
+                 VkCallPriority priority)
+{
+    VkCall call;
+    // The result is not decoded if success_cb is not set.
+    call.value_cb = success_cb;
+    call.error_cb = error_cb;
+    call.priority = priority;
+    call_api(gc, method_name, std::move(params), std::move(call));
+}
+
+void vk_call_api_raw(PurpleConnection* gc, const char* method_name, CallParams params,
+                     const CallRawSuccessCb& success_cb, const CallErrorCb& error_cb,
+                     VkCallPriority priority)
+{
+    VkCall call;
+    call.raw_cb = success_cb;
+    call.error_cb = error_cb;
+    call.priority = priority;
+    call_api(gc, method_name, std::move(params), std::move(call));
+}
+
+namespace
+{
+
+void call_api(PurpleConnection* gc, const char* method_name, CallParams&& params, VkCall&& call)
+{
     VkData& gc_data = get_data(gc);
     if (gc_data.is_closing()) {
         vkcom_debug_error("Programming error: API method %s called during logout\n", method_name);
         return;
     }
 
-    VkCall call;
-    call.method_name = method_name;
-    call.params = params;
+    call.args = std::make_shared<VkCallArgs>(VkCallArgs{ method_name, std::move(params) });
+
+    if (!is_deduplicatable(call.args->method_name)) {
+        dispatch_call(gc, call);
+        return;
+    }
+
+    VkApiDispatcher& dispatcher = get_dispatcher(gc);
+    string key = call_key(call.args->method_name, call.args->params);
+
+    int ttl = cache_ttl(call.args->method_name);
+    if (ttl > 0) {
+        auto cached_it = dispatcher.cached_results.find(key);
+        if (cached_it != dispatcher.cached_results.end()
+                && steady_clock::now() < cached_it->second.expires) {
+            vkcom_debug_info("    API call %s returned from cache\n", method_name);
+            dispatcher.cache_hits++;
+            // The callback is called asynchronously, just like for the real call.
+            string text = cached_it->second.text;
+            timeout_add(gc, 0, [=] {
+                complete_call(gc, call, CallResult{ JsonSpan(text.data(), text.data() + text.size()),
+                                                    nullptr });
+                return false;
+            });
+            return;
+        }
+        dispatcher.cache_misses++;
+    }
+
+    auto it = dispatcher.running_calls.find(key);
+    if (it != dispatcher.running_calls.end()) {
+        vkcom_debug_info("    API call %s is already running, waiting for its result\n", method_name);
+        it->second.push_back(std::move(call));
+        dispatcher.deduplicated_calls[method_name]++;
+        return;
+    }
+    dispatcher.running_calls[key];
+
+    call.key = std::move(key);
+    call.ttl = ttl;
+    dispatch_call(gc, call);
+}
+
+// Passes the result to the callbacks of the single call.
+void run_success_cb(const VkCall& call, const CallResult& result)
+{
+    if (call.raw_cb) {
+        call.raw_cb(result.text.first, result.text.second);
+        return;
+    }
+    if (!call.value_cb)
+        return;
+
+    if (result.value) {
+        call.value_cb(*result.value);
+        return;
+    }
+
+    // The result has been taken from the cache or from the identical call, which has not
+    // asked for decoding.
+    picojson::value value;
+    if (!json_parse_text(result.text.first, result.text.second, [&](JsonInput& in) {
+            return json_read_value(in, value);
+        })) {
+        vkcom_debug_error("Error parsing result of %s\n", call.args->method_name.data());
+        if (call.error_cb)
+            call.error_cb(picojson::value());
+        return;
+    }
+    call.value_cb(value);
+}
+
+void complete_call(PurpleConnection* gc, const VkCall& call, const CallResult& result)
+{
+    if (call.key.empty()) {
+        run_success_cb(call, result);
+        return;
+    }
+
+    // The call is removed from running_calls before running the callbacks, so that any new
+    // identical call will be made anew.
+    vector<VkCall> waiting_calls = take_waiting_calls(gc, call.key);
+    if (call.ttl > 0)
+        store_cached_result(gc, call.key, call.ttl, result.text.first, result.text.second);
+    run_success_cb(call, result);
+    for (const VkCall& waiting_call: waiting_calls)
+        run_success_cb(waiting_call, result);
+}
+
+void fail_call(PurpleConnection* gc, const VkCall& call, const picojson::value& error)
+{
+    if (call.key.empty()) {
+        if (call.error_cb)
+            call.error_cb(error);
+        return;
+    }
+
+    vector<VkCall> waiting_calls = take_waiting_calls(gc, call.key);
+    if (call.error_cb)
+        call.error_cb(error);
+    for (const VkCall& waiting_call: waiting_calls)
+        if (waiting_call.error_cb)
+            waiting_call.error_cb(error);
+}
+
+CallErrorCb fail_call_cb(PurpleConnection* gc, const VkCall& call)
+{
+    // Most calls have nobody waiting for them, so the callback of the caller is used as is.
+    if (call.key.empty())
+        return call.error_cb;
+    return [=](const picojson::value& error) {
+        fail_call(gc, call, error);
+    };
+}
+
+// Maximum number of calls in one "execute". This limit is set by Vk.com.
+const size_t MAX_EXECUTE_CALLS = 25;
+
+// The amount of time in milliseconds we wait for more calls before sending the batch. Zero means
+// that only calls issued during the same main loop iteration are batched together.
+const unsigned API_BATCH_WINDOW = 5;
+
+// The maximum number of requests, which may be sent during any API_WINDOW_MSEC milliseconds.
+// The window is a bit larger than a second, because network latency may make requests arrive
+// to Vk.com closer to each other.
+const size_t API_WINDOW_REQUESTS = 3;
+const int API_WINDOW_MSEC = 1100;
+
+// The timeout in seconds for requests, which are sent upon closing the connection.
+const int API_CLOSE_TIMEOUT = 5;
+
+// Queues one HTTP request to the API method and calls response_cb with the parsed response.
+// error_cb is called only on network and JSON errors. If item_cb is set, the response is streamed
+// (see VkCall::item_cb).
+void send_request(PurpleConnection* gc, const shared_ptr<const VkCallArgs>& args,
+                  VkCallPriority priority, const ResponseParsing& parsing,
+                  const ResponseCb& response_cb, const CallErrorCb& error_cb,
+                  const CallRawItemCb& item_cb = nullptr);
+
+// Process error: maybe do another call and/or re-authorize. retry_cb is called to repeat
+// the call if needed.
+void process_error(PurpleConnection* gc, const picojson::value& error, const RetryCb& retry_cb,
+                   const CallErrorCb& error_cb);
+
+// Returns callback, which repeats the call.
+RetryCb retry_call_cb(PurpleConnection* gc, const VkCall& call)
+{
+    // We must not use vk_call_api here, because the call would wait for its own result.
+    return [=] {
+        if (!get_data(gc).is_closing())
+            dispatch_call(gc, call);
+    };
+}
+
+void send_call(PurpleConnection* gc, const VkCall& call)
+{
+    vkcom_debug_info("    API call %s\n", call.args->method_name.data());
+
+    // The streamed result has the items cut out, so it is never decoded here.
+    ResponseParsing parsing;
+    parsing.decode_response = call.value_cb && !call.item_cb;
+    send_request(gc, call.args, call.priority, parsing,
+                 [=](const ApiResponse& response) {
+        // Process all errors, potentially re-executing the request.
+        if (response.has_error) {
+            process_error(gc, response.error, retry_call_cb(gc, call), fail_call_cb(gc, call));
+            return;
+        }
+
+        if (!response.has_response) {
+            vkcom_debug_error("Root element is neither \"response\" nor \"error\"\n");
+            fail_call(gc, call, picojson::value());
+            return;
+        }
+
+        complete_call(gc, call, CallResult{ response.response, parsing.decode_response
+                                                               ? &response.response_value : nullptr });
+    }, fail_call_cb(gc, call), call.item_cb);
+}
+
+void dispatch_call(PurpleConnection* gc, const VkCall& call)
+{
+    if (is_batchable(call.args->method_name) && !call.item_cb)
+        add_pending_call(gc, call);
+    else
+        send_call(gc, call);
+}
+
+bool is_deduplicatable(const string& method_name)
+{
+    // Only methods, which read data, may be deduplicated. Other methods either modify something
+    // (sending the same message twice is perfectly valid) or may do anything at all ("execute").
+    size_t dot = method_name.find('.');
+    if (dot == string::npos)
+        return false;
+    return method_name.compare(dot + 1, 3, "get") == 0
+        || method_name.compare(dot + 1, 7, "resolve") == 0;
+}
+
+string call_key(const string& method_name, const CallParams& params)
+{
+    // Only pointers are sorted, so that the parameters themselves are not copied.
+    vector<const CallParams::value_type*> sorted_params;
+    sorted_params.reserve(params.size());
+    size_t key_size = method_name.size();
+    for (const CallParams::value_type& p: params) {
+        sorted_params.push_back(&p);
+        key_size += p.first.size() + p.second.size() + 2;
+    }
+    std::sort(sorted_params.begin(), sorted_params.end(),
+              [](const CallParams::value_type* a, const CallParams::value_type* b) {
+        return *a < *b;
+    });
+
+    string key;
+    key.reserve(key_size);
+    key += method_name;
+    for (const CallParams::value_type* p: sorted_params) {
+        key += '\n';
+        key += p->first;
+        key += '=';
+        key += p->second;
+    }
+    return key;
+}
+
+vector<VkCall> take_waiting_calls(PurpleConnection* gc, const string& key)
+{
+    VkApiDispatcher& dispatcher = get_dispatcher(gc);
+    vector<VkCall> waiting_calls;
+    waiting_calls.swap(dispatcher.running_calls[key]);
+    dispatcher.running_calls.erase(key);
+    return waiting_calls;
+}
+
+int cache_ttl(const string& method_name)
+{
+    // These methods return the data, which changes rarely and which is requested repeatedly,
+    // e.g. upon opening a tooltip or receiving a message.
+    if (method_name == "users.get")
+        return 30;
+    if (method_name == "groups.getById")
+        return 15 * 60;
+    if (method_name == "messages.getChat")
+        return 5 * 60;
+    if (method_name == "utils.resolveScreenName")
+        return 60 * 60;
+    return 0;
+}
+
+void store_cached_result(PurpleConnection* gc, const string& key, int ttl, const char* begin,
+                         const char* end)
+{
+    VkApiDispatcher& dispatcher = get_dispatcher(gc);
+    steady_time_point now = steady_clock::now();
+
+    // Drop the expired results, so that the cache does not grow indefinitely.
+    for (auto it = dispatcher.cached_results.begin(); it != dispatcher.cached_results.end();) {
+        if (it->second.expires <= now)
+            it = dispatcher.cached_results.erase(it);
+        else
+            ++it;
+    }
+
+    VkCachedResult& result = dispatcher.cached_results[key];
+    result.text.assign(begin, end);
+    result.expires = now + std::chrono::seconds(ttl);
+}
+
+bool is_batchable(const string& method_name)
+{
+    // messages.send may require captcha, the details of which are not returned for calls
+    // inside "execute".
+    return method_name != "execute" && method_name != "messages.send";
+}
+
+// Builds VKScript code for "execute", which calls all methods and returns an array of results.
+string build_execute_code(const vector<VkCall>& calls)
+{
+    string code = "return [";
+    for (size_t i = 0; i < calls.size(); i++) {
+        if (i > 0)
+            code += ',';
+        picojson::object params;
+        for (const CallParams::value_type& p: calls[i].args->params)
+            params[p.first] = picojson::value(p.second);
+
+        code += "API.";
+        code += calls[i].args->method_name;
+        code += '(';
+        code += picojson::value(params).serialize();
+        code += ')';
+    }
+    code += "];";
+    return code;
+}
+
+// Checks if the error from execute_errors has been returned by the call. Some methods may return
+// false as a successful result, so we must not blindly assign errors to calls returning false.
+bool is_error_for_call(const picojson::value& error, const VkCall& call)
+{
+    if (!field_is_present<string>(error, "method"))
+        return true;
+    return error.get("method").get<string>() == call.args->method_name;
+}
+
+// Returns true if the span contains literal false.
+bool is_false(const JsonSpan& span)
+{
+    return span.second - span.first == 5 && strncmp(span.first, "false", 5) == 0;
+}
+
+// Calls fail_call for all calls with the same error.
+void fail_calls(PurpleConnection* gc, const vector<VkCall>& calls, const picojson::value& error)
+{
+    for (const VkCall& call: calls)
+        fail_call(gc, call, error);
+}
+
+// Sends calls as a single "execute" and dispatches the results to each call callbacks.
+// All calls must have the same priority.
+void send_batch(PurpleConnection* gc, const vector<VkCall>& calls)
+{
+    vkcom_debug_info("    API call execute with %d batched calls\n", (int)calls.size());
+    for (const VkCall& call: calls)
+        vkcom_debug_info("        %s\n", call.args->method_name.data());
+
+    shared_ptr<VkCallArgs> args = std::make_shared<VkCallArgs>();
+    args->method_name = "execute";
+    args->params.emplace_back("code", build_execute_code(calls));
+    ResponseParsing parsing;
+    parsing.collect_items = true;
+    for (const VkCall& call: calls)
+        parsing.decode_items.push_back(bool(call.value_cb));
+    send_request(gc, args, calls.front().priority, parsing,
+                 [=](const ApiResponse& response) {
+        // Errors, which are returned in place of the response, are related to the "execute" itself
+        // (like authorization errors), so we should repeat or fail the whole batch.
+        if (response.has_error) {
+            process_error(gc, response.error, [=] {
+                for (const VkCall& call: calls)
+                    retry_call_cb(gc, call)();
+            }, [=](const picojson::value& error) {
+                // The callers must see the actual error, e.g. to ask for captcha.
+                fail_calls(gc, calls, error);
+            });
+            return;
+        }
+
+        if (!response.response_is_array) {
+            vkcom_debug_error("Strange response to execute: %s\n",
+                              string(response.text.first, response.text.second).data());
+            fail_calls(gc, calls, picojson::value());
+            return;
+        }
+
+        const vector<JsonSpan>& results = response.response_items;
+        if (results.size() != calls.size()) {
+            vkcom_debug_error("Got %d results for %d calls in execute\n", (int)results.size(),
+                              (int)calls.size());
+            fail_calls(gc, calls, picojson::value());
+            return;
+        }
+
+        // Each failed call returns false and appends an error to execute_errors in the order of calls.
+        picojson::array errors;
+        if (response.execute_errors.is<picojson::array>())
+            errors = response.execute_errors.get<picojson::array>();
+        size_t next_error = 0;
+
+        for (size_t i = 0; i < calls.size(); i++) {
+            const VkCall& call = calls[i];
+            const JsonSpan& result = results[i];
+            if (is_false(result) && next_error < errors.size()
+                    && is_error_for_call(errors[next_error], call)) {
+                process_error(gc, errors[next_error], retry_call_cb(gc, call),
+                              fail_call_cb(gc, call));
+                next_error++;
+            } else {
+                complete_call(gc, call, CallResult{ result, call.value_cb ? &response.item_values[i]
+                                                                          : nullptr });
+            }
+        }
+    }, [=](const picojson::value& error) {
+        fail_calls(gc, calls, error);
+    });
+}
+
+VkApiDispatcher& get_dispatcher(PurpleConnection* gc)
+{
+    VkData& gc_data = get_data(gc);
+    if (!gc_data.api_dispatcher)
+        gc_data.api_dispatcher.reset(new VkApiDispatcher());
+    return *gc_data.api_dispatcher;
+}
+
+void add_pending_call(PurpleConnection* gc, const VkCall& call)
+{
+    VkApiDispatcher& dispatcher = get_dispatcher(gc);
+    dispatcher.pending_calls.push_back(call);
+
+    if (dispatcher.flush_scheduled)
+        return;
+    dispatcher.flush_scheduled = true;
+    timeout_add(gc, API_BATCH_WINDOW, [=] {
+        vk_call_api_flush(gc);
+        return false;
+    });
+}
+
+// Returns true if the key (see call_key) has the parameter, which is a comma-separated list
+// containing id.
+bool key_param_contains(const string& key, const string& param_name, const string& id)
+{
+    string param_prefix = '\n' + param_name + '=';
+    size_t start = key.find(param_prefix);
+    if (start == string::npos)
+        return false;
+    start += param_prefix.size();
+    size_t end = key.find('\n', start);
+    if (end == string::npos)
+        end = key.size();
+
+    while (start <= end) {
+        size_t comma = key.find(',', start);
+        if (comma == string::npos || comma > end)
+            comma = end;
+        if (key.compare(start, comma - start, id) == 0)
+            return true;
+        start = comma + 1;
+    }
+    return false;
+}
+
+} // End of anonymous namespace
+
+VkApiDispatcher::~VkApiDispatcher()
+{
+    for (const auto& p: deduplicated_calls)
+        vkcom_debug_info("Calls to %s merged with running identical calls: %d\n", p.first.data(),
+                         p.second);
+
+    if (cache_hits + cache_misses > 0)
+        vkcom_debug_info("API cache hits: %d, misses: %d\n", cache_hits, cache_misses);
+
+    if (requests_sent == 0)
+        return;
+    vkcom_debug_info("API requests sent: %d, delayed: %d, max queue depth: %d, "
+                     "average wait: %d msec, max wait: %d msec\n", requests_sent, requests_delayed,
+                     (int)max_queue_depth, (int)(to_milliseconds(total_wait_time) / requests_sent),
+                     (int)to_milliseconds(max_wait_time));
+}
+
+void vk_call_api_invalidate_cache(PurpleConnection* gc, const char* method_name,
+                                  const char* param_name, uint64 id)
+{
+    VkApiDispatcher& dispatcher = get_dispatcher(gc);
+    // Keys for the method start with method name, followed by newline (see call_key).
+    string prefix = string(method_name) + '\n';
+    string id_str = to_string(id);
+    auto it = dispatcher.cached_results.lower_bound(prefix);
+    while (it != dispatcher.cached_results.end() && it->first.compare(0, prefix.size(), prefix) == 0) {
+        if (key_param_contains(it->first, param_name, id_str))
+            it = dispatcher.cached_results.erase(it);
+        else
+            ++it;
+    }
+}
+
+void vk_call_api_flush(PurpleConnection* gc)
+{
+    VkApiDispatcher& dispatcher = get_dispatcher(gc);
+    dispatcher.flush_scheduled = false;
+
+    vector<VkCall> calls;
+    calls.swap(dispatcher.pending_calls);
+    // Batches are formed from calls with equal priority, so that the background calls do not get
+    // sent along with interactive ones.
+    std::stable_sort(calls.begin(), calls.end(), [](const VkCall& a, const VkCall& b) {
+        return a.priority < b.priority;
+    });
+
+    size_t batch_start = 0;
+    while (batch_start < calls.size()) {
+        size_t batch_end = batch_start + 1;
+        while (batch_end < calls.size() && batch_end - batch_start < MAX_EXECUTE_CALLS
+               && calls[batch_end].priority == calls[batch_start].priority)
+            batch_end++;
+
+        // There is no need to wrap a single call in "execute".
+        if (batch_end - batch_start == 1)
+            send_call(gc, calls[batch_start]);
+        else
+            send_batch(gc, vector<VkCall>(calls.begin() + batch_start, calls.begin() + batch_end));
+        batch_start = batch_end;
+    }
+}
+
+void vk_call_api_flush_on_close(PurpleConnection* gc)
+{
+    VkApiDispatcher& dispatcher = get_dispatcher(gc);
+    // Results of the calls, which only read data, are of no use anymore.
+    erase_if(dispatcher.pending_calls, [](const VkCall& call) {
+        return is_deduplicatable(call.args->method_name);
+    });
+    erase_if(dispatcher.queued_requests, [](const VkApiRequest& request) {
+        return is_deduplicatable(request.args->method_name);
+    });
+
+    dispatcher.closing = true;
+    vk_call_api_flush(gc);
+    send_queued_requests(gc);
+}
+
+namespace
+{
 
-    string method_url = str_format("https://api.vk.com/method/%s?v=%s&access_token=%s", method_name,
-                                   api_version, gc_data.access_token().data());
+// Parses one item of "response" array, storing its span and decoding it if requested.
+bool parse_response_item(JsonInput& in, const ResponseParsing& parsing, ApiResponse& response)
+{
+    size_t index = response.response_items.size();
+    response.item_values.emplace_back();
+    JsonSpan item;
+    if (index < parsing.decode_items.size() && parsing.decode_items[index]) {
+        in.skip_ws();
+        item.first = in.pos();
+        if (!json_read_value(in, response.item_values.back()))
+            return false;
+        item.second = in.pos();
+    } else {
+        if (!json_skip_span(in, item))
+            return false;
+    }
+    response.response_items.push_back(item);
+    return true;
+}
+
+// Parses "response" field of the root element, storing the spans and decoding the parts,
+// requested in parsing.
+bool parse_response_field(JsonInput& in, const ResponseParsing& parsing, ApiResponse& response)
+{
+    in.skip_ws();
+    response.has_response = true;
+    response.response.first = in.pos();
+    bool ok;
+    if (parsing.decode_response) {
+        ok = json_read_value(in, response.response_value);
+    } else if (parsing.collect_items) {
+        ok = json_read_array(in, [&](JsonInput& item_in) {
+            return parse_response_item(item_in, parsing, response);
+        }, response.response_is_array);
+    } else {
+        ok = json_skip(in);
+    }
+    response.response.second = in.pos();
+    return ok;
+}
+
+// Parses the root element of the response. Returns false if the text is not a valid JSON
+// or the root element is not an object.
+bool parse_api_response(const char* begin, const char* end, const ResponseParsing& parsing,
+                        ApiResponse& response)
+{
+    response.text = JsonSpan(begin, end);
+    bool is_object = false;
+    bool ok = json_parse_text(begin, end, [&](JsonInput& in) {
+        return json_read_object(in, [&](JsonInput& field_in, const string& key) {
+            if (key == "response")
+                return parse_response_field(field_in, parsing, response);
+            if (key == "error") {
+                response.has_error = true;
+                return json_read_value(field_in, response.error);
+            }
+            if (key == "execute_errors")
+                return json_read_value(field_in, response.execute_errors);
+            return json_skip(field_in);
+        }, is_object);
+    });
+    return ok && is_object;
+}
+
+// Returns URL of the API method.
+string get_method_url(PurpleConnection* gc, const string& method_name)
+{
+    VkApiDispatcher& dispatcher = get_dispatcher(gc);
+    const string& access_token = get_data(gc).access_token();
+    if (dispatcher.url_suffix.empty() || dispatcher.url_suffix_token != access_token) {
+        dispatcher.url_suffix = str_format("?v=%s&access_token=%s", api_version, access_token.data());
+        dispatcher.url_suffix_token = access_token;
+    }
+
+    static const char method_url_prefix[] = "https://api.vk.com/method/";
+    string url;
+    url.reserve(sizeof(method_url_prefix) - 1 + method_name.size() + dispatcher.url_suffix.size());
+    url += method_url_prefix;
+    url += method_name;
+    url += dispatcher.url_suffix;
+    return url;
+}
+
+// Parses the response text and passes it to response_cb.
+void process_response_text(const char* begin, const char* end, const ResponseParsing& parsing,
+                           const ResponseCb& response_cb, const CallErrorCb& error_cb)
+{
+    ApiResponse api_response;
+    if (!parse_api_response(begin, end, parsing, api_response)) {
+        vkcom_debug_error("Error parsing response or root element is not an object: %s\n",
+                          string(begin, end).data());
+        if (error_cb)
+            error_cb(picojson::value());
+        return;
+    }
+
+    response_cb(api_response);
+}
+
+// Items of the streamed response, which are passed to VkCall::item_cb. If the request is retried,
+// the items are received anew and the ones, which have already been passed, are skipped.
+struct StreamedItems
+{
+    CallRawItemCb item_cb;
+    // The number of items received since the response started anew.
+    size_t received = 0;
+    size_t passed = 0;
+};
+
+// Sends the request over HTTP, streaming the response.
+void send_streaming_http_request(PurpleConnection* gc, PurpleHttpRequest* req, const VkApiRequest& request)
+{
+    shared_ptr<StreamedItems> items(new StreamedItems());
+    items->item_cb = request.item_cb;
+    static const vector<string> items_path = { "response", "items" };
+    shared_ptr<JsonItemsStream> stream(new JsonItemsStream(items_path, [=](const char* begin, const char* end) {
+        items->received++;
+        if (items->received <= items->passed)
+            return true;
+        items->passed++;
+        return items->item_cb(begin, end);
+    }));
+
+    ResponseParsing parsing = request.parsing;
+    ResponseCb response_cb = request.response_cb;
+    CallErrorCb error_cb = request.error_cb;
+    http_request_streaming(gc, req, [=](const char* data, size_t len, bool restart) {
+        if (restart) {
+            stream->reset();
+            items->received = 0;
+        }
+        return stream->feed(data, len);
+    }, [=](PurpleHttpConnection*, PurpleHttpResponse* response) {
+        if (!purple_http_response_is_successful(response)) {
+            vkcom_debug_error("Error while calling API: %s\n", purple_http_response_get_error(response));
+            if (error_cb)
+                error_cb(picojson::value());
+            return;
+        }
+
+        const string& text = stream->rest();
+        process_response_text(text.data(), text.data() + text.size(), parsing, response_cb, error_cb);
+    });
+}
+
+// Sends the request over HTTP.
+void send_http_request(PurpleConnection* gc, const VkApiRequest& request)
+{
+    string method_url = get_method_url(gc, request.args->method_name);
     PurpleHttpRequest* req = purple_http_request_new(method_url.data());
     purple_http_request_set_method(req, "POST");
     purple_http_request_header_add(req, "Content-Type", "application/x-www-form-urlencoded");
-    if (!params.empty()) {
-        string body = urlencode_form(params);
-        purple_http_request_set_contents(req, body.data(), body.length());
+    if (!request.body.empty())
+        purple_http_request_set_contents(req, request.body.data(), request.body.length());
+    // Pipelined requests are repeated if the server breaks the pipeline, so only the calls, which
+    // do not modify anything, may be pipelined.
+    purple_http_request_set_pipelining(req, is_deduplicatable(request.args->method_name));
+
+    if (get_dispatcher(gc).closing) {
+        http_request_detached(gc, req, API_CLOSE_TIMEOUT);
+        purple_http_request_unref(req);
+        return;
+    }
+
+    if (request.item_cb) {
+        send_streaming_http_request(gc, req, request);
+        purple_http_request_unref(req);
+        return;
     }
 
-    http_request(gc, req, [=](PurpleHttpConnection* http_conn, PurpleHttpResponse* response) {
-        // Connection has been cancelled due to account being disconnected. Do not do any response
-        // processing, as callbacks may initiate new HTTP requests.
-        if (get_data(gc).is_closing())
+    ResponseParsing parsing = request.parsing;
+    ResponseCb response_cb = request.response_cb;
+    CallErrorCb error_cb = request.error_cb;
+    http_request(gc, req, [=](PurpleHttpConnection*, PurpleHttpResponse* response) {
+        if (!purple_http_response_is_successful(response)) {
+            vkcom_debug_error("Error while calling API: %s\n", purple_http_response_get_error(response));
+            if (error_cb)
+                error_cb(picojson::value());
             return;
+        }
 
-        on_vk_call_cb(http_conn, response, call, success_cb, error_cb);
+        size_t response_len;
+        const char* response_text = purple_http_response_get_data(response, &response_len);
+        process_response_text(response_text, response_text + response_len, parsing, response_cb,
+                              error_cb);
     });
     purple_http_request_unref(req);
 }
 
-namespace
+// Returns the time in milliseconds, after which one more request may be sent, or zero if it may
+// be sent right away.
+int time_until_next_request(const VkApiDispatcher& dispatcher, steady_time_point now)
+{
+    if (dispatcher.sent_times.size() < API_WINDOW_REQUESTS)
+        return 0;
+    int passed = (int)to_milliseconds(now - dispatcher.sent_times.front());
+    return std::max(API_WINDOW_MSEC - passed, 0);
+}
+
+// Records that the request has been sent at the given time.
+void add_sent_time(VkApiDispatcher& dispatcher, steady_time_point time)
 {
+    dispatcher.sent_times.push_back(time);
+    if (dispatcher.sent_times.size() > API_WINDOW_REQUESTS)
+        dispatcher.sent_times.pop_front();
+}
 
-// Someone started authentication, waits until the auth token is set and repeats the call.
-void vk_call_after_auth(PurpleConnection* gc, const VkCall& call,
-                        const CallSuccessCb& success_cb, const CallErrorCb& error_cb)
+// Sends as many queued requests as the rate limit allows and schedules sending the rest.
+void send_queued_requests(PurpleConnection* gc)
 {
-    // Try repeating in a second.
-    const int WAIT_AUTH_TIMEOUT = 1000;
-    vkcom_debug_info("Authentication already in progress, retrying in %d msec\n", WAIT_AUTH_TIMEOUT);
+    VkApiDispatcher& dispatcher = get_dispatcher(gc);
 
-    // This loop stops in case of failed authentication, because all timeouts die.
-    timeout_add(gc, WAIT_AUTH_TIMEOUT, [=] {
-        if (get_data(gc).is_authenticating())
-            vk_call_after_auth(gc, call, success_cb, error_cb);
-        else
-            vk_call_api(gc, call.method_name.data(), call.params, success_cb, error_cb);
+    // There is no time to wait for our turn when closing: the requests are few and each one is
+    // sent once, so exceeding the rate limit a bit is better than not sending them at all.
+    while (!dispatcher.queued_requests.empty()
+           && (time_until_next_request(dispatcher, steady_clock::now()) == 0 || dispatcher.closing)) {
+        VkApiRequest request = std::move(dispatcher.queued_requests.front());
+        dispatcher.queued_requests.pop_front();
+        add_sent_time(dispatcher, steady_clock::now());
+
+        steady_duration wait_time = steady_clock::now() - request.queued_time;
+        dispatcher.requests_sent++;
+        dispatcher.total_wait_time += wait_time;
+        dispatcher.max_wait_time = std::max(dispatcher.max_wait_time, wait_time);
+        if (to_milliseconds(wait_time) > 0) {
+            dispatcher.requests_delayed++;
+            vkcom_debug_info("API request %s waited for %d msec, %d requests left in queue\n",
+                             request.args->method_name.data(), (int)to_milliseconds(wait_time),
+                             (int)dispatcher.queued_requests.size());
+        }
+
+        send_http_request(gc, request);
+    }
+
+    if (dispatcher.queued_requests.empty() || dispatcher.send_scheduled)
+        return;
+
+    int wait_msec = time_until_next_request(dispatcher, steady_clock::now()) + 1;
+    dispatcher.send_scheduled = true;
+    timeout_add(gc, wait_msec, [=] {
+        get_dispatcher(gc).send_scheduled = false;
+        send_queued_requests(gc);
         return false;
     });
 }
 
-// Process error: maybe do another call and/or re-authorize.
-void process_error(PurpleHttpConnection* http_conn, const picojson::value& error, const VkCall &call,
-                   const CallSuccessCb& success_cb, const CallErrorCb& error_cb)
+void send_request(PurpleConnection* gc, const shared_ptr<const VkCallArgs>& args,
+                  VkCallPriority priority, const ResponseParsing& parsing,
+                  const ResponseCb& response_cb, const CallErrorCb& error_cb,
+                  const CallRawItemCb& item_cb)
+{
+    VkApiDispatcher& dispatcher = get_dispatcher(gc);
+    // Insert the request after all requests with the same or higher priority.
+    deque<VkApiRequest>& queue = dispatcher.queued_requests;
+    auto it = std::find_if(queue.begin(), queue.end(), [=](const VkApiRequest& request) {
+        return request.priority > priority;
+    });
+    queue.insert(it, { args, urlencode_form(args->params), response_cb, error_cb, priority,
+                       steady_clock::now(), item_cb, parsing });
+    dispatcher.max_queue_depth = std::max(dispatcher.max_queue_depth, dispatcher.queued_requests.size());
+
+    send_queued_requests(gc);
+}
+
+void process_error(PurpleConnection* gc, const picojson::value& error, const RetryCb& retry_cb,
+                   const CallErrorCb& error_cb)
 {
     if (!error.is<picojson::object>()) {
         vkcom_debug_error("Unknown error response: %s\n", error.serialize().data());
@@ -101,36 +1057,40 @@ void process_error(PurpleHttpConnection* http_conn, const picojson::value& error
         return;
     }
 
-    int error_code = error.get("error_code").get<double>();
+    int error_code = json_get_int64(error.get("error_code"));
     vkcom_debug_info("Got error code %d\n", error_code);
-    PurpleConnection* gc = purple_http_conn_get_purple_connection(http_conn);
     VkData& gc_data = get_data(gc);
 
     if (error_code == VK_AUTHORIZATION_FAILED) {
-        // Check if another authentication process has already started
-        if (gc_data.is_authenticating()) {
-            vk_call_after_auth(gc, call, success_cb, error_cb);
-        } else {
+        // If another authentication process has already started, authenticate() simply waits
+        // for it to finish.
+        if (!gc_data.is_authenticating()) {
             vkcom_debug_info("Access token expired, doing a reauthorization\n");
-
             gc_data.clear_access_token();
-            gc_data.authenticate([=] {
-                vk_call_api(gc, call.method_name.data(), call.params, success_cb, error_cb);
-            }, [=] {
-                if (error_cb)
-                    error_cb(picojson::value());
-            });
         }
+        gc_data.authenticate([=] {
+            retry_cb();
+        }, [=] {
+            if (error_cb)
+                error_cb(picojson::value());
+        });
     } else if (error_code == VK_TOO_MANY_REQUESTS_PER_SECOND) {
-        const int RETRY_TIMEOUT = 400; // 400msec is less than 3 requests per second (the current rate limit on Vk.com
-        vkcom_debug_info("Call rate limit hit, retrying in %d msec\n", RETRY_TIMEOUT);
+        // This should not normally happen, but someone else may use the same access token. Treat
+        // the whole window as used right now, so that the retried call waits for its turn along
+        // with the rest of requests.
+        vkcom_debug_info("Call rate limit hit, retrying after the rate limit window\n");
+        VkApiDispatcher& dispatcher = get_dispatcher(gc);
+        steady_time_point now = steady_clock::now();
+        for (size_t i = 0; i < API_WINDOW_REQUESTS; i++)
+            add_sent_time(dispatcher, now);
 
-        timeout_add(gc, RETRY_TIMEOUT, [=] {
-            vk_call_api(gc, call.method_name.data(), call.params, success_cb, error_cb);
-            return false;
-        });
+        retry_cb();
     } else if (error_code == VK_FLOOD_CONTROL) {
-        // Simply ignore the error.
+        // There is no point in retrying, but the caller must know that the call has finished
+        // (e.g. deduplicated calls wait for it, see vk_call_api_raw).
+        vkcom_debug_info("Flood control, the call is not repeated\n");
+        if (error_cb)
+            error_cb(error);
     } else if (error_code == VK_VALIDATION_REQUIRED) {
         // As far as I could understand, once you complete validation, all future requests/login
         // attempts will work correctly, so there is no need to do anything apart from showing
@@ -181,105 +1141,297 @@ void process_error(PurpleHttpConnection* http_conn, const picojson::value& error
     }
 }
 
-void on_vk_call_cb(PurpleHttpConnection* http_conn, PurpleHttpResponse* response, const VkCall &call,
-                   const CallSuccessCb& success_cb, const CallErrorCb& error_cb)
-{
-    if (!purple_http_response_is_successful(response)) {
-        vkcom_debug_error("Error while calling API: %s\n", purple_http_response_get_error(response));
-        if (error_cb)
-            error_cb(picojson::value());
-        return;
-    }
 
-    const char* response_text = purple_http_response_get_data(response, nullptr);
-    const char* response_text_copy = response_text; // Picojson updates iterators it received.
-    picojson::value root;
-    string error = picojson::parse(root, response_text, response_text + strlen(response_text));
-    if (!error.empty()) {
-        vkcom_debug_error("Error parsing %s: %s\n", response_text_copy, error.data());
-        if (error_cb)
-            error_cb(picojson::value());
-        return;
+// Adds or replaces existing parameter value in CallParams.
+void add_or_replace_call_param(CallParams& params, const char* name, const char* value)
+{
+    for (CallParams::value_type& pair: params) {
+        if (pair.first == name) {
+            pair.second = value;
+            return;
+        }
     }
+    params.emplace_back(name, value);
+}
 
-    // Process all errors, potentially re-executing the request.
-    if (root.contains("error")) {
-        process_error(http_conn, root.get("error"), call, success_cb, error_cb);
-        return;
-    }
+// The maximum number of pages, which are requested simultaneously by vk_call_api_items. All these
+// calls still go through the rate limiter and are usually batched into one "execute".
+const unsigned MAX_PAGES_RUNNING = 4;
 
-    if (!root.contains("response")) {
-        vkcom_debug_error("Root element is neither \"response\" nor \"error\"\n");
-        if (error_cb)
-            error_cb(picojson::value());
+// Same as vk_call_api_raw, but streams the result (see VkCall::item_cb). The call is neither
+// batched nor deduplicated.
+void vk_call_api_streaming(PurpleConnection* gc, const char* method_name, CallParams params,
+                           const CallRawItemCb& item_cb, const CallRawSuccessCb& success_cb,
+                           const CallErrorCb& error_cb, VkCallPriority priority)
+{
+    if (get_data(gc).is_closing()) {
+        vkcom_debug_error("Programming error: API method %s called during logout\n", method_name);
         return;
     }
 
-    if (success_cb)
-        success_cb(root.get("response"));
+    VkCall call;
+    call.args = std::make_shared<VkCallArgs>(VkCallArgs{ method_name, std::move(params) });
+    call.raw_cb = success_cb;
+    call.error_cb = error_cb;
+    call.priority = priority;
+    call.item_cb = item_cb;
+    dispatch_call(gc, call);
 }
 
+// Page of items, which has been received, but not processed yet.
+struct ItemsPage
+{
+    string text;
+    // Offsets of the beginning and the end of each item in text.
+    vector<pair<size_t, size_t>> items;
+};
 
-// We do not want to copy CallParams when storing in lambda, the easiest way is storing them in shared_ptr.
-typedef shared_ptr<CallParams> CallParams_ptr;
+// State of one vk_call_api_items_raw. The first page is streamed and its items are processed while
+// the rest of it is still being received. After the first page is received, we know the total number
+// of items and page size, so we request the following pages in parallel. Pages may be received
+// in any order, but the items are processed strictly in order.
+struct ItemsRequest
+{
+    PurpleConnection* gc;
+    string method_name;
+    CallParams params;
+    bool pagination;
+    CallRawProcessItemCb call_process_item_cb;
+    CallFinishedCb call_finished_cb;
+    CallErrorCb error_cb;
+    VkCallPriority priority;
 
-// Adds or replaces existing parameter value in CallParams.
-void add_or_replace_call_param(CallParams& params, const char* name, const char* value)
+    // Total number of items, as returned by the first page.
+    uint64 count;
+    // Number of items in the first page, all the following pages are requested with this step.
+    size_t page_size;
+    // Offset of the next page to request.
+    size_t next_request_offset;
+    // Offset of the next page to process.
+    size_t next_process_offset;
+    // Pages, which have been received, but cannot be processed yet, because some of the previous
+    // pages are still running.
+    map<size_t, ItemsPage> received_pages;
+    unsigned pages_running;
+    // Set after call_finished_cb or error_cb has been called.
+    bool finished;
+};
+typedef shared_ptr<ItemsRequest> ItemsRequest_ptr;
+
+// Requests the page with items, starting from offset.
+void request_items_page(const ItemsRequest_ptr& request, size_t offset);
+
+// Marks the request as finished and calls error_cb.
+void fail_items_request(const ItemsRequest_ptr& request, const picojson::value& error)
 {
-    for (CallParams::value_type& pair: params) {
-        if (pair.first == name) {
-            pair.second = value;
-            return;
+    request->finished = true;
+    request->received_pages.clear();
+    if (request->error_cb)
+        request->error_cb(error);
+}
+
+// Processes all received pages in order and requests more pages if needed.
+void process_items_pages(const ItemsRequest_ptr& request)
+{
+    while (!request->finished && contains(request->received_pages, request->next_process_offset)) {
+        ItemsPage page = std::move(request->received_pages[request->next_process_offset]);
+        request->received_pages.erase(request->next_process_offset);
+        request->next_process_offset += request->page_size;
+
+        // We've gone beyond the last item.
+        if (page.items.empty()) {
+            request->finished = true;
+            break;
+        }
+
+        const char* text = page.text.data();
+        for (const pair<size_t, size_t>& item: page.items) {
+            if (!request->call_process_item_cb(text + item.first, text + item.second)) {
+                fail_items_request(request, picojson::value());
+                return;
+            }
         }
     }
-    params.emplace_back(name, value);
+
+    if (!request->finished) {
+        while (request->pages_running < MAX_PAGES_RUNNING
+               && request->next_request_offset < request->count) {
+            request_items_page(request, request->next_request_offset);
+            request->next_request_offset += request->page_size;
+        }
+
+        // Either we've received all items or method does not have pagination.
+        if (request->pages_running == 0)
+            request->finished = true;
+    }
+
+    if (request->finished) {
+        request->received_pages.clear();
+        if (request->call_finished_cb)
+            request->call_finished_cb();
+    }
 }
 
-void vk_call_api_items_impl(PurpleConnection* gc, const char* method_name,
-                            const CallParams_ptr& params, bool pagination,
-                            const CallProcessItemCb& call_process_item_cb,
-                            const CallFinishedCb& call_finished_cb, const CallErrorCb& error_cb,
-                            size_t offset)
+// Decodes the result of the call, which must contain "count" and "items". Spans of the items
+// are appended to items unless it is null. Returns false if the result is strange.
+bool read_items_result(const char* begin, const char* end, uint64& count, vector<JsonSpan>* items)
 {
-    if (offset > 0) {
-        vkcom_debug_info("    API call with offset %d\n", (int)offset);
-        add_or_replace_call_param(*params, "offset", to_string(offset).data());
+    bool is_object = false;
+    int64 count_value = 0;
+    bool has_count = false;
+    bool has_items = false;
+    bool ok = json_parse_text(begin, end, [&](JsonInput& in) {
+        return json_read_object(in, [&](JsonInput& field_in, const string& key) {
+            if (key == "count")
+                return json_read_int64(field_in, count_value, has_count);
+            if (key == "items")
+                return json_read_array(field_in, [&](JsonInput& item_in) {
+                    JsonSpan item;
+                    if (!json_skip_span(item_in, item))
+                        return false;
+                    if (items)
+                        items->push_back(item);
+                    return true;
+                }, has_items);
+            return json_skip(field_in);
+        }, is_object);
+    });
+    if (!ok || !is_object || !has_count || !has_items) {
+        vkcom_debug_error("Strange response, no 'count' and/or 'items' are present: %s\n",
+                          string(begin, end).data());
+        return false;
     }
+    count = count_value;
+    return true;
+}
 
-    vk_call_api(gc, method_name, *params, [=] (const picojson::value& result) {
-        if (!field_is_present<picojson::array>(result, "items")
-                || !field_is_present<double>(result, "count")) {
-            vkcom_debug_error("Strange response, no 'count' and/or 'items' are present: %s\n",
-                               result.serialize().data());
-            if (error_cb)
-                error_cb(picojson::value());
+// Requests the first page. The following pages are requested only after the first one is received,
+// so we process its items as soon as they arrive.
+void request_first_items_page(const ItemsRequest_ptr& request)
+{
+    // The number of items in the first page.
+    shared_ptr<size_t> page_size(new size_t(0));
+
+    request->pages_running++;
+    vk_call_api_streaming(request->gc, request->method_name.data(), request->params,
+                          [=](const char* begin, const char* end) {
+        if (request->finished)
+            return true;
+
+        (*page_size)++;
+        return request->call_process_item_cb(begin, end);
+    }, [=](const char* begin, const char* end) {
+        request->pages_running--;
+        if (request->finished)
+            return;
+
+        // The items have already been processed, only "count" is left in the result.
+        uint64 count;
+        if (!read_items_result(begin, end, count, nullptr)) {
+            fail_items_request(request, picojson::value());
             return;
         }
 
-        const picojson::array& items = result.get("items").get<picojson::array>();
-        for (const picojson::value& v: items)
-            call_process_item_cb(v);
+        request->count = count;
+        request->page_size = *page_size;
+        request->next_process_offset = *page_size;
+        if (!request->pagination || *page_size == 0)
+            request->next_request_offset = request->count;
+        else
+            request->next_request_offset = *page_size;
 
-        uint64 count = result.get("count").get<double>();
-        size_t next_offset = offset + items.size();
-        // Either we've received all items or method does not have pagination.
-        if (next_offset >= count || items.empty() || !pagination) {
-            if (call_finished_cb)
-                call_finished_cb();
-        } else {
-            vk_call_api_items_impl(gc, method_name, params, pagination, call_process_item_cb,
-                                   call_finished_cb, error_cb, next_offset);
+        process_items_pages(request);
+    }, [=](const picojson::value& error) {
+        request->pages_running--;
+        if (request->finished)
+            return;
+
+        fail_items_request(request, error);
+    }, request->priority);
+}
+
+void request_items_page(const ItemsRequest_ptr& request, size_t offset)
+{
+    CallParams params = request->params;
+    vkcom_debug_info("    API call with offset %d\n", (int)offset);
+    add_or_replace_call_param(params, "offset", to_string(offset).data());
+
+    request->pages_running++;
+    vk_call_api_raw(request->gc, request->method_name.data(), std::move(params),
+                    [=](const char* begin, const char* end) {
+        request->pages_running--;
+        // Either error has been reported or an empty page has been received earlier.
+        if (request->finished)
+            return;
+
+        uint64 count;
+        vector<JsonSpan> items;
+        if (!read_items_result(begin, end, count, &items)) {
+            fail_items_request(request, picojson::value());
+            return;
         }
-    }, error_cb);
+
+        // The text is valid only during the callback, so the page is stored until its turn comes.
+        ItemsPage& page = request->received_pages[offset];
+        page.text.assign(begin, end);
+        for (const JsonSpan& item: items)
+            page.items.emplace_back(item.first - begin, item.second - begin);
+
+        process_items_pages(request);
+    }, [=](const picojson::value& error) {
+        request->pages_running--;
+        if (request->finished)
+            return;
+
+        fail_items_request(request, error);
+    }, request->priority);
 }
 
 } // End of anonymous namespace
 
+void vk_call_api_items_raw(PurpleConnection* gc, const char* method_name, const CallParams& params,
+                           bool pagination, const CallRawProcessItemCb& call_process_item_cb,
+                           const CallFinishedCb& call_finished_cb, const CallErrorCb& error_cb,
+                           VkCallPriority priority)
+{
+    ItemsRequest_ptr request{ new ItemsRequest() };
+    request->gc = gc;
+    request->method_name = method_name;
+    request->params = params;
+    request->pagination = pagination;
+    request->call_process_item_cb = call_process_item_cb;
+    request->call_finished_cb = call_finished_cb;
+    request->error_cb = error_cb;
+    request->priority = priority;
+    request->count = 0;
+    request->page_size = 0;
+    request->next_request_offset = 0;
+    request->next_process_offset = 0;
+    request->pages_running = 0;
+    request->finished = false;
+
+    request_first_items_page(request);
+}
+
 void vk_call_api_items(PurpleConnection* gc, const char* method_name, const CallParams& params, bool pagination,
                        const CallProcessItemCb& call_process_item_cb, const CallFinishedCb& call_finished_cb,
-                       const CallErrorCb& error_cb)
+                       const CallErrorCb& error_cb, VkCallPriority priority)
 {
-    CallParams_ptr params_ptr{ new CallParams(params) };
-    vk_call_api_items_impl(gc, method_name, params_ptr, pagination, call_process_item_cb,
-                           call_finished_cb, error_cb, 0);
+    // Ids of processed items. Items may shift between pages if something gets added or removed
+    // in the middle of receiving, so we skip items, which have already been processed.
+    shared_ptr<set<uint64>> processed_ids(new set<uint64>());
+    string method_name_str = method_name;
+    vk_call_api_items_raw(gc, method_name, params, pagination, [=](const char* begin, const char* end) {
+        picojson::value v;
+        if (!json_parse_text(begin, end, [&](JsonInput& in) { return json_read_value(in, v); })) {
+            vkcom_debug_error("Error parsing item in result of %s\n", method_name_str.data());
+            return false;
+        }
+        if (field_is_present<double>(v, "id")
+                && !processed_ids->insert(json_get_uint64(v.get("id"))).second)
+            return true;
+        if (call_process_item_cb)
+            call_process_item_cb(v);
+        return true;
+    }, call_finished_cb, error_cb, priority);
 }
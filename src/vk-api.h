@@ -13,21 +13,79 @@ using std::pair;
 #include "contrib/picojson/picojson.h"
 
 // Calls method with params.
+//
+// Calls are not sent immediately: all calls made within a few milliseconds are packed together
+// into one "execute" request (up to 25 calls per request).
+//
+// params are stored until the call completes, so they are taken by value: pass them with std::move
+// if they are not needed afterwards to avoid copying.
+//
+// Calls with higher priority are sent before calls with lower priority if the calls have to wait
+// due to rate limiting.
 typedef vector<pair<string, string>> CallParams;
 typedef function_ptr<void(const picojson::value& result)> CallSuccessCb;
 typedef function_ptr<void(const picojson::value& error)> CallErrorCb;
-void vk_call_api(PurpleConnection* gc, const char* method_name, const CallParams& params,
-                 const CallSuccessCb& success_cb, const CallErrorCb& error_cb);
+enum VkCallPriority {
+    // Calls, which are initiated by the user and the user waits for them (sending messages etc.).
+    VK_CALL_PRIORITY_INTERACTIVE,
+    // Regular calls.
+    VK_CALL_PRIORITY_NORMAL,
+    // Bulk calls, e.g. receiving the message history or periodic updates.
+    VK_CALL_PRIORITY_BACKGROUND
+};
+void vk_call_api(PurpleConnection* gc, const char* method_name, CallParams params,
+                 const CallSuccessCb& success_cb, const CallErrorCb& error_cb,
+                 VkCallPriority priority = VK_CALL_PRIORITY_NORMAL);
+
+// Same as vk_call_api, but passes the text of the result to success_cb without building
+// the DOM. The text should be decoded with functions from jsonutils.h. It is valid only until
+// success_cb returns.
+typedef function_ptr<void(const char* begin, const char* end)> CallRawSuccessCb;
+void vk_call_api_raw(PurpleConnection* gc, const char* method_name, CallParams params,
+                     const CallRawSuccessCb& success_cb, const CallErrorCb& error_cb,
+                     VkCallPriority priority = VK_CALL_PRIORITY_NORMAL);
+
+// Results of calls to some methods, which only read data (users.get, groups.getById,
+// messages.getChat, utils.resolveScreenName), are cached for some time and identical calls
+// during that time are not sent at all. This function drops the cached results for the method,
+// which have id in the comma-separated list in param_name (e.g. "user_ids" for users.get), so that
+// the results for the other users or chats are kept. It must be called when the data is known
+// to have changed.
+void vk_call_api_invalidate_cache(PurpleConnection* gc, const char* method_name,
+                                  const char* param_name, uint64 id);
+
+// Immediately sends all calls, which have been delayed for batching. Must be called before
+// closing the connection if responses to the last calls are not needed.
+void vk_call_api_flush(PurpleConnection* gc);
+
+// Sends all calls, which modify something and have not been sent yet (e.g. account.setOffline
+// or messages.markAsRead), without waiting for the rate limit or for the responses. Calls, which
+// only read data, are dropped. Must be called right before closing the connection: the requests
+// are not bound to it, so they complete (or time out in a few seconds) after it is destroyed.
+void vk_call_api_flush_on_close(PurpleConnection* gc);
 
 // Helper function for calling APIs with "messages.get" or "messages.getDialogs" which return
 // "items" array as a part of return value and may accept "offset" as a parameter.
 //
 // pagination is true for methods which accept "offset", false otherwise,
-// call_process_item_cb is called for each item in the array,
+// call_process_item_cb is called for each item in the array (the items of the first page are
+// processed as soon as they are received, before the rest of the page arrives),
 // call_finished_cb is called upon completion,
-// error_cb is called upon error.
+// error_cb is called upon error,
+// priority is used for all the calls.
 typedef function_ptr<void(const picojson::value&)> CallProcessItemCb;
 typedef function_ptr<void()> CallFinishedCb;
 void vk_call_api_items(PurpleConnection* gc, const char* method_name, const CallParams& params,
                        bool pagination, const CallProcessItemCb& call_process_item_cb,
-                       const CallFinishedCb& call_finished_cb, const CallErrorCb& error_cb);
+                       const CallFinishedCb& call_finished_cb, const CallErrorCb& error_cb,
+                       VkCallPriority priority = VK_CALL_PRIORITY_NORMAL);
+
+// Same as vk_call_api_items, but passes the text of each item to call_process_item_cb without
+// building the DOM (see vk_call_api_raw). The text is valid only until the callback returns,
+// returning false fails the whole call. Unlike vk_call_api_items, the items are not checked
+// for duplicates: if they shift between pages while receiving, the same item may be passed twice.
+typedef function_ptr<bool(const char* begin, const char* end)> CallRawProcessItemCb;
+void vk_call_api_items_raw(PurpleConnection* gc, const char* method_name, const CallParams& params,
+                           bool pagination, const CallRawProcessItemCb& call_process_item_cb,
+                           const CallFinishedCb& call_finished_cb, const CallErrorCb& error_cb,
+                           VkCallPriority priority = VK_CALL_PRIORITY_NORMAL);
@@ -1,4 +1,5 @@
 #include "httputils.h"
+#include "jsonutils.h"
 #include "miscutils.h"
 #include "vk-api.h"
 #include "vk-chat.h"
@@ -14,55 +15,151 @@ namespace
 const char user_fields[] = "first_name,last_name,bdate,education,photo_50,photo_max_orig,"
                            "online,contacts,activity,last_seen,domain";
 
+// User information, as returned by friends.get, users.get and messages.getChat. It is decoded
+// directly from the response text by read_user_fields without building the DOM.
+struct UserFields
+{
+    // Text of the object, used only for logging and valid only during the API callback.
+    JsonSpan text;
+
+    bool has_id = false;
+    int64 id = 0;
+    bool has_first_name = false;
+    string first_name;
+    bool has_last_name = false;
+    string last_name;
+    bool has_deactivated = false;
+    string deactivated;
+    bool has_photo_50 = false;
+    string photo_50;
+    string activity;
+    string bdate;
+    string university_name;
+    bool has_faculty_name = false;
+    string faculty_name;
+    bool has_graduation = false;
+    double graduation = 0;
+    string photo_max_orig;
+    string mobile_phone;
+    string domain;
+    bool has_online = false;
+    double online = 0;
+    bool has_online_mobile = false;
+    double online_mobile = 0;
+    bool has_last_seen = false;
+    int64 last_seen = 0;
+};
+
+// Decodes one user object. is_object is set to true if the value is an object.
+bool read_user_fields(JsonInput& in, UserFields& fields, bool& is_object)
+{
+    in.skip_ws();
+    fields.text.first = in.pos();
+    bool ok = json_read_object(in, [&](JsonInput& field_in, const string& key) {
+        if (key == "id")
+            return json_read_int64(field_in, fields.id, fields.has_id);
+        if (key == "first_name")
+            return json_read_string(field_in, fields.first_name, fields.has_first_name);
+        if (key == "last_name")
+            return json_read_string(field_in, fields.last_name, fields.has_last_name);
+        if (key == "deactivated")
+            return json_read_string(field_in, fields.deactivated, fields.has_deactivated);
+        if (key == "photo_50")
+            return json_read_string(field_in, fields.photo_50, fields.has_photo_50);
+        if (key == "activity")
+            return json_read_string(field_in, fields.activity);
+        if (key == "bdate")
+            return json_read_string(field_in, fields.bdate);
+        if (key == "university_name")
+            return json_read_string(field_in, fields.university_name);
+        if (key == "faculty_name")
+            return json_read_string(field_in, fields.faculty_name, fields.has_faculty_name);
+        if (key == "graduation")
+            return json_read_number(field_in, fields.graduation, fields.has_graduation);
+        if (key == "photo_max_orig")
+            return json_read_string(field_in, fields.photo_max_orig);
+        if (key == "mobile_phone")
+            return json_read_string(field_in, fields.mobile_phone);
+        if (key == "domain")
+            return json_read_string(field_in, fields.domain);
+        if (key == "online")
+            return json_read_number(field_in, fields.online, fields.has_online);
+        if (key == "online_mobile")
+            return json_read_number(field_in, fields.online_mobile, fields.has_online_mobile);
+        if (key == "last_seen")
+            return json_read_object(field_in, [&](JsonInput& time_in, const string& time_key) {
+                if (time_key == "time")
+                    return json_read_int64(time_in, fields.last_seen, fields.has_last_seen);
+                return json_skip(time_in);
+            });
+        return json_skip(field_in);
+    }, is_object);
+    fields.text.second = in.pos();
+    return ok;
+}
+
+// Decodes an array of user objects. Items, which are not objects, are logged and skipped.
+// is_array is set to true if the value is an array.
+bool read_user_array(JsonInput& in, vector<UserFields>& users, bool& is_array)
+{
+    return json_read_array(in, [&](JsonInput& item_in) {
+        UserFields fields;
+        bool is_object = false;
+        if (!read_user_fields(item_in, fields, is_object))
+            return false;
+        if (is_object)
+            users.push_back(std::move(fields));
+        else
+            vkcom_debug_error("Strange user information: %s\n",
+                              string(fields.text.first, fields.text.second).data());
+        return true;
+    }, is_array);
+}
+
 // Creates single string from multiple fields in user_fields, describing education.
-string make_education_string(const picojson::value& v)
+string make_education_string(const UserFields& fields)
 {
-    string ret;
-    if (field_is_present<string>(v, "university_name")) {
-        ret = v.get("university_name").get<string>();
-        if (ret.empty())
-            return ret;
-        if (field_is_present<string>(v, "faculty_name"))
-            ret = v.get("faculty_name").get<string>() +  ", " + ret;
-        if (field_is_present<double>(v, "graduation")) {
-            int graduation = int(v.get("graduation").get<double>());
-            if (graduation != 0) {
-                ret += " ";
-
-                char buf[128];
-                // Strip '20' from graduation year
-                if (graduation >= 2000)
-                    sprintf(buf, "'%02d", graduation % 100);
-                else
-                    sprintf(buf, "%d", graduation);
-                ret += buf;
-            }
+    string ret = fields.university_name;
+    if (ret.empty())
+        return ret;
+    if (fields.has_faculty_name)
+        ret = fields.faculty_name +  ", " + ret;
+    if (fields.has_graduation) {
+        int graduation = int(fields.graduation);
+        if (graduation != 0) {
+            ret += " ";
+
+            char buf[128];
+            // Strip '20' from graduation year
+            if (graduation >= 2000)
+                sprintf(buf, "'%02d", graduation % 100);
+            else
+                sprintf(buf, "%d", graduation);
+            ret += buf;
         }
     }
     return ret;
 }
 
 // Updates user info about user.
-void update_user_info_from(PurpleConnection* gc, const picojson::value& fields)
+void update_user_info_from(PurpleConnection* gc, const UserFields& fields)
 {
-    if (!field_is_present<double>(fields, "id")
-            || !field_is_present<string>(fields, "first_name")
-            || !field_is_present<string>(fields, "last_name")) {
+    if (!fields.has_id || !fields.has_first_name || !fields.has_last_name) {
         vkcom_debug_error("Incomplete user information in friends.get or users.get: %s\n",
-                           picojson::value(fields).serialize().data());
+                           string(fields.text.first, fields.text.second).data());
         return;
     }
-    uint64 user_id = fields.get("id").get<double>();
+    uint64 user_id = fields.id;
 
     VkUserInfo& info = get_data(gc).user_infos[user_id];
-    info.real_name = fields.get("first_name").get<string>() + " " + fields.get("last_name").get<string>();
+    info.real_name = fields.first_name + " " + fields.last_name;
 
     // This usually means that user has been deleted.
-    if (field_is_present<string>(fields, "deactivated"))
+    if (fields.has_deactivated)
         return;
 
-    if (field_is_present<string>(fields, "photo_50")) {
-        info.photo_min = fields.get("photo_50").get<string>();
+    if (fields.has_photo_50) {
+        info.photo_min = fields.photo_50;
         static const char empty_photo_a[] = "http://vkontakte.ru/images/camera_a.gif";
         static const char empty_photo_b[] = "http://vkontakte.ru/images/camera_b.gif";
         static const char empty_photo_c[] = "https://vk.com/images/camera_c.gif";
@@ -71,40 +168,18 @@ void update_user_info_from(PurpleConnection* gc, const picojson::value& fields)
             info.photo_min.clear();
     }
 
-    if (field_is_present<string>(fields, "activity"))
-        info.activity = unescape_html(fields.get("activity").get<string>());
-    else
-        info.activity.clear();
-
-    if (field_is_present<string>(fields, "bdate"))
-        info.bdate = unescape_html(fields.get("bdate").get<string>());
-    else
-        info.bdate.clear();
-
+    info.activity = unescape_html(fields.activity);
+    info.bdate = unescape_html(fields.bdate);
     info.education = unescape_html(make_education_string(fields));
+    info.photo_max = fields.photo_max_orig;
+    info.mobile_phone = unescape_html(fields.mobile_phone);
 
-    if (field_is_present<string>(fields, "photo_max_orig"))
-        info.photo_max = fields.get("photo_max_orig").get<string>();
-    else
-        info.photo_max.clear();
-
-    if (field_is_present<string>(fields, "mobile_phone"))
-        info.mobile_phone = unescape_html(fields.get("mobile_phone").get<string>());
-    else
-        info.mobile_phone.clear();
-
-    if (field_is_present<string>(fields, "domain"))
-        info.domain = fields.get("domain").get<string>();
-    else
-        info.domain.clear();
+    info.domain = fields.domain;
     if (info.domain == user_name_from_id(user_id))
         info.domain.clear();
 
-    bool online = false;
-    if (field_is_present<double>(fields, "online"))
-        online = fields.get("online").get<double>() == 1;
-
-    bool online_mobile = field_is_present<double>(fields, "online_mobile");
+    bool online = fields.has_online && fields.online == 1;
+    bool online_mobile = fields.has_online_mobile;
 
     // Update presence only for non-friends.
     if (!is_user_friend(gc, user_id)) {
@@ -118,24 +193,21 @@ void update_user_info_from(PurpleConnection* gc, const picojson::value& fields)
                               info.online, info.online_mobile);
     }
 
-    if (field_is_present<picojson::object>(fields, "last_seen"))
-        info.last_seen = fields.get("last_seen").get("time").get<double>();
+    if (fields.has_last_seen)
+        info.last_seen = fields.last_seen;
 }
 
-// Returns all "id" elements from each item in items.
-set<uint64> get_ids_from_items(const picojson::array& items)
+// Returns ids of all users.
+set<uint64> get_ids_from_users(const vector<UserFields>& users)
 {
     set<uint64> ret;
-    for (const picojson::value& it: items) {
-        if (!it.is<picojson::object>()) {
-            vkcom_debug_error("Strange response: %s\n", it.serialize().data());
+    for (const UserFields& fields: users) {
+        if (!fields.has_id) {
+            vkcom_debug_error("Strange response: %s\n",
+                              string(fields.text.first, fields.text.second).data());
             return set<uint64>();
         }
-        if (!field_is_present<double>(it, "id")) {
-            vkcom_debug_error("Strange response: %s\n", it.serialize().data());
-            return set<uint64>();
-        }
-        uint64 id = it.get("id").get<double>();
+        uint64 id = fields.id;
         ret.insert(id);
     }
     return ret;
@@ -146,34 +218,30 @@ void update_friends_info(PurpleConnection* gc, const SuccessCb& success_cb)
 {
     CallParams params = { {"user_id", to_string(get_data(gc).self_user_id())},
                           {"fields", user_fields} };
-    vk_call_api(gc, "friends.get", params, [=](const picojson::value& result) {
-        if (!result.is<picojson::object>()) {
-            vkcom_debug_error("Strange response from friends.get: %s\n", result.serialize().data());
-            purple_connection_error_reason(gc, PURPLE_CONNECTION_ERROR_NETWORK_ERROR,
-                                           i18n("Unable to update user infos"));
-            return;
-        }
-
-        if (!result.get("items").is<picojson::array>()) {
-            vkcom_debug_error("Strange response from friends.get: %s\n", result.serialize().data());
+    vk_call_api_raw(gc, "friends.get", params, [=](const char* begin, const char* end) {
+        vector<UserFields> items;
+        bool is_object = false;
+        bool has_items = false;
+        bool ok = json_parse_text(begin, end, [&](JsonInput& in) {
+            return json_read_object(in, [&](JsonInput& field_in, const string& key) {
+                if (key == "items")
+                    return read_user_array(field_in, items, has_items);
+                return json_skip(field_in);
+            }, is_object);
+        });
+        if (!ok || !is_object || !has_items) {
+            vkcom_debug_error("Strange response from friends.get: %s\n", string(begin, end).data());
             purple_connection_error_reason(gc, PURPLE_CONNECTION_ERROR_NETWORK_ERROR,
                                            i18n("Unable to update user infos"));
             return;
         }
-        const picojson::array& items = result.get("items").get<picojson::array>();
 
         // We must update friend_user_ids before we update user infos, because we do not want
         // to update presence information.
-        get_data(gc).friend_user_ids = get_ids_from_items(items);
+        get_data(gc).friend_user_ids = get_ids_from_users(items);
 
-        for (const picojson::value& v: items) {
-            if (!v.is<picojson::object>()) {
-                vkcom_debug_error("Strange response from friends.get: %s\n", v.serialize().data());
-                continue;
-            }
-
-            update_user_info_from(gc, v);
-        }
+        for (const UserFields& fields: items)
+            update_user_info_from(gc, fields);
 
         success_cb();
     }, [=](const picojson::value&) {
@@ -208,7 +276,7 @@ void get_users_chats_from_dialogs_impl(PurpleConnection* gc, const SuccessCb& su
 
         VkData& gc_data = get_data(gc);
 
-        uint64 count = v.get("count").get<double>();
+        uint64 count = json_get_uint64(v.get("count"));
         const picojson::array& items = v.get("items").get<picojson::array>();
         for (const picojson::value& m: items) {
             if (!field_is_present<picojson::object>(m, "message")) {
@@ -240,7 +308,7 @@ void get_users_chats_from_dialogs_impl(PurpleConnection* gc, const SuccessCb& su
 
                 // NOTE: we could parse chat title and participants and add entries to chat_infos,
                 // but it's easier to do it via update_chat_infos.
-                uint64 chat_id = message.get("chat_id").get<double>();
+                uint64 chat_id = json_get_uint64(message.get("chat_id"));
                 data->chat_ids.insert(chat_id);
             } else {
                 if (!field_is_present<double>(message, "user_id")) {
@@ -251,7 +319,7 @@ void get_users_chats_from_dialogs_impl(PurpleConnection* gc, const SuccessCb& su
                     return;
                 }
 
-                uint64 user_id = message.get("user_id").get<double>();
+                uint64 user_id = json_get_uint64(message.get("user_id"));
                 data->user_ids.insert(user_id);
             }
         }
@@ -464,20 +532,31 @@ void update_buddy_presence_impl(PurpleConnection* gc, const string& buddy_name,
     purple_prpl_got_user_status(account, buddy_name.data(), get_user_status(info), nullptr);
 }
 
-// We do not want to download more than one icon at once, so we have a queue. Fortunately, there
-// is no need for locks, as we run everything from the main thread.
+// Buddy icon, which waits to be downloaded.
 struct FetchBuddyIcon
 {
-    PurpleConnection* gc;
     string buddy_name;
     string icon_url;
 };
 
-vector<FetchBuddyIcon> fetch_queue;
-// Number of currently running HTTP requests.
-int fetches_running = 0;
-// Maximum number of concurrently running HTTP requests
-const int MAX_FETCHES_RUNNING = 4;
+} // End of anonymous namespace
+
+// We limit the number of icons, which are downloaded at once, so that they do not delay other
+// media downloads for too long. The queue belongs to the connection: all running downloads
+// are cancelled upon logout along with the queue.
+struct BuddyIconFetches
+{
+    vector<FetchBuddyIcon> queue;
+    // Number of currently running HTTP requests.
+    int running = 0;
+};
+
+namespace
+{
+
+// Maximum number of concurrently running HTTP requests. The actual number of connections
+// is limited by the media keep-alive pool.
+const int MAX_FETCHES_RUNNING = 16;
 
 string get_filename(const char* url)
 {
@@ -486,39 +565,51 @@ string get_filename(const char* url)
     return ret;
 }
 
-void fetch_next_buddy_icon()
+BuddyIconFetches& get_buddy_icon_fetches(PurpleConnection* gc)
+{
+    VkData& gc_data = get_data(gc);
+    if (!gc_data.buddy_icon_fetches)
+        gc_data.buddy_icon_fetches.reset(new BuddyIconFetches());
+    return *gc_data.buddy_icon_fetches;
+}
+
+void fetch_next_buddy_icon(PurpleConnection* gc)
 {
-    FetchBuddyIcon fetch = fetch_queue.back();
-    fetch_queue.pop_back();
-    fetches_running++;
+    BuddyIconFetches& fetches = get_buddy_icon_fetches(gc);
+    FetchBuddyIcon fetch = fetches.queue.back();
+    fetches.queue.pop_back();
+    fetches.running++;
     vkcom_debug_info("Load buddy icon from %s\n", fetch.icon_url.data());
-    http_get(fetch.gc, fetch.icon_url, [=](PurpleHttpConnection* http_conn, PurpleHttpResponse* response) {
+    http_get(gc, fetch.icon_url, [=](PurpleHttpConnection* http_conn, PurpleHttpResponse* response) {
         vkcom_debug_info("Updating buddy icon for %s\n", fetch.buddy_name.data());
         if (!purple_http_response_is_successful(response)) {
             vkcom_debug_error("Error while fetching buddy icon: %s\n",
                                purple_http_response_get_error(response));
         } else {
             size_t icon_len;
-            const void* icon_data = purple_http_response_get_data(response, &icon_len);
+            // purple_buddy_icons_set_for_user takes ownership of the data.
+            char* icon_data = purple_http_response_steal_data(response, &icon_len);
             const char* icon_url = purple_http_request_get_url(purple_http_conn_get_request(http_conn));
             // This should be synchronized with code in update_buddy_in_blist.
             string checksum = get_filename(icon_url);
-            purple_buddy_icons_set_for_user(purple_connection_get_account(fetch.gc), fetch.buddy_name.data(),
-                                            g_memdup(icon_data, icon_len), icon_len, checksum.data());
+            purple_buddy_icons_set_for_user(purple_connection_get_account(gc), fetch.buddy_name.data(),
+                                            icon_data, icon_len, checksum.data());
         }
 
-        fetches_running--;
-        if (!fetch_queue.empty())
-            fetch_next_buddy_icon();
-    });
+        BuddyIconFetches& fetches = get_buddy_icon_fetches(gc);
+        fetches.running--;
+        if (!fetches.queue.empty())
+            fetch_next_buddy_icon(gc);
+    }, VK_HTTP_POOL_MEDIA);
 }
 
 // Starts downloading buddy icon and sets it upon finishing.
 void fetch_buddy_icon(PurpleConnection* gc, const string& buddy_name, const string& icon_url)
 {
-    fetch_queue.push_back(FetchBuddyIcon{ gc, buddy_name, icon_url });
-    if (fetches_running < MAX_FETCHES_RUNNING)
-        fetch_next_buddy_icon();
+    BuddyIconFetches& fetches = get_buddy_icon_fetches(gc);
+    fetches.queue.push_back(FetchBuddyIcon{ buddy_name, icon_url });
+    if (fetches.running < MAX_FETCHES_RUNNING)
+        fetch_next_buddy_icon(gc);
 }
 
 // Adds or updates blist node for user_id.
@@ -779,7 +870,7 @@ void update_friends_presence(PurpleConnection* gc, const SuccessCb& on_update_cb
                 return;
             }
 
-            uint64 user_id = v.get<double>();
+            uint64 user_id = json_get_uint64(v);
             friend_user_ids.insert(user_id);
             VkUserInfo& info = gc_data.user_infos[user_id];
             if (info.online && !info.online_mobile)
@@ -800,7 +891,7 @@ void update_friends_presence(PurpleConnection* gc, const SuccessCb& on_update_cb
                 return;
             }
 
-            uint64 user_id = v.get<double>();
+            uint64 user_id = json_get_uint64(v);
             friend_user_ids.insert(user_id);
             VkUserInfo& info = gc_data.user_infos[user_id];
             if (info.online && info.online_mobile)
@@ -856,8 +947,8 @@ void update_open_conv_presence(PurpleConnection *gc)
                                    v.serialize().data());
                 continue;
             }
-            uint64 user_id = v.get("id").get<double>();
-            bool online = v.get("online").get<double>() == 1;
+            uint64 user_id = json_get_uint64(v.get("id"));
+            bool online = v.get("online").as_double() == 1;
             bool online_mobile = field_is_present<double>(v, "online_mobile");
             vkcom_debug_info("Got status %d, %d for %llu\n", online, online_mobile,
                              (unsigned long long)user_id);
@@ -889,22 +980,22 @@ void update_user_infos(PurpleConnection* gc, const set<uint64>& user_ids, const
 
     CallParams params = { {"fields", user_fields},
                           {"user_ids", str_concat_int(',', user_ids)} };
-    vk_call_api(gc, "users.get", params, [=](const picojson::value& result) {
-        if (!result.is<picojson::array>()) {
-            vkcom_debug_error("Strange response from users.get: %s\n", result.serialize().data());
+    vk_call_api_raw(gc, "users.get", params, [=](const char* begin, const char* end) {
+        vector<UserFields> users;
+        bool is_array = false;
+        bool ok = json_parse_text(begin, end, [&](JsonInput& in) {
+            return read_user_array(in, users, is_array);
+        });
+        if (!ok || !is_array) {
+            vkcom_debug_error("Strange response from users.get: %s\n", string(begin, end).data());
             purple_connection_error_reason(gc, PURPLE_CONNECTION_ERROR_NETWORK_ERROR,
                                            i18n("Unable to update user infos"));
             return;
         }
 
         // Adds or updates buddies in result and forms the active set of buddy ids.
-        for (const picojson::value& v: result.get<picojson::array>()) {
-            if (!v.is<picojson::object>()) {
-                vkcom_debug_error("Strange response from users.get: %s\n", v.serialize().data());
-                continue;
-            }
-            update_user_info_from(gc, v);
-        }
+        for (const UserFields& fields: users)
+            update_user_info_from(gc, fields);
 
         if (on_update_cb)
             on_update_cb();
@@ -913,46 +1004,78 @@ void update_user_infos(PurpleConnection* gc, const set<uint64>& user_ids, const
         // guarantees that it won't happen in the future).
         if (on_update_cb)
             on_update_cb();
-    });
+    }, VK_CALL_PRIORITY_BACKGROUND);
 }
 
 namespace
 {
 
+// Chat information, as returned by messages.getChat.
+struct ChatFields
+{
+    // Text of the object, used only for logging and valid only during the API callback.
+    JsonSpan text;
+
+    bool has_id = false;
+    int64 id = 0;
+    bool has_title = false;
+    string title;
+    bool has_admin_id = false;
+    int64 admin_id = 0;
+    bool has_users = false;
+    vector<UserFields> users;
+};
+
+// Decodes one chat object. is_object is set to true if the value is an object.
+bool read_chat_fields(JsonInput& in, ChatFields& fields, bool& is_object)
+{
+    in.skip_ws();
+    fields.text.first = in.pos();
+    bool ok = json_read_object(in, [&](JsonInput& field_in, const string& key) {
+        if (key == "id")
+            return json_read_int64(field_in, fields.id, fields.has_id);
+        if (key == "title")
+            return json_read_string(field_in, fields.title, fields.has_title);
+        if (key == "admin_id")
+            return json_read_int64(field_in, fields.admin_id, fields.has_admin_id);
+        if (key == "users")
+            return read_user_array(field_in, fields.users, fields.has_users);
+        return json_skip(field_in);
+    }, is_object);
+    fields.text.second = in.pos();
+    return ok;
+}
+
 // Updates one entry in chat_infos. update_blist has the same meaning as in update_chat_infos
-void update_chat_info_from(PurpleConnection* gc, const picojson::value& chat,
-                           bool update_blist = false)
+void update_chat_info_from(PurpleConnection* gc, const ChatFields& chat, bool update_blist = false)
 {
-    if (!field_is_present<double>(chat, "id") || !field_is_present<string>(chat, "title")
-            || !field_is_present<double>(chat, "admin_id")
-            || !field_is_present<picojson::array>(chat, "users")) {
-        vkcom_debug_error("Strange response from messages.getChat: %s\n", chat.serialize().data());
+    string chat_text(chat.text.first, chat.text.second);
+    if (!chat.has_id || !chat.has_title || !chat.has_admin_id || !chat.has_users) {
+        vkcom_debug_error("Strange response from messages.getChat: %s\n", chat_text.data());
         purple_connection_error_reason(gc, PURPLE_CONNECTION_ERROR_NETWORK_ERROR,
                                        i18n("Unable to retrieve chat info"));
         return;
     }
 
-    uint64 chat_id = chat.get("id").get<double>();
+    uint64 chat_id = chat.id;
     VkData& gc_data = get_data(gc);
     VkChatInfo& info = gc_data.chat_infos[chat_id];
-    info.admin_id = chat.get("admin_id").get<double>();
-    info.title = chat.get("title").get<string>();
+    info.admin_id = chat.admin_id;
+    info.title = chat.title;
 
     info.participants.clear();
     set<string> already_used_names;
 
-    const picojson::array& users = chat.get("users").get<picojson::array>();
-    for (const picojson::value& u: users) {
-        if (!field_is_present<double>(u, "id")) {
-            vkcom_debug_error("Strange response from messages.getChat: %s\n",
-                              chat.serialize().data());
+    for (const UserFields& u: chat.users) {
+        if (!u.has_id) {
+            vkcom_debug_error("Strange response from messages.getChat: %s\n", chat_text.data());
             purple_connection_error_reason(gc, PURPLE_CONNECTION_ERROR_NETWORK_ERROR,
                                            i18n("Unable to retrieve chat info"));
             return;
         }
 
         // E-mail participants are less than zero, let's just ignore them. Also, ignore the user.
-        int64 user_id = u.get("id").get<double>();
+        int64 user_id = u.id;
         if (user_id < 0 || gc_data.self_user_id() == (uint64)user_id)
             continue;
 
@@ -996,16 +1119,24 @@ void update_chat_infos(PurpleConnection* gc, const set<uint64>& chat_ids,
 
     CallParams params = { {"fields", user_fields},
                           {"chat_ids", str_concat_int(',', chat_ids)} };
-    vk_call_api(gc, "messages.getChat", params, [=](const picojson::value& v) {
-        if (!v.is<picojson::array>()) {
-            vkcom_debug_error("Strange response from messages.getChat: %s\n", v.serialize().data());
+    vk_call_api_raw(gc, "messages.getChat", params, [=](const char* begin, const char* end) {
+        vector<ChatFields> chats;
+        bool is_array = false;
+        bool ok = json_parse_text(begin, end, [&](JsonInput& in) {
+            return json_read_array(in, [&](JsonInput& item_in) {
+                chats.push_back(ChatFields());
+                bool is_object = false;
+                return read_chat_fields(item_in, chats.back(), is_object);
+            }, is_array);
+        });
+        if (!ok || !is_array) {
+            vkcom_debug_error("Strange response from messages.getChat: %s\n", string(begin, end).data());
             purple_connection_error_reason(gc, PURPLE_CONNECTION_ERROR_NETWORK_ERROR,
                                            i18n("Unable to retrieve chat info"));
             return;
         }
 
-        const picojson::array& a = v.get<picojson::array>();
-        for (const picojson::value& chat: a)
+        for (const ChatFields& chat: chats)
             update_chat_info_from(gc, chat, update_blist);
 
         if (on_update_cb)
@@ -79,5 +79,5 @@ void request_captcha(PurpleConnection* gc, const string& captcha_img, const Capt
                               i18n("Ok"), G_CALLBACK(request_captcha_ok),
                               i18n("Cancel"), G_CALLBACK(request_captcha_cancel),
                               purple_connection_get_account(gc), nullptr, nullptr, data);
-    });
+    }, VK_HTTP_POOL_MEDIA);
 }
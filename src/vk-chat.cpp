@@ -250,11 +250,12 @@ void add_user_to_chat(PurpleConnection* gc, uint64 chat_id, uint64 user_id)
             return;
         }
 
-        if (result.get<double>() != 1.0) {
+        if (result.as_double() != 1.0) {
             show_add_user_error(gc, chat_id, user_id);
             return;
         }
 
+        vk_call_api_invalidate_cache(gc, "messages.getChat", "chat_ids", chat_id);
         add_user_to_chat_info(gc, chat_id, user_id);
         update_chat_conv(gc, chat_id);
     }, [=] (const picojson::value&) {
@@ -275,11 +276,12 @@ void remove_user_from_chat(PurpleConnection* gc, uint64 chat_id, uint64 user_id)
             return;
         }
 
-        if (result.get<double>() != 1.0) {
+        if (result.as_double() != 1.0) {
             show_remove_user_error(gc, chat_id, user_id);
             return;
         }
 
+        vk_call_api_invalidate_cache(gc, "messages.getChat", "chat_ids", chat_id);
         remove_user_from_chat_info(gc, chat_id, user_id);
         update_chat_conv(gc, chat_id);
     }, [=] (const picojson::value&) {
@@ -303,11 +305,12 @@ void set_chat_title(PurpleConnection* gc, uint64 chat_id, const char* title)
             return;
         }
 
-        if (result.get<double>() != 1.0) {
+        if (result.as_double() != 1.0) {
             show_set_title_error(gc, chat_id);
             return;
         }
 
+        vk_call_api_invalidate_cache(gc, "messages.getChat", "chat_ids", chat_id);
         VkChatInfo& info = get_data(gc).chat_infos[chat_id];
         info.title = title_str;
         update_chat_conv(gc, chat_id);
@@ -12,6 +12,9 @@ const char VK_PERMISSIONS[] = "friends,photos,audio,video,docs,status,messages,o
 
 namespace {
 
+// Maximum number of API requests, which may wait for responses on one connection.
+const unsigned API_PIPELINE_DEPTH = 4;
+
 // Splits the comma-separated string of integers.
 set<uint64> str_split_int(const char* str)
 {
@@ -45,9 +48,9 @@ vector<VkReceivedMessage> deferred_mark_as_read_from_string(const char* str)
     const picojson::array& a = v.get<picojson::array>();
     for (const picojson::value& d: a) {
         VkReceivedMessage msg;
-        msg.msg_id = d.get("msg_id").get<double>();
-        msg.user_id = d.get("user_id").get<double>();
-        msg.chat_id = d.get("chat_id").get<double>();
+        msg.msg_id = json_get_uint64(d.get("msg_id"));
+        msg.user_id = json_get_uint64(d.get("user_id"));
+        msg.chat_id = json_get_uint64(d.get("chat_id"));
         messages.push_back(std::move(msg));
     }
 
@@ -64,9 +67,9 @@ string deferred_mark_as_read_to_string(const vector<VkReceivedMessage>& messages
     picojson::array a;
     for (const VkReceivedMessage& msg: messages) {
         picojson::object d = {
-            {"msg_id",  picojson::value((double)msg.msg_id)},
-            {"user_id", picojson::value((double)msg.user_id)},
-            {"chat_id", picojson::value((double)msg.chat_id)},
+            {"msg_id",  picojson::value((int64)msg.msg_id)},
+            {"user_id", picojson::value((int64)msg.user_id)},
+            {"chat_id", picojson::value((int64)msg.chat_id)},
         };
         a.push_back(picojson::value(d));
     }
@@ -93,10 +96,10 @@ map<uint64, VkUploadedDocInfo> uploaded_docs_from_string(const char* str)
                 || !field_is_present<string>(d, "url"))
             continue;
 
-        uint64 id = d.get("id").get<double>();
+        uint64 id = json_get_uint64(d.get("id"));
         VkUploadedDocInfo& doc = docs[id];
         doc.filename = d.get("filename").get<string>();
-        doc.size = d.get("size").get<double>();
+        doc.size = json_get_uint64(d.get("size"));
         doc.md5sum = d.get("md5sum").get<string>();
         doc.url = d.get("url").get<string>();
     }
@@ -111,9 +114,9 @@ string uploaded_docs_to_string(const map<uint64, VkUploadedDocInfo>& docs)
         uint64 id = p.first;
         const VkUploadedDocInfo& doc = p.second;
         picojson::object d = {
-            {"id",  picojson::value((double)id)},
+            {"id",  picojson::value((int64)id)},
             {"filename", picojson::value(doc.filename)},
-            {"size", picojson::value((double)doc.size)},
+            {"size", picojson::value((int64)doc.size)},
             {"md5sum", picojson::value(doc.md5sum)},
             {"url", picojson::value(doc.url)}
         };
@@ -152,11 +155,13 @@ bool check_if_webkit_enabled()
 } // End of anonymous namespace
 
 VkData::VkData(PurpleConnection* gc, const string& email, const string& password)
-    : m_email(email),
+    : idle_since(0),
+      m_email(email),
       m_password(password),
+      m_authenticating(false),
       m_gc(gc),
       m_closing(false),
-      m_keepalive_pool(nullptr)
+      m_keepalive_pools()
 {
     PurpleAccount* account = purple_connection_get_account(m_gc);
 
@@ -179,6 +184,11 @@ VkData::VkData(PurpleConnection* gc, const string& email, const string& password
     m_options.imitate_mobile_client = purple_account_get_bool(account, "imitate_mobile_client", false);
     m_options.blist_default_group = purple_account_get_string(account, "blist_default_group", "");
     m_options.blist_chat_group = purple_account_get_string(account, "blist_chat_group", "");
+    m_options.api_connections = purple_account_get_int(account, "api_connections", 4);
+    m_options.long_poll_connections = purple_account_get_int(account, "long_poll_connections", 2);
+    m_options.media_connections = purple_account_get_int(account, "media_connections", 4);
+    m_options.upload_connections = purple_account_get_int(account, "upload_connections", 2);
+    m_options.api_pipelining = purple_account_get_bool(account, "api_pipelining", false);
 
     const char* str = purple_account_get_string(account, "manually_added_buddies", "");
     m_manually_added_buddies = str_split_int(str);
@@ -233,8 +243,9 @@ VkData::~VkData()
     for (unsigned id: timeout_ids_copy)
         g_source_remove(id);
 
-    if (m_keepalive_pool)
-        purple_http_keepalive_pool_unref(m_keepalive_pool);
+    for (PurpleHttpKeepalivePool* pool: m_keepalive_pools)
+        if (pool)
+            purple_http_keepalive_pool_unref(pool);
 }
 
 void VkData::authenticate(const SuccessCb& success_cb, const ErrorCb& error_cb)
@@ -245,6 +256,13 @@ void VkData::authenticate(const SuccessCb& success_cb, const ErrorCb& error_cb)
         return;
     }
 
+    m_auth_waiters.emplace_back(success_cb, error_cb);
+    if (m_authenticating) {
+        vkcom_debug_info("Authentication already in progress, waiting for it to finish\n");
+        return;
+    }
+    m_authenticating = true;
+
     vk_auth_user(m_gc, m_email, m_password, VK_CLIENT_ID, VK_PERMISSIONS,
                  m_options.imitate_mobile_client,
         [=](const string& access_token, const string& self_user_id) {
@@ -263,23 +281,64 @@ void VkData::authenticate(const SuccessCb& success_cb, const ErrorCb& error_cb)
                 vkcom_debug_error("Error converting user id %s to integer\n", self_user_id.data());
                 purple_connection_error_reason(m_gc, PURPLE_CONNECTION_ERROR_OTHER_ERROR,
                                                i18n("Authentication process failed"));
-                error_cb();
+                finish_authentication(false);
+                return;
             }
-            success_cb();
+            finish_authentication(true);
     }, [=] {
         vkcom_debug_error("Unable to authenticate, connection will be terminated\n");
         purple_connection_error_reason(m_gc, PURPLE_CONNECTION_ERROR_NETWORK_ERROR,
                                        i18n("Unable to connect to Long Poll server"));
-        error_cb();
+        finish_authentication(false);
     });
 }
 
-PurpleHttpKeepalivePool* VkData::get_keepalive_pool()
+void VkData::finish_authentication(bool success)
 {
-    if (!m_keepalive_pool)
-        m_keepalive_pool = purple_http_keepalive_pool_new();
+    m_authenticating = false;
+    // Callbacks may start new authentication, so we clear the list before calling them.
+    vector<pair<SuccessCb, ErrorCb>> waiters;
+    waiters.swap(m_auth_waiters);
+    for (const pair<SuccessCb, ErrorCb>& waiter: waiters) {
+        if (success) {
+            if (waiter.first)
+                waiter.first();
+        } else {
+            if (waiter.second)
+                waiter.second();
+        }
+    }
+}
+
+PurpleHttpKeepalivePool* VkData::get_keepalive_pool(VkHttpPool pool)
+{
+    if (!m_keepalive_pools[pool]) {
+        int limit_per_host = 0;
+        switch (pool) {
+        case VK_HTTP_POOL_API:
+            limit_per_host = m_options.api_connections;
+            break;
+        case VK_HTTP_POOL_LONG_POLL:
+            limit_per_host = m_options.long_poll_connections;
+            break;
+        case VK_HTTP_POOL_MEDIA:
+            limit_per_host = m_options.media_connections;
+            break;
+        case VK_HTTP_POOL_UPLOAD:
+            limit_per_host = m_options.upload_connections;
+            break;
+        default:
+            break;
+        }
+
+        m_keepalive_pools[pool] = purple_http_keepalive_pool_new();
+        if (limit_per_host > 0)
+            purple_http_keepalive_pool_set_limit_per_host(m_keepalive_pools[pool], limit_per_host);
+        if (pool == VK_HTTP_POOL_API && m_options.api_pipelining)
+            purple_http_keepalive_pool_set_pipeline_depth(m_keepalive_pools[pool], API_PIPELINE_DEPTH);
+    }
 
-    return m_keepalive_pool;
+    return m_keepalive_pools[pool];
 }
 
 
@@ -13,6 +13,7 @@ using std::set;
 
 #include "common.h"
 #include "contrib/purple/http.h"
+#include "httputils.h"
 
 // We get connection options and store in this structure on login because we have no way
 // of knowing when the account options have been changed, so we want to prevent potential
@@ -28,6 +29,13 @@ struct VkOptions
     bool enable_webkit_workarounds;
     string blist_default_group;
     string blist_chat_group;
+    // Maximum number of simultaneous connections per host for each VkHttpPool, 0 means no limit.
+    int api_connections;
+    int long_poll_connections;
+    int media_connections;
+    int upload_connections;
+    // Send read-only API calls without waiting for the responses to the previous ones.
+    bool api_pipelining;
 };
 
 // Several useful error codes
@@ -127,6 +135,19 @@ typedef function_ptr<bool()> TimeoutCb;
 void timeout_add(PurpleConnection* gc, unsigned milliseconds, const TimeoutCb& callback);
 
 
+// State of API calls dispatcher, see vk-api.cpp.
+struct VkApiDispatcher;
+// Per-host circuit breakers for HTTP requests, see httputils.cpp.
+struct HttpCircuitBreakers;
+// Cached redirects, see httputils.cpp.
+struct HttpRedirectCache;
+// Queue of buddy icons to download, see vk-buddy.cpp.
+struct BuddyIconFetches;
+// Ids of messages to receive in one batch, see vk-message-recv.cpp.
+struct MessagesToReceive;
+// File transfers, which are being uploaded, see vk-filexfer.cpp.
+struct RunningXfers;
+
 // Data, associated with account. It contains all information, required for connecting and executing
 // API calls.
 class VkData
@@ -139,7 +160,8 @@ public:
 
     // Perform authentication. access_token is set upon successful authentication.
     // Authentication is performed only if access_token is empty, otherwise
-    // success_cb is called immediately.
+    // success_cb is called immediately. If authentication is already in progress, no new
+    // authentication is started, the callbacks are called once the current one finishes.
     void authenticate(const SuccessCb& success_cb, const ErrorCb &error_cb);
 
     // Access token, used for accessing the API.
@@ -307,6 +329,9 @@ public:
     // This container should be changed into bimap.
     vector<pair<int, uint64>> chat_conv_ids;
 
+    // The time, when the user has become idle, or 0 if the user is not idle. Set in vk_set_idle.
+    time_t idle_since;
+
     // If true, connection is in "closing" state. This is set in vk_close and is used in longpoll
     // callback to differentiate the case of network timeout/silent connection dropping and connection
     // cancellation.
@@ -320,16 +345,27 @@ public:
         m_closing = true;
     }
 
-    // Returns true if authentication is in process (try requesting access token after
-    // a while).
+    // Returns true if authentication is in process.
     bool is_authenticating() const
     {
-        return m_access_token.empty();
+        return m_authenticating;
     }
 
-    // Per-connection HTTP keepalive pool, initialized upon first HTTP connection and destroy
-    // upon closing the connection.
-    PurpleHttpKeepalivePool* get_keepalive_pool();
+    // Per-connection HTTP keepalive pools (one for each traffic class), initialized upon first HTTP
+    // connection of the given class and destroyed upon closing the connection.
+    PurpleHttpKeepalivePool* get_keepalive_pool(VkHttpPool pool);
+
+    // API calls, which are waiting to be sent. Initialized and used only in vk-api.cpp.
+    shared_ptr<VkApiDispatcher> api_dispatcher;
+    // Initialized and used only in httputils.cpp.
+    shared_ptr<HttpCircuitBreakers> http_circuit_breakers;
+    shared_ptr<HttpRedirectCache> http_redirect_cache;
+    // Initialized and used only in vk-buddy.cpp.
+    shared_ptr<BuddyIconFetches> buddy_icon_fetches;
+    // Initialized and used only in vk-message-recv.cpp.
+    shared_ptr<MessagesToReceive> messages_to_receive;
+    // Initialized and used only in vk-filexfer.cpp.
+    shared_ptr<RunningXfers> running_xfers;
 
 private:
     string m_email;
@@ -337,6 +373,10 @@ private:
     string m_access_token;
     uint64 m_self_user_id;
 
+    bool m_authenticating;
+    // Callbacks of all authenticate() calls, which wait for the authentication in progress.
+    vector<pair<SuccessCb, ErrorCb>> m_auth_waiters;
+
     VkOptions m_options;
 
     set<uint64> m_sent_msg_ids;
@@ -352,7 +392,10 @@ private:
 
     set<unsigned> timeout_ids;
 
-    PurpleHttpKeepalivePool* m_keepalive_pool;
+    PurpleHttpKeepalivePool* m_keepalive_pools[VK_HTTP_POOL_COUNT];
+
+    // Calls and clears all m_auth_waiters.
+    void finish_authentication(bool success);
 
     friend void timeout_add(PurpleConnection* gc, unsigned milliseconds, const TimeoutCb& callback);
 };
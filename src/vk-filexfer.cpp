@@ -1,3 +1,5 @@
+#include <glib/gstdio.h>
+
 #include "miscutils.h"
 #include "vk-api.h"
 #include "vk-common.h"
@@ -25,23 +27,70 @@ PurpleXfer* new_xfer(PurpleConnection* gc, uint64 user_id)
     PurpleXfer* xfer = purple_xfer_new(purple_connection_get_account(gc), PURPLE_XFER_SEND, name.data());
 
     xfer->data = new uint64(user_id);
-    // NOTE: We are lazy and do not implement "proper" sending file in buffer. We load the
-    // contents of the file in xfer_start. A proper way would be implementing xfer write_fnc.
+    // NOTE: We do not implement "proper" sending file in buffer via xfer write_fnc. Instead the file
+    // is read in chunks by the upload request, see upload_doc_for_im.
     purple_xfer_set_init_fnc(xfer, xfer_init);
 
     return xfer;
 }
 
+// Transfers, which have been started in xfer_init and not yet finished with xfer_fini.
+struct RunningXfers
+{
+    set<PurpleXfer*> xfers;
+};
+
+namespace
+{
+
+RunningXfers& get_running_xfers(PurpleConnection* gc)
+{
+    VkData& gc_data = get_data(gc);
+    if (!gc_data.running_xfers)
+        gc_data.running_xfers.reset(new RunningXfers());
+    return *gc_data.running_xfers;
+}
+
+// Destructor for xfer.
+void xfer_fini(PurpleXfer* xfer);
+
+} // End of anonymous namespace
+
+void cancel_running_xfers(PurpleConnection* gc)
+{
+    // xfer_fini modifies the set.
+    set<PurpleXfer*> xfers = get_running_xfers(gc).xfers;
+    for (PurpleXfer* xfer: xfers) {
+        vkcom_debug_info("Cancelling transfer of %s upon closing the connection\n",
+                         purple_xfer_get_filename(xfer));
+        if (purple_xfer_get_status(xfer) != PURPLE_XFER_STATUS_CANCEL_LOCAL)
+            purple_xfer_cancel_remote(xfer);
+        xfer_fini(xfer);
+    }
+}
+
 namespace
 {
 
-// Returns string, containing md5sum of contents.
-string compute_md5sum(const char* contents, gsize size)
+// Computes md5sum of the file, reading it in chunks. Returns false if the file cannot be read.
+bool compute_file_md5sum(const char* filepath, string& md5sum)
 {
-    char* str = g_compute_checksum_for_data(G_CHECKSUM_MD5, (const unsigned char*)contents, size);
-    string ret = str;
-    g_free(str);
-    return ret;
+    FILE* file = g_fopen(filepath, "rb");
+    if (!file)
+        return false;
+
+    GChecksum* checksum = g_checksum_new(G_CHECKSUM_MD5);
+    vector<unsigned char> buffer(64 * 1024);
+    size_t read;
+    while ((read = fread(buffer.data(), 1, buffer.size(), file)) > 0)
+        g_checksum_update(checksum, buffer.data(), read);
+    bool ok = !ferror(file);
+    fclose(file);
+
+    if (ok)
+        md5sum = g_checksum_get_string(checksum);
+    g_checksum_free(checksum);
+    return ok;
 }
 
 // Helper function, updating xfer progress and cancelling it if user has pressed cancel.
@@ -100,7 +149,7 @@ bool send_doc(PurpleConnection* gc, uint64 user_id, const VkUploadedDocInfo& doc
     send_doc_url(gc, user_id, doc_url, false);
 
     // Store the uploaded document.
-    uint64 doc_id = d.get("id").get<double>();
+    uint64 doc_id = json_get_uint64(d.get("id"));
     VkData& gc_data = get_data(gc);
     gc_data.uploaded_docs[doc_id] = doc;
     gc_data.uploaded_docs[doc_id].url = doc_url;
@@ -108,19 +157,21 @@ bool send_doc(PurpleConnection* gc, uint64 user_id, const VkUploadedDocInfo& doc
     return true;
 }
 
-// Destructor for xfer.
-void xfer_fini(PurpleXfer* xfer, char* contents)
+void xfer_fini(PurpleXfer* xfer)
 {
+    PurpleConnection* gc = purple_account_get_connection(purple_xfer_get_account(xfer));
+    get_running_xfers(gc).xfers.erase(xfer);
+
     delete (uint64*)xfer->data;
+    xfer->data = nullptr;
     purple_xfer_unref(xfer);
-
-    g_free(contents);
 }
 
 // Uploads document and sends it.
-void start_uploading_doc(PurpleConnection* gc, PurpleXfer* xfer, const VkUploadedDocInfo& doc, char* contents)
+void start_uploading_doc(PurpleConnection* gc, PurpleXfer* xfer, const VkUploadedDocInfo& doc)
 {
-    upload_doc_for_im(gc, doc.filename.data(), contents, doc.size, [=](const picojson::value& v) {
+    const char* filepath = purple_xfer_get_local_filename(xfer);
+    upload_doc_for_im(gc, doc.filename.data(), filepath, doc.size, [=](const picojson::value& v) {
         uint64 user_id = *(uint64*)xfer->data;
 
         if (purple_xfer_get_status(xfer) == PURPLE_XFER_STATUS_CANCEL_LOCAL) {
@@ -133,13 +184,13 @@ void start_uploading_doc(PurpleConnection* gc, PurpleXfer* xfer, const VkUploade
                 purple_xfer_cancel_remote(xfer);
             }
         }
-        xfer_fini(xfer, contents);
+        xfer_fini(xfer);
     }, [=] {
         if (purple_xfer_get_status(xfer) == PURPLE_XFER_STATUS_CANCEL_LOCAL)
             vkcom_debug_info("Transfer has been cancelled by user\n");
         else
             purple_xfer_cancel_remote(xfer);
-        xfer_fini(xfer, contents);
+        xfer_fini(xfer);
     }, [=](PurpleHttpConnection* http_conn, int processed, int total) {
         xfer_upload_progress(xfer, http_conn, processed, total);
     });
@@ -161,14 +212,14 @@ void clean_nonexisting_docs(PurpleConnection* gc, const SuccessCb& success_cb)
             return;
         }
 
-        uint64 doc_id = v.get("id").get<double>();
+        uint64 doc_id = json_get_uint64(v.get("id"));
 
         VkData& gc_data = get_data(gc);
         if (contains(gc_data.uploaded_docs, doc_id)) {
             const VkUploadedDocInfo& doc = gc_data.uploaded_docs[doc_id];
 
             const string& title = v.get("title").get<string>();
-            uint64 size = v.get("size").get<double>();
+            uint64 size = json_get_uint64(v.get("size"));
             const string& url = v.get("url").get<string>();
 
             if (doc.filename == title && doc.size == size && doc.url == url)
@@ -197,11 +248,11 @@ void clean_nonexisting_docs(PurpleConnection* gc, const SuccessCb& success_cb)
 
         if (success_cb)
             success_cb();
-    });
+    }, VK_CALL_PRIORITY_BACKGROUND);
 }
 
 // Either finds matching doc, checks that it exists and sends it or uploads new doc.
-void find_or_upload_doc(PurpleConnection* gc, PurpleXfer* xfer, const VkUploadedDocInfo& doc, char* contents)
+void find_or_upload_doc(PurpleConnection* gc, PurpleXfer* xfer, const VkUploadedDocInfo& doc)
 {
     // We have a concurrency problem here: if the document is uploaded and added during the
     // call to clean_nonexisting_docs (between calling docs.get and parsing the results) it will
@@ -222,12 +273,12 @@ void find_or_upload_doc(PurpleConnection* gc, PurpleXfer* xfer, const VkUploaded
 
                 purple_xfer_set_completed(xfer, true);
                 purple_xfer_end(xfer);
-                xfer_fini(xfer, contents);
+                xfer_fini(xfer);
                 return;
             }
         }
 
-        start_uploading_doc(gc, xfer, doc, contents);
+        start_uploading_doc(gc, xfer, doc);
     });
 }
 
@@ -240,39 +291,45 @@ void xfer_init(PurpleXfer* xfer)
     // Xfer can be cancelled locally anytime, which may lead to error callback getting called or not called.
     // The former happens if the user cancelled xfer before xfer_upload_progress has been called once again.
     purple_xfer_ref(xfer);
+    // The upload callbacks are not called upon logout, so the transfer is finished in
+    // cancel_running_xfers instead.
+    get_running_xfers(gc).xfers.insert(xfer);
 
     const char* filepath = purple_xfer_get_local_filename(xfer);
     const char* filename = purple_xfer_get_filename(xfer);
 
-    vkcom_debug_info("Reading file contents\n");
-
-    // Load all contents in memory.
-    char* contents;
-    gsize size;
-    if (!g_file_get_contents(filepath, &contents, &size, nullptr)) {
+    GStatBuf file_stat;
+    if (g_stat(filepath, &file_stat) != 0) {
         vkcom_debug_error("Unable to read file %s\n", filepath);
 
         purple_xfer_cancel_local(xfer);
-        xfer_fini(xfer, nullptr);
+        xfer_fini(xfer);
         return;
     }
+    gsize size = file_stat.st_size;
 
     if (size > (gsize)MAX_UPLOAD_SIZE) {
         vkcom_debug_info("Unable to upload files larger than %d\n", MAX_UPLOAD_SIZE);
 
         purple_xfer_cancel_remote(xfer);
-        xfer_fini(xfer, nullptr);
+        xfer_fini(xfer);
         return;
     }
 
-    vkcom_debug_info("Successfully read file contents\n");
-
+    // The file is never loaded in memory as a whole: it is read in chunks for md5sum and once
+    // again while uploading.
     VkUploadedDocInfo doc;
     doc.filename = filename;
     doc.size = size;
-    doc.md5sum = compute_md5sum(contents, size);
+    if (!compute_file_md5sum(filepath, doc.md5sum)) {
+        vkcom_debug_error("Unable to read file %s\n", filepath);
+
+        purple_xfer_cancel_local(xfer);
+        xfer_fini(xfer);
+        return;
+    }
 
-    find_or_upload_doc(gc, xfer, doc, contents);
+    find_or_upload_doc(gc, xfer, doc);
 }
 
 } // End of anonymous namespace
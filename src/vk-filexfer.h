@@ -8,3 +8,8 @@
 
 // Initializes and starts PurpleXfer for trasnferring document to particular user. Used for "Send File".
 PurpleXfer* new_xfer(PurpleConnection* gc, uint64 user_id);
+
+// Cancels all transfers, which are still running. Must be called upon closing the connection
+// after cancelling the HTTP requests, as the upload callbacks, which finish the transfers, are not
+// called then.
+void cancel_running_xfers(PurpleConnection* gc);
@@ -33,14 +33,37 @@ uint64 load_last_msg_id(PurpleConnection* gc);
 // Saves last_msg_id to settings.
 void save_last_msg_id(PurpleConnection* gc, uint64 last_msg_id);
 
+// NOTE: Re Long Poll cursor: ts and pts of the last processed Long Poll response are stored
+// along with last_msg_id. pts is a persistent counter of message events, so after reconnecting
+// all the events we have missed since then can be received via messages.getLongPollHistory
+// instead of receiving all the messages since last_msg_id. Both are zero if nothing has been
+// stored yet.
+
+// Loads Long Poll cursor from settings.
+void load_long_poll_cursor(PurpleConnection* gc, uint64& ts, uint64& pts);
+// Saves Long Poll cursor to settings.
+void save_long_poll_cursor(PurpleConnection* gc, uint64 ts, uint64 pts);
+
 // Helper for start_long_poll.
 void start_long_poll_impl(PurpleConnection* gc, uint64 last_msg_id);
+// Same as start_long_poll_impl, but receives the missed events since the stored cursor.
+void resume_long_poll(PurpleConnection* gc, uint64 last_msg_id, uint64 ts, uint64 pts);
 
 } // End of anonymous namespace
 
 void start_long_poll(PurpleConnection* gc)
 {
     uint64 last_msg_id = load_last_msg_id(gc);
+    uint64 ts;
+    uint64 pts;
+    load_long_poll_cursor(gc, ts, pts);
+    if (last_msg_id != 0 && pts != 0) {
+        vkcom_debug_info("Resuming Long Poll with last msg id %llu, pts %llu\n",
+                         (unsigned long long)last_msg_id, (unsigned long long)pts);
+        resume_long_poll(gc, last_msg_id, ts, pts);
+        return;
+    }
+
     vkcom_debug_info("Starting Long Poll with last msg id %llu\n", (unsigned long long)last_msg_id);
     start_long_poll_impl(gc, last_msg_id);
 }
@@ -60,6 +83,21 @@ void save_last_msg_id(PurpleConnection* gc, uint64 last_msg_id)
     return purple_account_set_int(account, "last_msg_id", last_msg_id);
 }
 
+// ts does not fit into int, so the cursor is stored as strings.
+void load_long_poll_cursor(PurpleConnection* gc, uint64& ts, uint64& pts)
+{
+    PurpleAccount* account = purple_connection_get_account(gc);
+    ts = strtoull(purple_account_get_string(account, "long_poll_ts", "0"), nullptr, 10);
+    pts = strtoull(purple_account_get_string(account, "long_poll_pts", "0"), nullptr, 10);
+}
+
+void save_long_poll_cursor(PurpleConnection* gc, uint64 ts, uint64 pts)
+{
+    PurpleAccount* account = purple_connection_get_account(gc);
+    purple_account_set_string(account, "long_poll_ts", to_string(ts).data());
+    purple_account_set_string(account, "long_poll_pts", to_string(pts).data());
+}
+
 // Helper struct for request_long_poll.
 struct LastMsg
 {
@@ -72,19 +110,25 @@ struct LastMsg
     // or equal to it must be ignored.
     const uint64 ignored;
 };
+// LastMsg is shared between the consecutive Long Poll requests, because the next request is sent
+// before the updates of the previous one have been processed.
+typedef shared_ptr<LastMsg> LastMsg_ptr;
 
 // Connects to given Long Poll server and starts reading events from it. last_msg_id is explained
 // earlier, last_msg_id_from_start is a bit more complex. There are cases when request_long_poll
 // will receive messages, which have already been processed:
 void request_long_poll(PurpleConnection* gc, const string& server, const string& key, uint64 ts,
-                       LastMsg last_msg);
+                       const LastMsg_ptr& last_msg);
 // Disconnects account on Long Poll errors as we do not have anything to do after that really.
 void long_poll_fatal(PurpleConnection* gc);
 
-void start_long_poll_impl(PurpleConnection* gc, uint64 last_msg_id)
+// Receives the Long Poll server address, key and starting timestamp. Disconnects the account
+// on errors.
+typedef function_ptr<void(const string& server, const string& key, uint64 ts)> LongPollServerCb;
+void get_long_poll_server(PurpleConnection* gc, const LongPollServerCb& server_cb)
 {
-    CallParams params = { {"use_ssl", "1"} };
-    vk_call_api(gc, "messages.getLongPollServer", params, [=](const picojson::value& v) {
+    CallParams params = { {"use_ssl", "1"}, {"need_pts", "1"} };
+    vk_call_api(gc, "messages.getLongPollServer", std::move(params), [=](const picojson::value& v) {
         // The connection status can be not connected, because we could've skipped the whole authentication part
         // in vk-auth.cpp if the access token is stored. Here is the first place where we can guarantee, that
         // the connection really succeeded.
@@ -99,6 +143,24 @@ void start_long_poll_impl(PurpleConnection* gc, uint64 last_msg_id)
             return;
         }
 
+        server_cb(v.get("server").get<string>(), v.get("key").get<string>(), json_get_uint64(v.get("ts")));
+    }, [=](const picojson::value&) {
+        long_poll_fatal(gc);
+    });
+}
+
+// Receives the events since ts and pts via messages.getLongPollHistory and processes them. Calls
+// caught_up_cb when all the events have been processed or restarts Long Poll from scratch
+// if the history is not available. pts may be zero if it is not known.
+void catch_up_long_poll(PurpleConnection* gc, uint64 ts, uint64 pts, const LastMsg_ptr& last_msg,
+                        const SuccessCb& caught_up_cb);
+
+void start_long_poll_impl(PurpleConnection* gc, uint64 last_msg_id)
+{
+    get_long_poll_server(gc, [=](const string& server, const string& key, uint64 ts) {
+        // Connect to Long Poll server while we are receiving the buddy list and unread messages.
+        http_prewarm(gc, "https://" + server, VK_HTTP_POOL_LONG_POLL);
+
         // First, we update buddy presence and receive unread messages and only then start
         // processing events. We won't miss any events because we already got starting timestamp
         // from server.
@@ -112,34 +174,61 @@ void start_long_poll_impl(PurpleConnection* gc, uint64 last_msg_id)
                 else
                     save_last_msg_id(gc, max_msg_id);
 
-                if (!field_is_present<string>(v, "server") || !field_is_present<string>(v, "key")
-                        || !field_is_present<double>(v, "ts")) {
-                    vkcom_debug_error("Wrong response from messages.getLongPollServer: %s\n",
-                                       v.serialize().data());
-                    long_poll_fatal(gc);
-                    return;
-                }
-
-                const string& server = v.get("server").get<string>();
-                const string& key = v.get("key").get<string>();
-                double ts = v.get("ts").get<double>();
-                request_long_poll(gc, server, key, ts, { max_msg_id, max_msg_id });
+                request_long_poll(gc, server, key, ts, LastMsg_ptr(new LastMsg{ max_msg_id, max_msg_id }));
             });
         });
-    }, [=](const picojson::value&) {
-        long_poll_fatal(gc);
     });
 }
 
-// Reads and processes an event from updates array.
-void process_update(PurpleConnection* gc, const picojson::value& v, LastMsg& last_msg);
+void resume_long_poll(PurpleConnection* gc, uint64 last_msg_id, uint64 ts, uint64 pts)
+{
+    get_long_poll_server(gc, [=](const string& server, const string& key, uint64 new_ts) {
+        http_prewarm(gc, "https://" + server, VK_HTTP_POOL_LONG_POLL);
 
-// We request platform to detect desktop/mobile status and attachments to get "from"
-// in chats.
-const char* long_poll_url = "https://%s?act=a_check&key=%s&ts=%llu&wait=25&mode=66";
+        update_friends_presence(gc, [=] {
+            update_user_chat_infos(gc);
+            LastMsg_ptr last_msg(new LastMsg{ last_msg_id, 0 });
+            catch_up_long_poll(gc, ts, pts, last_msg, [=] {
+                // The history may contain messages, which Long Poll will return once again.
+                request_long_poll(gc, server, key, new_ts, LastMsg_ptr(new LastMsg{ last_msg->id, last_msg->id }));
+            });
+        });
+    });
+}
+
+// Online status of a user, which has been received from Long Poll.
+struct PresenceUpdate
+{
+    bool online;
+    // Platform, which the user has come online from. Valid only if online is true.
+    uint64 platform;
+};
+
+// Online/offline events are not applied right away, because mobile clients often go online
+// and offline a lot of times in a row. They are folded per user (the last state wins) and
+// applied after the whole batch of updates has been processed.
+struct PresenceUpdates
+{
+    map<uint64, PresenceUpdate> users;
+    // The number of events, which have been overridden by later events for the same user.
+    unsigned dropped = 0;
+};
+
+// Reads and processes an event from updates array.
+void process_update(PurpleConnection* gc, const picojson::value& v, LastMsg& last_msg,
+                    PresenceUpdates& presence);
+// Updates online status of the users in buddy list.
+void apply_presence_updates(PurpleConnection* gc, const PresenceUpdates& presence);
+// Recovers after Long Poll has returned "failed" in response to the request with ts.
+void recover_long_poll(PurpleConnection* gc, const string& server, const string& key, uint64 ts,
+                       const picojson::value& root, const LastMsg_ptr& last_msg);
+
+// We request platform to detect desktop/mobile status, attachments to get "from"
+// in chats and pts to store the Long Poll cursor.
+const char* long_poll_url = "https://%s?act=a_check&key=%s&ts=%llu&wait=25&mode=98";
 
 void request_long_poll(PurpleConnection* gc, const string& server, const string& key, uint64 ts,
-                       LastMsg last_msg)
+                       const LastMsg_ptr& last_msg)
 {
     string server_url = str_format(long_poll_url, server.data(), key.data(), ts);
 #if 0
@@ -147,10 +236,6 @@ void request_long_poll(PurpleConnection* gc, const string& server, const string&
 #endif
 
     http_get(gc, server_url, [=](PurpleHttpConnection*, PurpleHttpResponse* response) {
-        // Connection has been cancelled due to account being disconnected.
-        if (get_data(gc).is_closing())
-            return;
-
         if (purple_http_response_get_code(response) != 200) {
             vkcom_debug_error("Error while reading response from Long Poll server: %s\n",
                                purple_http_response_get_error(response));
@@ -174,8 +259,7 @@ void request_long_poll(PurpleConnection* gc, const string& server, const string&
         }
 
         if (root.contains("failed")) {
-            vkcom_debug_info("Long Poll got tired, re-requesting Long Poll server address\n");
-            start_long_poll_impl(gc, last_msg.id);
+            recover_long_poll(gc, server, key, ts, root, last_msg);
             return;
         }
 
@@ -185,15 +269,77 @@ void request_long_poll(PurpleConnection* gc, const string& server, const string&
             return;
         }
 
-        LastMsg next_last_msg = last_msg;
+        // Send the next request before processing the updates, so that the events, which arrive
+        // meanwhile, do not wait for the whole round trip. Its response cannot be processed until
+        // we return to the main loop, so the updates are still processed in order.
+        uint64 next_ts = json_get_uint64(root.get("ts"));
+        request_long_poll(gc, server, key, next_ts, last_msg);
 
+        PresenceUpdates presence;
         const picojson::array& updates = root.get("updates").get<picojson::array>();
         for (const picojson::value& v: updates)
-            process_update(gc, v, next_last_msg);
+            process_update(gc, v, *last_msg, presence);
+        apply_presence_updates(gc, presence);
 
-        uint64 next_ts = root.get("ts").get<double>();
-        request_long_poll(gc, server, key, next_ts, next_last_msg);
-    });
+        if (field_is_present<double>(root, "pts"))
+            save_long_poll_cursor(gc, next_ts, json_get_uint64(root.get("pts")));
+    }, VK_HTTP_POOL_LONG_POLL);
+}
+
+// Values of "failed" in Long Poll response.
+enum LongPollFailures
+{
+    // Some events since ts have been lost, Long Poll must continue from the returned ts.
+    LONG_POLL_FAILED_HISTORY = 1,
+    // The key has expired, a new one must be requested, but ts is still valid.
+    LONG_POLL_FAILED_KEY = 2,
+    // The server has lost the user information, both a new key and a new ts must be requested.
+    LONG_POLL_FAILED_INFO = 3
+};
+
+void recover_long_poll(PurpleConnection* gc, const string& server, const string& key, uint64 ts,
+                       const picojson::value& root, const LastMsg_ptr& last_msg)
+{
+    int failed = 0;
+    if (field_is_present<double>(root, "failed"))
+        failed = json_get_int64(root.get("failed"));
+    // The stored cursor has been saved upon processing the response, which returned ts.
+    uint64 stored_ts;
+    uint64 pts;
+    load_long_poll_cursor(gc, stored_ts, pts);
+
+    switch (failed) {
+    case LONG_POLL_FAILED_HISTORY: {
+        if (!field_is_present<double>(root, "ts"))
+            break;
+        vkcom_debug_info("Long Poll history is outdated, catching up\n");
+        uint64 new_ts = json_get_uint64(root.get("ts"));
+        catch_up_long_poll(gc, ts, pts, last_msg, [=] {
+            request_long_poll(gc, server, key, new_ts, LastMsg_ptr(new LastMsg{ last_msg->id, last_msg->id }));
+        });
+        return;
+    }
+    case LONG_POLL_FAILED_KEY:
+        vkcom_debug_info("Long Poll key has expired, re-requesting it\n");
+        get_long_poll_server(gc, [=](const string& new_server, const string& new_key, uint64) {
+            request_long_poll(gc, new_server, new_key, ts, last_msg);
+        });
+        return;
+    case LONG_POLL_FAILED_INFO:
+        vkcom_debug_info("Long Poll has lost user information, re-requesting key and catching up\n");
+        get_long_poll_server(gc, [=](const string& new_server, const string& new_key, uint64 new_ts) {
+            catch_up_long_poll(gc, ts, pts, last_msg, [=] {
+                request_long_poll(gc, new_server, new_key, new_ts,
+                                  LastMsg_ptr(new LastMsg{ last_msg->id, last_msg->id }));
+            });
+        });
+        return;
+    default:
+        break;
+    }
+
+    vkcom_debug_info("Long Poll got tired, re-requesting Long Poll server address\n");
+    start_long_poll_impl(gc, last_msg->id);
 }
 
 // Update codes coming from Long Poll
@@ -227,16 +373,121 @@ enum MessageFlags
     MESSAGE_FLAG_MEDIA = 512
 };
 
+// Outgoing messages in the history may have been sent by us, just like the ones in Long Poll
+// updates (see process_message). Returns false if the message has been sent by us or must be
+// checked once again after a timeout, which receives it if it has been sent from someplace else.
+bool should_receive_history_message(PurpleConnection* gc, uint64 msg_id, const picojson::value& message)
+{
+    if (!field_is_present<double>(message, "out") || message.get("out").as_double() == 0)
+        return true;
+
+    VkData& gc_data = get_data(gc);
+    if (gc_data.remove_sent_msg_id(msg_id))
+        return false;
+
+    steady_duration since_last_msg_sent = steady_clock::now() - gc_data.last_msg_sent_time();
+    if (to_milliseconds(since_last_msg_sent) >= 30000)
+        return true;
+
+    vkcom_debug_info("We sent message not long ago, let's have a check after timeout\n");
+    timeout_add(gc, 30000, [=] {
+        if (get_data(gc).remove_sent_msg_id(msg_id))
+            return false;
+
+        vkcom_debug_error("We have sent a message not long ago, but not all"
+                          " msg id are belong to us (msg id %llu)\n",
+                          (unsigned long long)msg_id);
+        receive_message_items(gc, { message }, nullptr);
+        return false;
+    });
+    return false;
+}
+
+void catch_up_long_poll(PurpleConnection* gc, uint64 ts, uint64 pts, const LastMsg_ptr& last_msg,
+                        const SuccessCb& caught_up_cb)
+{
+    CallParams params = { {"ts", to_string(ts)}, {"onlines", "1"} };
+    if (pts != 0)
+        params.emplace_back("pts", to_string(pts));
+    vk_call_api(gc, "messages.getLongPollHistory", std::move(params), [=](const picojson::value& v) {
+        if (!field_is_present<picojson::array>(v, "history")
+                || !field_is_present<picojson::object>(v, "messages")
+                || !field_is_present<picojson::array>(v.get("messages"), "items")) {
+            vkcom_debug_error("Strange response from messages.getLongPollHistory: %s\n",
+                              v.serialize().data());
+            start_long_poll_impl(gc, last_msg->id);
+            return;
+        }
+        // Not all events have been returned, the rest are received starting from new_pts.
+        // Without it, it is simpler to receive everything anew.
+        bool more = field_is_present<double>(v, "more") && v.get("more").as_double() != 0;
+        uint64 new_pts = 0;
+        if (field_is_present<double>(v, "new_pts"))
+            new_pts = json_get_uint64(v.get("new_pts"));
+        if (more && new_pts == 0) {
+            vkcom_debug_info("Too many events in Long Poll history, restarting Long Poll\n");
+            start_long_poll_impl(gc, last_msg->id);
+            return;
+        }
+
+        // Message events in the history contain only ids and flags, the messages themselves
+        // are returned in "messages". Typing notifications are stale by now.
+        PresenceUpdates presence;
+        for (const picojson::value& update: v.get("history").get<picojson::array>()) {
+            if (!update.is<picojson::array>() || !update.contains(0) || !update.get(0).is<double>())
+                continue;
+            int code = json_get_int64(update.get(0));
+            if (code != LONG_POLL_MESSAGE && code != LONG_POLL_USER_STARTED_TYPING
+                    && code != LONG_POLL_USER_STARTED_CHAT_TYPING)
+                process_update(gc, update, *last_msg, presence);
+        }
+        apply_presence_updates(gc, presence);
+
+        picojson::array messages;
+        // The max id of the new messages, including the ones, which are not received right away.
+        uint64 max_new_msg_id = 0;
+        for (const picojson::value& message: v.get("messages").get("items").get<picojson::array>()) {
+            if (!field_is_present<double>(message, "id"))
+                continue;
+            uint64 msg_id = json_get_uint64(message.get("id"));
+            if (msg_id <= last_msg->id)
+                continue;
+            max_new_msg_id = std::max(max_new_msg_id, msg_id);
+            if (should_receive_history_message(gc, msg_id, message))
+                messages.push_back(message);
+        }
+        vkcom_debug_info("Got %d new messages from Long Poll history\n", (int)messages.size());
+
+        receive_message_items(gc, messages, [=](uint64 max_msg_id) {
+            max_msg_id = std::max(max_msg_id, max_new_msg_id);
+            if (max_msg_id > last_msg->id) {
+                last_msg->id = max_msg_id;
+                save_last_msg_id(gc, max_msg_id);
+            }
+            if (more) {
+                vkcom_debug_info("Receiving more events from Long Poll history\n");
+                catch_up_long_poll(gc, ts, new_pts, last_msg, caught_up_cb);
+            } else {
+                caught_up_cb();
+            }
+        });
+    }, [=](const picojson::value&) {
+        vkcom_debug_error("Unable to receive Long Poll history, restarting Long Poll\n");
+        start_long_poll_impl(gc, last_msg->id);
+    });
+}
+
 // Processes message event.
 void process_message(PurpleConnection* gc, const picojson::value& v, LastMsg& last_msg);
 // Processes user online/offline event.
-void process_online(PurpleConnection* gc, const picojson::value& v, bool online);
+void process_online(const picojson::value& v, bool online, PresenceUpdates& presence);
 // Processes update of chat parameters.
 void process_chat_update(PurpleConnection* gc, const picojson::value& v);
 // Processes user typing event.
 void process_typing(PurpleConnection* gc, const picojson::value& v);
 
-void process_update(PurpleConnection* gc, const picojson::value& v, LastMsg& last_msg)
+void process_update(PurpleConnection* gc, const picojson::value& v, LastMsg& last_msg,
+                    PresenceUpdates& presence)
 {
     if (!v.is<picojson::array>() || !v.contains(0)) {
         vkcom_debug_error("Strange response from Long Poll in updates: %s\n",
@@ -244,16 +495,16 @@ void process_update(PurpleConnection* gc, const picojson::value& v, LastMsg& las
         return;
     }
 
-    int code = v.get(0).get<double>();
+    int code = json_get_int64(v.get(0));
     switch (code) {
     case LONG_POLL_MESSAGE:
         process_message(gc, v, last_msg);
         break;
     case LONG_POLL_ONLINE:
-        process_online(gc, v, true);
+        process_online(v, true, presence);
         break;
     case LONG_POLL_OFFLINE:
-        process_online(gc, v, false);
+        process_online(v, false, presence);
         break;
     case LONG_POLL_CHAT_PARAMS_UPDATED:
         process_chat_update(gc, v);
@@ -282,7 +533,7 @@ void process_message(PurpleConnection* gc, const picojson::value& v, LastMsg& la
                                        i18n("Unable to receive message"));
         return;
     }
-    uint64 msg_id = v.get(1).get<double>();
+    uint64 msg_id = json_get_uint64(v.get(1));
     // Check if we already processed this message in receive_messages_range.
     if (msg_id <= last_msg.ignored)
         return;
@@ -294,10 +545,10 @@ void process_message(PurpleConnection* gc, const picojson::value& v, LastMsg& la
         save_last_msg_id(gc, msg_id);
     }
 
-    int flags = v.get(2).get<double>();
+    int flags = json_get_int64(v.get(2));
 
-    uint64 user_id = v.get(3).get<double>();
-    uint64 timestamp = v.get(4).get<double>();
+    uint64 user_id = json_get_uint64(v.get(3));
+    uint64 timestamp = json_get_uint64(v.get(4));
     // NOTE:
     // * The text is simple UTF-8 text with some HTML leftovers:
     //   * The only tag which it may contain is <br> (API v5.0 stopped using <br>, but Long Poll
@@ -374,10 +625,12 @@ void process_incoming_message_internal(PurpleConnection* gc, uint64 msg_id, int
     //   * access to information on private images/documents/etc. (e.g. ones uploaded from Vk.com
     //     chat UI) is prohibited and we can only show links to the corresponding page;
     //   * there is no video.getById so we can show no information on video;
-    //   * it takes at least one additional call per message (receive_messages takes exactly one
-    //     call).
-    if (flags & MESSAGE_FLAG_MEDIA) {
-        receive_messages(gc, { msg_id });
+    //   * it takes at least one additional call per message (receive_messages_batched takes one
+    //     call for all the messages, which arrive within a short time).
+    //  Text messages, which follow the messages being received in the same conversation, are
+    //  received the same way, so that they are not shown before the preceding ones.
+    if ((flags & MESSAGE_FLAG_MEDIA) || is_receiving_batched(gc, user_id)) {
+        receive_messages_batched(gc, msg_id, user_id);
     } else {
         convert_incoming_smileys(text);
 
@@ -395,7 +648,7 @@ void process_incoming_message_internal(PurpleConnection* gc, uint64 msg_id, int
                 vkcom_debug_error("Chat message has wrong attachments: %s\n", attachments
                                   ? attachments->serialize().data() : "null");
                 // Let's try to receive the message the other way.
-                receive_messages(gc, { msg_id });
+                receive_messages_batched(gc, msg_id, user_id);
                 return;
             }
 
@@ -405,7 +658,7 @@ void process_incoming_message_internal(PurpleConnection* gc, uint64 msg_id, int
                 vkcom_debug_error("Chat message has wrong attachments: %s\n", attachments
                                   ? attachments->serialize().data() : "null");
                 // Let's try to receive the message the other way.
-                receive_messages(gc, { msg_id });
+                receive_messages_batched(gc, msg_id, user_id);
                 return;
             }
 
@@ -426,8 +679,8 @@ void process_outgoing_message_internal(PurpleConnection* gc, uint64 msg_id, int
 {
     // See NOTE in process_incoming_message_internal. Unlik incoming messages, we know perfectly
     // well who is the message author for outgoing messages.
-    if (flags & MESSAGE_FLAG_MEDIA) {
-        receive_messages(gc, { msg_id });
+    if ((flags & MESSAGE_FLAG_MEDIA) || is_receiving_batched(gc, user_id)) {
+        receive_messages_batched(gc, msg_id, user_id);
     } else {
         convert_incoming_smileys(text);
 
@@ -460,50 +713,66 @@ void process_outgoing_message_internal(PurpleConnection* gc, uint64 msg_id, int
     }
 }
 
-void process_online(PurpleConnection* gc, const picojson::value& v, bool online)
+void process_online(const picojson::value& v, bool online, PresenceUpdates& presence)
 {
     if (!v.contains(1) || !v.get(1).is<double>()) {
         vkcom_debug_error("Strange response from Long Poll in updates: %s\n",
                            v.serialize().data());
         return;
     }
-    if (v.get(1).get<double>() > 0) {
+    if (v.get(1).as_double() > 0) {
         vkcom_debug_error("Strange response from Long Poll in updates: %s\n",
                            v.serialize().data());
         return;
     }
-    uint64 user_id = -v.get(1).get<double>();
-    string name = user_name_from_id(user_id);
+    uint64 user_id = -json_get_int64(v.get(1));
+
+    uint64 platform = 0;
+    if (online) {
+        if (!v.contains(2) || !v.get(2).is<double>()) {
+            vkcom_debug_error("Strange response from Long Poll in updates: %s\n",
+                               v.serialize().data());
+            return;
+        }
+        platform = json_get_uint64(v.get(2)) % 0x100;
+    }
 
-    vkcom_debug_info("User %s changed online to %d\n", name.data(), online);
+    if (contains(presence.users, user_id))
+        presence.dropped++;
+    presence.users[user_id] = PresenceUpdate{ online, platform };
+}
+
+void apply_presence_updates(PurpleConnection* gc, const PresenceUpdates& presence)
+{
+    if (presence.dropped > 0)
+        vkcom_debug_info("Dropped %d redundant online status changes, applying %d\n",
+                         presence.dropped, (int)presence.users.size());
+
+    for (const auto& p: presence.users) {
+        uint64 user_id = p.first;
+        const PresenceUpdate& update = p.second;
+        string name = user_name_from_id(user_id);
+
+        vkcom_debug_info("User %s changed online to %d\n", name.data(), update.online);
+        // Cached users.get results contain the previous online status.
+        vk_call_api_invalidate_cache(gc, "users.get", "user_ids", user_id);
+
+        if (!user_in_buddy_list(gc, user_id)) {
+            vkcom_debug_info("User %s has come online, but is not present in buddy list."
+                              "He has probably been added behind our backs.", name.data());
+            add_buddy_if_needed(gc, user_id);
+            continue;
+        }
 
-    if (!user_in_buddy_list(gc, user_id)) {
-        vkcom_debug_info("User %s has come online, but is not present in buddy list."
-                          "He has probably been added behind our backs.", name.data());
-        add_buddy_if_needed(gc, user_id);
-        return;
-    } else {
         VkUserInfo* info = get_user_info(gc, user_id);
         if (!info) {
             vkcom_debug_error("We somehow do not have info on user %s\n", name.data());
-            return;
+            continue;
         }
 
-        if (online) {
-            if (!v.contains(2) || !v.get(2).is<double>()) {
-                vkcom_debug_error("Strange response from Long Poll in updates: %s\n",
-                                   v.serialize().data());
-                return;
-            }
-            uint64 platform = uint64(v.get(2).get<double>()) % 0x100;
-
-            if (platform == PLATFORM_WEB) {
-                info->online = true;
-                info->online_mobile = false;
-            } else {
-                info->online = true;
-                info->online_mobile = true;
-            }
+        if (update.online) {
+            info->online = true;
+            info->online_mobile = update.platform != PLATFORM_WEB;
 
             PurpleAccount* account = purple_connection_get_account(gc);
             purple_prpl_got_user_login_time(account, name.data(), time(nullptr));
@@ -522,10 +791,11 @@ void process_chat_update(PurpleConnection* gc, const picojson::value& v)
                           v.serialize().data());
         return;
     }
-    uint64 chat_id = v.get(1).get<double>();
+    uint64 chat_id = json_get_uint64(v.get(1));
 
     vkcom_debug_info("Updating parameters for chat %llu\n", (unsigned long long)chat_id);
 
+    vk_call_api_invalidate_cache(gc, "messages.getChat", "chat_ids", chat_id);
     update_chat_infos(gc, { chat_id }, nullptr, true);
 }
 
@@ -536,7 +806,7 @@ void process_typing(PurpleConnection* gc, const picojson::value& v)
                            v.serialize().data());
         return;
     }
-    uint64 user_id = v.get(1).get<double>();
+    uint64 user_id = json_get_uint64(v.get(1));
 
     add_buddy_if_needed(gc, user_id, [=] {
         // Vk.com documentation states, that "user is typing" messages are sent with ~10 second
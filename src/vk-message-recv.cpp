@@ -6,6 +6,7 @@
 #include <util.h>
 
 #include "httputils.h"
+#include "jsonutils.h"
 #include "miscutils.h"
 #include "vk-api.h"
 #include "vk-buddy.h"
@@ -60,14 +61,49 @@ struct MessagesData
     ReceivedCb received_cb;
 
     vector<Message> messages;
+    // Ids of the processed messages. Messages may shift between pages of messages.get, so we skip
+    // the ones, which have already been processed.
+    set<uint64> processed_ids;
 };
 typedef shared_ptr<MessagesData> MessagesData_ptr;
 
+// Message, as returned by messages.get and messages.getById. The top-level fields are decoded
+// directly from the response text by read_message_fields without building the DOM. Attachments,
+// forwarded messages and geo are present only in some messages and are deeply nested, so they
+// are decoded into DOM and processed by process_attachments etc.
+struct MessageFields
+{
+    bool has_id = false;
+    int64 id = 0;
+    bool has_user_id = false;
+    int64 user_id = 0;
+    int64 chat_id = 0;
+    bool has_body = false;
+    string body;
+    bool has_date = false;
+    int64 date = 0;
+    bool has_read_state = false;
+    int64 read_state = 0;
+    bool has_out = false;
+    int64 out = 0;
+    // Null if not present.
+    picojson::value attachments;
+    picojson::value fwd_messages;
+    picojson::value geo;
+};
+
 // Receives all messages starting after last_msg_id.
 void receive_messages_range_internal(const MessagesData_ptr& data, uint64 last_msg_id, bool outgoing);
 
-// Processes one item from the result of messages.get and messages.getById.
-void process_message(const MessagesData_ptr& data, const picojson::value& fields);
+// Decodes one message object. is_object is set to true if the value is an object.
+bool read_message_fields(JsonInput& in, MessageFields& fields, bool& is_object);
+// Same as read_message_fields, but for the message, which has already been decoded into DOM.
+void get_message_fields(const picojson::value& v, MessageFields& fields);
+// Returns true if all the fields, which every message must have, are present.
+bool has_required_fields(const MessageFields& fields);
+// Processes one item from the result of messages.get and messages.getById. The item must have
+// all the required fields.
+void process_message(const MessagesData_ptr& data, const MessageFields& fields);
 // Processes attachments: appends urls to message text, adds thumbnail_urls.
 void process_attachments(PurpleConnection* gc, const picojson::array& items, Message& message);
 // Processes forwarded messages: appends message text and processes attachments.
@@ -120,6 +156,10 @@ void add_unknown_users_chats(const MessagesData_ptr& data);
 // Sorts received messages, sends them to libpurple client and destroys this.
 void finish_receiving(const MessagesData_ptr& data);
 
+// Helper for receive_messages and receive_messages_batched.
+void receive_messages_impl(PurpleConnection* gc, const vector<uint64>& message_ids,
+                           const ReceivedCb& received_cb);
+
 } // End of anonymous namespace
 
 void receive_messages_range(PurpleConnection* gc, uint64 last_msg_id, const ReceivedCb& received_cb)
@@ -144,17 +184,175 @@ void receive_messages_range(PurpleConnection* gc, uint64 last_msg_id, const Rece
 }
 
 void receive_messages(PurpleConnection* gc, const vector<uint64>& message_ids)
+{
+    receive_messages_impl(gc, message_ids, nullptr);
+}
+
+// Messages, which have been passed to receive_messages_batched, but not received yet.
+struct MessagesToReceive
+{
+    struct Item
+    {
+        uint64 msg_id;
+        uint64 peer_id;
+    };
+
+    vector<Item> messages;
+    // True if receiving messages has been scheduled.
+    bool scheduled = false;
+
+    // Peer ids of the batch, which is being received, empty if none is running. The next batch
+    // is sent only after it has finished, so that the messages are shown in order.
+    set<uint64> running_peer_ids;
+    bool running = false;
+    // Incremented for each batch, so that the timeout does not finish the wrong one.
+    unsigned batch_num = 0;
+};
+
+namespace
+{
+
+// The amount of time in milliseconds we wait for more message ids before receiving the batch.
+const unsigned RECEIVE_BATCH_WINDOW = 50;
+// Maximum number of message ids in one messages.getById.
+const size_t MAX_RECEIVE_BATCH = 100;
+// The amount of time in milliseconds, after which the batch is considered finished even if
+// receiving it has not called back, so that it does not hold the following batches forever.
+const unsigned RECEIVE_BATCH_TIMEOUT = 60000;
+
+MessagesToReceive& get_messages_to_receive(PurpleConnection* gc)
+{
+    VkData& gc_data = get_data(gc);
+    if (!gc_data.messages_to_receive)
+        gc_data.messages_to_receive.reset(new MessagesToReceive());
+    return *gc_data.messages_to_receive;
+}
+
+// Receives the first MAX_RECEIVE_BATCH messages and then the rest.
+void receive_next_messages_batch(PurpleConnection* gc);
+
+// Marks the batch as finished and starts receiving the next one.
+void finish_messages_batch(PurpleConnection* gc, unsigned batch_num)
+{
+    MessagesToReceive& to_receive = get_messages_to_receive(gc);
+    if (!to_receive.running || to_receive.batch_num != batch_num)
+        return;
+
+    to_receive.running = false;
+    to_receive.running_peer_ids.clear();
+    // The ids, which have arrived meanwhile, have already waited long enough.
+    if (!to_receive.messages.empty())
+        receive_next_messages_batch(gc);
+}
+
+void receive_next_messages_batch(PurpleConnection* gc)
+{
+    MessagesToReceive& to_receive = get_messages_to_receive(gc);
+    size_t batch_size = std::min(to_receive.messages.size(), MAX_RECEIVE_BATCH);
+    vector<uint64> message_ids;
+    for (size_t i = 0; i < batch_size; i++) {
+        message_ids.push_back(to_receive.messages[i].msg_id);
+        to_receive.running_peer_ids.insert(to_receive.messages[i].peer_id);
+    }
+    to_receive.messages.erase(to_receive.messages.begin(), to_receive.messages.begin() + batch_size);
+    to_receive.running = true;
+    unsigned batch_num = ++to_receive.batch_num;
+
+    vkcom_debug_info("Receiving %d messages in one batch\n", (int)message_ids.size());
+    receive_messages_impl(gc, message_ids, [=](uint64) {
+        finish_messages_batch(gc, batch_num);
+    });
+    timeout_add(gc, RECEIVE_BATCH_TIMEOUT, [=] {
+        MessagesToReceive& to_receive = get_messages_to_receive(gc);
+        if (to_receive.running && to_receive.batch_num == batch_num)
+            vkcom_debug_error("Receiving batch of messages timed out\n");
+        finish_messages_batch(gc, batch_num);
+        return false;
+    });
+}
+
+} // End of anonymous namespace
+
+void receive_messages_batched(PurpleConnection* gc, uint64 message_id, uint64 peer_id)
+{
+    MessagesToReceive& to_receive = get_messages_to_receive(gc);
+    to_receive.messages.push_back({ message_id, peer_id });
+    if (to_receive.scheduled || to_receive.running)
+        return;
+
+    to_receive.scheduled = true;
+    timeout_add(gc, RECEIVE_BATCH_WINDOW, [=] {
+        get_messages_to_receive(gc).scheduled = false;
+        receive_next_messages_batch(gc);
+        return false;
+    });
+}
+
+bool is_receiving_batched(PurpleConnection* gc, uint64 peer_id)
+{
+    MessagesToReceive& to_receive = get_messages_to_receive(gc);
+    if (contains(to_receive.running_peer_ids, peer_id))
+        return true;
+    return std::any_of(to_receive.messages.begin(), to_receive.messages.end(),
+                       [=](const MessagesToReceive::Item& item) {
+        return item.peer_id == peer_id;
+    });
+}
+
+void receive_message_items(PurpleConnection* gc, const picojson::array& items,
+                           const ReceivedCb& received_cb)
+{
+    MessagesData_ptr data{ new MessagesData() };
+    data->gc = gc;
+    data->received_cb = received_cb;
+
+    for (const picojson::value& message: items) {
+        MessageFields fields;
+        get_message_fields(message, fields);
+        if (has_required_fields(fields))
+            process_message(data, fields);
+        else
+            vkcom_debug_error("Strange message: %s\n", message.serialize().data());
+    }
+    download_thumbnail(data, 0, 0);
+}
+
+namespace
+{
+
+// Decodes the message from the item of messages.get or messages.getById and processes it.
+bool process_message_item(const MessagesData_ptr& data, const char* begin, const char* end)
+{
+    MessageFields fields;
+    bool is_object = false;
+    if (!json_parse_text(begin, end, [&](JsonInput& in) {
+            return read_message_fields(in, fields, is_object);
+        })) {
+        vkcom_debug_error("Error parsing message: %s\n", string(begin, end).data());
+        return false;
+    }
+    if (is_object && has_required_fields(fields))
+        process_message(data, fields);
+    else
+        vkcom_debug_error("Strange response from messages.get or messages.getById: %s\n",
+                          string(begin, end).data());
+    return true;
+}
+
+void receive_messages_impl(PurpleConnection* gc, const vector<uint64>& message_ids,
+                           const ReceivedCb& received_cb)
 {
     if (message_ids.empty())
         return;
 
     MessagesData_ptr data{ new MessagesData() };
     data->gc = gc;
-    data->received_cb = nullptr;
+    data->received_cb = received_cb;
 
     CallParams params = { {"message_ids", str_concat_int(',', message_ids)} };
-    vk_call_api_items(data->gc, "messages.getById", params, false, [=](const picojson::value& message) {
-        process_message(data, message);
+    vk_call_api_items_raw(data->gc, "messages.getById", params, false,
+                          [=](const char* begin, const char* end) {
+        return process_message_item(data, begin, end);
     }, [=] {
         download_thumbnail(data, 0, 0);
     }, [=](const picojson::value&) {
@@ -162,9 +360,6 @@ void receive_messages(PurpleConnection* gc, const vector<uint64>& message_ids)
     });
 }
 
-namespace
-{
-
 void get_last_message_id(PurpleConnection* gc, LastMessageIdCb last_message_id_cb)
 {
     CallParams params = { {"code", "return API.messages.get({\"count\": 1}).items[0].id;" } };
@@ -176,7 +371,7 @@ void get_last_message_id(PurpleConnection* gc, LastMessageIdCb last_message_id_c
             return;
         }
 
-        last_message_id_cb(v.get<double>());
+        last_message_id_cb(json_get_uint64(v));
     }, [=](const picojson::value&) {
         last_message_id_cb(0);
     });
@@ -190,8 +385,8 @@ void receive_messages_range_internal(const MessagesData_ptr& data, uint64 last_m
     CallParams params = { {"out", outgoing ? "1" : "0"}, {"count", "200"},
                           {"last_message_id", to_string(last_msg_id) } };
 
-    vk_call_api_items(data->gc, "messages.get", params, true, [=](const picojson::value& message) {
-        process_message(data, message);
+    vk_call_api_items_raw(data->gc, "messages.get", params, true, [=](const char* begin, const char* end) {
+        return process_message_item(data, begin, end);
     }, [=] {
         vkcom_debug_info("Finished processing %s messages\n", outgoing ? "outgoing" : "incoming");
         if (!outgoing)
@@ -200,7 +395,7 @@ void receive_messages_range_internal(const MessagesData_ptr& data, uint64 last_m
             download_thumbnail(data, 0, 0);
     }, [=](const picojson::value&) {
         finish_receiving(data);
-    });
+    }, VK_CALL_PRIORITY_BACKGROUND);
 }
 
 
@@ -224,44 +419,109 @@ string timestamp_to_long_format(time_t timestamp)
     return purple_date_format_long(localtime(&timestamp));
 }
 
-void process_message(const MessagesData_ptr& data, const picojson::value& fields)
+bool read_message_fields(JsonInput& in, MessageFields& fields, bool& is_object)
 {
-    if (!field_is_present<double>(fields, "user_id") || !field_is_present<double>(fields, "date")
-            || !field_is_present<string>(fields, "body") || !field_is_present<double>(fields, "id")
-            || !field_is_present<double>(fields, "read_state")|| !field_is_present<double>(fields, "out")) {
-        vkcom_debug_error("Strange response from messages.get or messages.getById: %s\n",
-                           fields.serialize().data());
+    return json_read_object(in, [&](JsonInput& field_in, const string& key) {
+        if (key == "id")
+            return json_read_int64(field_in, fields.id, fields.has_id);
+        if (key == "user_id")
+            return json_read_int64(field_in, fields.user_id, fields.has_user_id);
+        if (key == "chat_id") {
+            bool present = false;
+            return json_read_int64(field_in, fields.chat_id, present);
+        }
+        if (key == "body")
+            return json_read_string(field_in, fields.body, fields.has_body);
+        if (key == "date")
+            return json_read_int64(field_in, fields.date, fields.has_date);
+        if (key == "read_state")
+            return json_read_int64(field_in, fields.read_state, fields.has_read_state);
+        if (key == "out")
+            return json_read_int64(field_in, fields.out, fields.has_out);
+        if (key == "attachments")
+            return json_read_value(field_in, fields.attachments);
+        if (key == "fwd_messages")
+            return json_read_value(field_in, fields.fwd_messages);
+        if (key == "geo")
+            return json_read_value(field_in, fields.geo);
+        return json_skip(field_in);
+    }, is_object);
+}
+
+void get_message_fields(const picojson::value& v, MessageFields& fields)
+{
+    if (!v.is<picojson::object>())
         return;
+
+    if (field_is_present<double>(v, "id")) {
+        fields.has_id = true;
+        fields.id = json_get_int64(v.get("id"));
+    }
+    if (field_is_present<double>(v, "user_id")) {
+        fields.has_user_id = true;
+        fields.user_id = json_get_int64(v.get("user_id"));
+    }
+    if (field_is_present<double>(v, "chat_id"))
+        fields.chat_id = json_get_int64(v.get("chat_id"));
+    if (field_is_present<string>(v, "body")) {
+        fields.has_body = true;
+        fields.body = v.get("body").get<string>();
+    }
+    if (field_is_present<double>(v, "date")) {
+        fields.has_date = true;
+        fields.date = json_get_int64(v.get("date"));
+    }
+    if (field_is_present<double>(v, "read_state")) {
+        fields.has_read_state = true;
+        fields.read_state = json_get_int64(v.get("read_state"));
+    }
+    if (field_is_present<double>(v, "out")) {
+        fields.has_out = true;
+        fields.out = json_get_int64(v.get("out"));
     }
+    if (v.contains("attachments"))
+        fields.attachments = v.get("attachments");
+    if (v.contains("fwd_messages"))
+        fields.fwd_messages = v.get("fwd_messages");
+    if (v.contains("geo"))
+        fields.geo = v.get("geo");
+}
+
+bool has_required_fields(const MessageFields& fields)
+{
+    return fields.has_id && fields.has_user_id && fields.has_body && fields.has_date
+        && fields.has_read_state && fields.has_out;
+}
+
+void process_message(const MessagesData_ptr& data, const MessageFields& fields)
+{
+    if (!data->processed_ids.insert(fields.id).second)
+        return;
 
     Message message;
-    message.mid = fields.get("id").get<double>();
-    message.user_id = fields.get("user_id").get<double>();
-    message.chat_id = 0;
-    if (field_is_present<double>(fields, "chat_id"))
-        message.chat_id = fields.get("chat_id").get<double>();
-
-    message.text = cleanup_message_body(fields.get("body").get<string>());
-    message.timestamp = fields.get("date").get<double>();
-    if (fields.get("out").get<double>() != 0.0)
+    message.mid = fields.id;
+    message.user_id = fields.user_id;
+    message.chat_id = fields.chat_id;
+    message.text = cleanup_message_body(fields.body);
+    message.timestamp = fields.date;
+    if (fields.out != 0)
         message.status = MESSAGE_OUTGOING;
-    else if (fields.get("read_state").get<double>() == 0.0)
+    else if (fields.read_state == 0)
         message.status = MESSAGE_INCOMING_UNREAD;
     else
         message.status = MESSAGE_INCOMING_READ;
 
     // Process attachments: append information to text.
-    if (field_is_present<picojson::array>(fields, "attachments"))
-        process_attachments(data->gc, fields.get("attachments").get<picojson::array>(), message);
+    if (fields.attachments.is<picojson::array>())
+        process_attachments(data->gc, fields.attachments.get<picojson::array>(), message);
 
     // Process forwarded messages.
-    if (field_is_present<picojson::array>(fields, "fwd_messages")) {
-        const picojson::array& fwd_messages = fields.get("fwd_messages").get<picojson::array>();
-        for (const picojson::value& m: fwd_messages)
+    if (fields.fwd_messages.is<picojson::array>()) {
+        for (const picojson::value& m: fields.fwd_messages.get<picojson::array>())
             process_fwd_message(data->gc, m, message);
     }
-    if (field_is_present<picojson::object>(fields, "geo"))
-        process_geo(fields.get("geo"), message);
+    if (fields.geo.is<picojson::object>())
+        process_geo(fields.geo, message);
 
     data->messages.push_back(std::move(message));
 }
@@ -326,8 +586,8 @@ void process_fwd_message(PurpleConnection* gc, const picojson::value& fields, Me
 
     message.text += "<br>";
 
-    uint64 user_id = fields.get("user_id").get<double>();
-    string date = timestamp_to_long_format(fields.get("date").get<double>());
+    uint64 user_id = json_get_uint64(fields.get("user_id"));
+    string date = timestamp_to_long_format(json_get_int64(fields.get("date")));
     // Placeholder either contains a formed href, if the user is already known, or will be replaced
     // with proper name and href in replace_ids().
     string text = str_format(i18n("Forwarded message (from %s on %s):\n"),
@@ -353,8 +613,8 @@ void process_photo_attachment(const picojson::value& fields, Message& message,
                            "or messages.getById: %s\n", fields.serialize().data());
         return;
     }
-    const uint64 id = fields.get("id").get<double>();
-    const int64 owner_id = fields.get("owner_id").get<double>();
+    const uint64 id = json_get_uint64(fields.get("id"));
+    const int64 owner_id = json_get_int64(fields.get("owner_id"));
     const string& photo_text = fields.get("text").get<string>();
     const string& thumbnail = fields.get("photo_604").get<string>();
 
@@ -393,8 +653,8 @@ void process_video_attachment(const picojson::value& fields, Message& message,
                            "or messages.getById: %s\n", fields.serialize().data());
         return;
     }
-    const uint64 id = fields.get("id").get<double>();
-    const int64 owner_id = fields.get("owner_id").get<double>();
+    const uint64 id = json_get_uint64(fields.get("id"));
+    const int64 owner_id = json_get_int64(fields.get("owner_id"));
     const string& title = fields.get("title").get<string>();
     const string& thumbnail = fields.get("photo_320").get<string>();
 
@@ -453,13 +713,13 @@ void process_wall_attachment(PurpleConnection* gc, const picojson::value& fields
 
     message.text += "<br>";
 
-    uint64 id = fields.get("id").get<double>();
+    uint64 id = json_get_uint64(fields.get("id"));
     // This happens in case of reposts, where only "from_id" is specified.
     int64 to_id;
     if (field_is_present<double>(fields, "to_id"))
-        to_id = fields.get("to_id").get<double>();
+        to_id = json_get_uint64(fields.get("to_id"));
     else
-        to_id = fields.get("from_id").get<double>();
+        to_id = json_get_uint64(fields.get("from_id"));
 
     if (to_id > 0) {
         message.text += get_user_placeholder(gc, to_id, message);
@@ -471,7 +731,7 @@ void process_wall_attachment(PurpleConnection* gc, const picojson::value& fields
                                  (unsigned long long)id);
     const char* verb = (fields.contains("copy_text") || fields.contains("copy_history"))
                         ? i18n("reposted") : i18n("posted");
-    string date = timestamp_to_long_format(fields.get("date").get<double>());
+    string date = timestamp_to_long_format(json_get_int64(fields.get("date")));
 
     message.text += str_format(" <a href='%s'>%s</a> %s %s<br>", wall_url.data(), verb,
                                i18n("on"), date.data());
@@ -717,15 +977,16 @@ void download_thumbnail(const MessagesData_ptr& data, size_t msg_num, size_t thu
         }
 
         size_t size;
-        const char* img_data = purple_http_response_get_data(response, &size);
-        int img_id = purple_imgstore_add_with_id(g_memdup(img_data, size), size, nullptr);
+        // purple_imgstore_add_with_id takes ownership of the data.
+        char* img_data = purple_http_response_steal_data(response, &size);
+        int img_id = purple_imgstore_add_with_id(img_data, size, nullptr);
 
         string img_tag = str_format("<img id=\"%d\">", img_id);
         string img_placeholder = str_format("<thumbnail-placeholder-%zu>", thumb_num);
         str_replace(data->messages[msg_num].text, img_placeholder, img_tag);
 
         download_thumbnail(data, msg_num, thumb_num + 1);
-    });
+    }, VK_HTTP_POOL_MEDIA);
 }
 
 void replace_user_ids(const MessagesData_ptr& data)
@@ -977,7 +1238,7 @@ void mark_messages_as_read_impl(PurpleConnection* gc, const Cont& message_ids)
 
     vkcom_debug_info("Marking %d messages as read\n", (int)message_ids.size());
     CallParams params = { {"message_ids", str_concat_int(',', message_ids)} };
-    vk_call_api(gc, "messages.markAsRead", params, nullptr, nullptr);
+    vk_call_api(gc, "messages.markAsRead", std::move(params), nullptr, nullptr, VK_CALL_PRIORITY_INTERACTIVE);
 }
 
 } // namespace
@@ -6,6 +6,8 @@
 
 #include <connection.h>
 
+#include "contrib/picojson/picojson.h"
+
 // Callback called when messages are received. max_msg_id is the max id of received messages if any have been
 // received, zero otherwise.
 typedef function_ptr<void(uint64 max_msg_id)> ReceivedCb;
@@ -18,6 +20,21 @@ void receive_messages_range(PurpleConnection* gc, uint64 last_msg_id, const Rece
 // Receives messages with given ids. Suitable for small amount of message_ids (< 100).
 void receive_messages(PurpleConnection* gc, const vector<uint64>& message_ids);
 
+// Same as receive_messages, but the ids are collected for a short time and received together
+// (up to 100 per call). The messages are shown in the order of ids. peer_id is the user id
+// or chat id + 2000000000 of the conversation, the message belongs to.
+void receive_messages_batched(PurpleConnection* gc, uint64 message_id, uint64 peer_id);
+
+// Returns true if some messages of the conversation with peer_id are waiting to be received
+// by receive_messages_batched. The following messages of the conversation must be received
+// the same way, otherwise they would be shown before the preceding ones.
+bool is_receiving_batched(PurpleConnection* gc, uint64 peer_id);
+
+// Processes messages, which have been returned as a part of the result of another call (e.g.
+// messages.getLongPollHistory), the same way as receive_messages does.
+void receive_message_items(PurpleConnection* gc, const picojson::array& items,
+                           const ReceivedCb& received_cb);
+
 // Marks messages as read or defers marking them until it is appropriate to mark them as read.
 void mark_message_as_read(PurpleConnection* gc, const vector<VkReceivedMessage>& messages);
 
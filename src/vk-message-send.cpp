@@ -164,8 +164,8 @@ void upload_imgstore_images_impl(PurpleConnection* gc, const UploadImgstoreImage
             images->attachments += ',';
         // NOTE: We do not receive "access_key" from photos.saveMessagesPhoto, but it seems it does not matter,
         // vk.com will automatically add access_key to your private photos.
-        int64 owner_id = (int64)fields.get("owner_id").get<double>();
-        uint64 id = (uint64)fields.get("id").get<double>();
+        int64 owner_id = json_get_int64(fields.get("owner_id"));
+        uint64 id = json_get_uint64(fields.get("id"));
         images->attachments += str_format("photo%lld_%llu", (long long)owner_id,
                                           (unsigned long long)id);
 
@@ -276,7 +276,7 @@ void send_message_internal(PurpleConnection* gc, const SendMessage_ptr& message,
 
     get_data(gc).set_last_msg_sent_time(steady_clock::now());
 
-    vk_call_api(gc, "messages.send", params, [=](const picojson::value& v) {
+    vk_call_api(gc, "messages.send", std::move(params), [=](const picojson::value& v) {
         if (!v.is<double>()) {
             vkcom_debug_error("Wrong response from message.send: %s\n", v.serialize().data());
             show_error(gc, *message);
@@ -285,7 +285,7 @@ void send_message_internal(PurpleConnection* gc, const SendMessage_ptr& message,
 
         // NOTE: We do not set last_msg_id here, because it is done when corresponding notification is received
         // in longpoll.
-        uint64 msg_id = v.get<double>();
+        uint64 msg_id = json_get_uint64(v);
         get_data(gc).add_sent_msg_id(msg_id);
 
         // Check if we have sent the whole message.
@@ -305,7 +305,7 @@ void send_message_internal(PurpleConnection* gc, const SendMessage_ptr& message,
             message->success_cb();
     }, [=](const picojson::value& error) {
         process_im_error(error, gc, message);
-    });
+    }, VK_CALL_PRIORITY_INTERACTIVE);
 }
 
 void process_im_error(const picojson::value& error, PurpleConnection* gc, const SendMessage_ptr& message)
@@ -315,7 +315,7 @@ void process_im_error(const picojson::value& error, PurpleConnection* gc, const
         show_error(gc, *message);
         return;
     }
-    int error_code = error.get("error_code").get<double>();
+    int error_code = json_get_int64(error.get("error_code"));
     if (error_code != VK_CAPTCHA_NEEDED) {
         show_error(gc, *message);
         return;
@@ -362,7 +362,7 @@ void show_error(PurpleConnection* gc, const SendMessage& message)
 unsigned send_typing_notification(PurpleConnection* gc, uint64 user_id)
 {
     CallParams params = { {"user_id", to_string(user_id)}, {"type", "typing"} };
-    vk_call_api(gc, "messages.setActivity", params, nullptr, nullptr);
+    vk_call_api(gc, "messages.setActivity", std::move(params), nullptr, nullptr, VK_CALL_PRIORITY_INTERACTIVE);
 
     add_buddy_if_needed(gc, user_id);
 
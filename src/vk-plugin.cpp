@@ -277,6 +277,9 @@ void vk_login(PurpleAccount* account)
     VkData* gc_data = new VkData(gc, email, password);
     purple_connection_set_protocol_data(gc, gc_data);
 
+    // Connect to API server while we are authenticating.
+    http_prewarm(gc, "https://api.vk.com/");
+
     gc_data->authenticate([=] {
         // Set account alias to full user name if alias not set previously.
         const char* alias = purple_account_get_alias(account);
@@ -336,17 +339,17 @@ void vk_close(PurpleConnection* gc)
                           PURPLE_CALLBACK(conversation_received_msg));
 
     set_offline(gc);
-    // Let's sleep 250 msec, so that setOffline executes successfully. Yes, it is ugly, but
-    // we cannot defer destruction of PurpleConnection and doing the "right way" is such a bother.
-    g_usleep(250000);
+    // setOffline and the rest of unsent calls (e.g. messages.markAsRead) are sent detached from
+    // gc, so that they complete after the connection is destroyed.
+    vk_call_api_flush_on_close(gc);
 
     VkData& data = get_data(gc);
     data.set_closing();
 
     purple_request_close_with_handle(gc);
-    // TODO: Pidgin crashes if we cancel more than one http_get request in here. Either do not
-    // run parallel requests when fetching buddy icons or do something with timeouts.
+    // Callbacks of the cancelled requests are not called, see http_request.
     purple_http_conn_cancel_all(gc);
+    cancel_running_xfers(gc);
 
     check_blist_on_logout(gc);
 
@@ -379,6 +382,28 @@ unsigned int vk_send_typing(PurpleConnection* gc, const char* who, PurpleTypingS
     return send_typing_notification(gc, user_id);
 }
 
+// The minimum time in seconds the user must have been idle for the API connection to be
+// pre-warmed upon returning. Shorter idle periods do not outlive the keep-alive connections.
+const time_t PREWARM_MIN_IDLE_TIME = 30;
+
+// Called when the user becomes idle or returns. idle_time is the number of seconds the user
+// has been idle for, or 0 when the user returns.
+void vk_set_idle(PurpleConnection* gc, int idle_time)
+{
+    VkData& gc_data = get_data(gc);
+    if (idle_time != 0) {
+        gc_data.idle_since = time(nullptr) - idle_time;
+        return;
+    }
+
+    time_t idle_since = gc_data.idle_since;
+    gc_data.idle_since = 0;
+    // The server has most likely closed the idle API connections, open a new one before the user
+    // does anything.
+    if (idle_since != 0 && time(nullptr) - idle_since >= PREWARM_MIN_IDLE_TIME)
+        http_prewarm(gc, "https://api.vk.com/");
+}
+
 // Returns link to vk.com user page
 string get_user_page(const char* who, const VkUserInfo* info)
 {
@@ -393,19 +418,21 @@ void vk_get_info(PurpleConnection* gc, const char* who)
 {
     vkcom_debug_info("Requesting user info for %s\n", who);
 
-    PurpleNotifyUserInfo* info = purple_notify_user_info_new();
+    // purple_notify_userinfo does not take ownership of info. The shared_ptr releases it even if
+    // the callback below is not called due to logout.
+    shared_ptr<PurpleNotifyUserInfo> info(purple_notify_user_info_new(), purple_notify_user_info_destroy);
     uint64 user_id = user_id_from_name(who);
     if (user_id == 0) {
-        purple_notify_user_info_add_pair(info, i18n("User is not a Vk.com user"), nullptr);
-        purple_notify_userinfo(gc, who, info, nullptr, nullptr);
+        purple_notify_user_info_add_pair(info.get(), i18n("User is not a Vk.com user"), nullptr);
+        purple_notify_userinfo(gc, who, info.get(), nullptr, nullptr);
         return;
     }
 
     VkUserInfo* user_info = get_user_info(gc, user_id);
-    purple_notify_user_info_add_pair(info, i18n("Page"), get_user_page(who, user_info).data());
+    purple_notify_user_info_add_pair(info.get(), i18n("Page"), get_user_page(who, user_info).data());
     if (!user_info) {
-        purple_notify_user_info_add_pair(info, i18n("Updating data..."), nullptr);
-        purple_notify_userinfo(gc, who, info, nullptr, nullptr);
+        purple_notify_user_info_add_pair(info.get(), i18n("Updating data..."), nullptr);
+        purple_notify_userinfo(gc, who, info.get(), nullptr, nullptr);
         return;
     }
 
@@ -413,37 +440,38 @@ void vk_get_info(PurpleConnection* gc, const char* who)
     [=](PurpleHttpConnection*, PurpleHttpResponse* response) {
         if (purple_http_response_is_successful(response)) {
             size_t size;
-            const char* data = purple_http_response_get_data(response, &size);
-            int img_id = purple_imgstore_add_with_id(g_memdup(data, size), size, nullptr);
+            // purple_imgstore_add_with_id takes ownership of the data.
+            char* data = purple_http_response_steal_data(response, &size);
+            int img_id = purple_imgstore_add_with_id(data, size, nullptr);
             if (img_id != 0) {
                 string img = str_format("<img id='%d'>", img_id);
-                purple_notify_user_info_add_pair(info, nullptr, img.data());
+                purple_notify_user_info_add_pair(info.get(), nullptr, img.data());
             }
         }
 
-        purple_notify_user_info_add_section_break(info);
-        purple_notify_user_info_add_pair_plaintext(info, i18n("Name"), user_info->real_name.data());
+        purple_notify_user_info_add_section_break(info.get());
+        purple_notify_user_info_add_pair_plaintext(info.get(), i18n("Name"), user_info->real_name.data());
 
         if (!user_info->bdate.empty())
-            purple_notify_user_info_add_pair_plaintext(info, i18n("Birthdate"),
+            purple_notify_user_info_add_pair_plaintext(info.get(), i18n("Birthdate"),
                                                        user_info->bdate.data());
         if (!user_info->education.empty())
-            purple_notify_user_info_add_pair_plaintext(info, i18n("Education"),
+            purple_notify_user_info_add_pair_plaintext(info.get(), i18n("Education"),
                                                        user_info->education.data());
         if (!user_info->mobile_phone.empty())
-            purple_notify_user_info_add_pair_plaintext(info, i18n("Mobile phone"),
+            purple_notify_user_info_add_pair_plaintext(info.get(), i18n("Mobile phone"),
                                                        user_info->mobile_phone.data());
         if (!user_info->activity.empty())
-            purple_notify_user_info_add_pair_plaintext(info, i18n("Status"),
+            purple_notify_user_info_add_pair_plaintext(info.get(), i18n("Status"),
                                                        user_info->activity.data());
 
         if (!user_info->online && user_info->last_seen != 0) {
             const char* date_buf = purple_date_format_full(localtime(&user_info->last_seen));
-            purple_notify_user_info_add_pair_plaintext(info, i18n("Last seen"), date_buf);
+            purple_notify_user_info_add_pair_plaintext(info.get(), i18n("Last seen"), date_buf);
         }
 
-        purple_notify_userinfo(gc, who, info, nullptr, nullptr);
-    });
+        purple_notify_userinfo(gc, who, info.get(), nullptr, nullptr);
+    }, VK_HTTP_POOL_MEDIA);
 }
 
 // Called when user changes the status.
@@ -744,7 +772,7 @@ PurplePluginProtocolInfo prpl_info = {
     vk_send_typing, /* send_typing */
     vk_get_info, /* get_info */
     vk_set_status, /* set_status */
-    nullptr, /* set_idle */
+    vk_set_idle, /* set_idle */
     nullptr, /* change_passwd */
     vk_add_buddy, /* add_buddy */
     nullptr, /* add_buddies */
@@ -882,6 +910,25 @@ void vkcom_prpl_init(PurplePlugin*)
 
     option = purple_account_option_string_new(i18n("Group for chats"), "blist_chat_group", "");
     prpl_info.protocol_options = g_list_append(prpl_info.protocol_options, option);
+
+    // Limits of simultaneous connections per host for each class of traffic (0 means no limit).
+    option = purple_account_option_int_new(i18n("Max connections for API calls"), "api_connections", 4);
+    prpl_info.protocol_options = g_list_append(prpl_info.protocol_options, option);
+
+    option = purple_account_option_int_new(i18n("Max connections for Long Poll"), "long_poll_connections", 2);
+    prpl_info.protocol_options = g_list_append(prpl_info.protocol_options, option);
+
+    option = purple_account_option_int_new(i18n("Max connections for downloading images"),
+                                           "media_connections", 4);
+    prpl_info.protocol_options = g_list_append(prpl_info.protocol_options, option);
+
+    option = purple_account_option_int_new(i18n("Max connections for uploading files"),
+                                           "upload_connections", 2);
+    prpl_info.protocol_options = g_list_append(prpl_info.protocol_options, option);
+
+    option = purple_account_option_bool_new(i18n("Use HTTP pipelining for API calls (experimental)"),
+                                            "api_pipelining", false);
+    prpl_info.protocol_options = g_list_append(prpl_info.protocol_options, option);
 }
 
 extern "C"
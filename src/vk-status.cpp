@@ -44,5 +44,5 @@ void set_offline(PurpleConnection* gc)
 void set_status_text(PurpleConnection* gc, const char* text)
 {
     CallParams params = { { "text", text } };
-    vk_call_api(gc, "status.set", params, nullptr, nullptr);
+    vk_call_api(gc, "status.set", std::move(params), nullptr, nullptr);
 }
@@ -1,4 +1,6 @@
+#include <cstring>
 #include <gio/gio.h>
+#include <glib/gstdio.h>
 #include <random>
 
 #include "httputils.h"
@@ -11,20 +13,30 @@
 namespace
 {
 
+// Contents of the uploaded file, either in memory or on disk.
+struct UploadContents
+{
+    // The contents in memory or nullptr if the file must be read from filepath.
+    const char* data;
+    string filepath;
+    size_t size;
+};
+
 // Helper function, which is used by upload_doc and upload_photo.
 void upload_file(PurpleConnection* gc, const char* get_upload_server, const char* partname, const char* name,
-                 const void* contents, size_t size, const UploadedCb& uploaded_cb, const ErrorCb& error_cb,
+                 const UploadContents& contents, const UploadedCb& uploaded_cb, const ErrorCb& error_cb,
                  const UploadProgressCb& upload_progress_cb = nullptr);
 
 } // End of anonymous namespace
 
-void upload_doc_for_im(PurpleConnection* gc, const char* name, const void* contents, size_t size,
+void upload_doc_for_im(PurpleConnection* gc, const char* name, const char* filepath, size_t size,
                        const UploadedCb& uploaded_cb, const ErrorCb& error_cb,
                        const UploadProgressCb& upload_progress_cb)
 {
     vkcom_debug_info("Uploading document for IM\n");
 
-    upload_file(gc, "docs.getWallUploadServer", "file", name, contents, size, [=](const picojson::value& v) {
+    UploadContents contents = { nullptr, filepath, size };
+    upload_file(gc, "docs.getWallUploadServer", "file", name, contents, [=](const picojson::value& v) {
         if (!field_is_present<string>(v, "file")) {
             vkcom_debug_error("Strange response from upload server: %s\n", v.serialize().data());
             if (error_cb)
@@ -49,7 +61,9 @@ void upload_photo_for_im(PurpleConnection* gc, const char* name, const void* con
 {
     vkcom_debug_info("Uploading photo for IM\n");
 
-    upload_file(gc, "photos.getMessagesUploadServer", "photo", name, contents, size, [=](const picojson::value& v) {
+    UploadContents upload_contents = { (const char*)contents, string(), size };
+    upload_file(gc, "photos.getMessagesUploadServer", "photo", name, upload_contents,
+                [=](const picojson::value& v) {
         if (!(field_is_present<int>(v, "server") || field_is_present<string>(v, "server"))
             || !field_is_present<string>(v, "photo") || !field_is_present<string>(v, "hash")) {
             vkcom_debug_error("Strange response from upload server: %s\n", v.serialize().data());
@@ -74,13 +88,39 @@ void upload_photo_for_im(PurpleConnection* gc, const char* name, const void* con
 namespace
 {
 
+// Body of the multipart/form-data POST request, which is read in chunks by upload_body_reader
+// while the request is being sent.
+struct UploadBody
+{
+    string header;
+    UploadContents contents;
+    string footer;
+
+    // The file, which is opened if contents are on disk, and the current position in it.
+    FILE* file = nullptr;
+    size_t file_pos = 0;
+
+    ~UploadBody()
+    {
+        if (file)
+            fclose(file);
+    }
+
+    size_t size() const
+    {
+        return header.size() + contents.size + footer.size();
+    }
+};
+
 // Initiates HTTP transfer to upload_url.
 void start_upload(PurpleConnection* gc, const string& upload_url, const char* partname, const char* name,
-                  const void* contents, size_t size, const UploadedCb& uploaded_cb, const ErrorCb& error_cb,
+                  const UploadContents& contents, const UploadedCb& uploaded_cb, const ErrorCb& error_cb,
                   const UploadProgressCb& upload_progress_cb);
 // Prepares HTTP POST request with multipart/form-data with partname, containing given contents.
-PurpleHttpRequest* prepare_upload_request(const string& url, const char* partname, const void* contents,
-                                          size_t size, const char* name);
+// Returns nullptr if the file cannot be opened. body must be valid until the request is finished.
+PurpleHttpRequest* prepare_upload_request(const string& url, const char* partname,
+                                          const UploadContents& contents, const char* name,
+                                          UploadBody& body);
 // Generates random boundary string for multipart/form-data POST requests.
 string generate_boundary();
 
@@ -89,7 +129,7 @@ void progress_watcher(PurpleHttpConnection* http_conn, gboolean reading_state, i
                       void* progress_data);
 
 void upload_file(PurpleConnection* gc, const char* get_upload_server, const char* partname, const char* name,
-                 const void* contents, size_t size, const UploadedCb& uploaded_cb, const ErrorCb& error_cb,
+                 const UploadContents& contents, const UploadedCb& uploaded_cb, const ErrorCb& error_cb,
                  const UploadProgressCb& upload_progress_cb)
 {
     vk_call_api(gc, get_upload_server, CallParams(), [=](const picojson::value& result) {
@@ -103,7 +143,7 @@ void upload_file(PurpleConnection* gc, const char* get_upload_server, const char
         const string& upload_url = result.get("upload_url").get<string>();
         vkcom_debug_info("Uploading to %s\n", upload_url.data());
 
-        start_upload(gc, upload_url, partname, name, contents, size, uploaded_cb, error_cb, upload_progress_cb);
+        start_upload(gc, upload_url, partname, name, contents, uploaded_cb, error_cb, upload_progress_cb);
     }, [=](const picojson::value&) {
         if (error_cb)
             error_cb();
@@ -111,20 +151,27 @@ void upload_file(PurpleConnection* gc, const char* get_upload_server, const char
 }
 
 void start_upload(PurpleConnection* gc, const string& upload_url, const char* partname, const char* name,
-                  const void* contents, size_t size, const UploadedCb& uploaded_cb, const ErrorCb& error_cb,
+                  const UploadContents& contents, const UploadedCb& uploaded_cb, const ErrorCb& error_cb,
                   const UploadProgressCb& upload_progress_cb)
 {
     vkcom_debug_info("Starting upload\n");
 
-    PurpleHttpRequest* request = prepare_upload_request(upload_url, partname, contents, size, name);
-    UploadProgressCb* progress_data = nullptr;
+    // The body and the progress callback are owned by the response callback, so that they are
+    // released even if the callback is not called due to logout.
+    shared_ptr<UploadBody> body{ new UploadBody() };
+    PurpleHttpRequest* request = prepare_upload_request(upload_url, partname, contents, name, *body);
+    if (!request) {
+        if (error_cb)
+            error_cb();
+        return;
+    }
+
+    shared_ptr<UploadProgressCb> progress_data;
     if (upload_progress_cb)
-        progress_data = new UploadProgressCb(upload_progress_cb);
+        progress_data.reset(new UploadProgressCb(upload_progress_cb));
 
     PurpleHttpConnection* http_conn = http_request(gc, request,
-    [=](PurpleHttpConnection*, PurpleHttpResponse* response) {
-        delete progress_data;
-
+    [body, progress_data, uploaded_cb, error_cb](PurpleHttpConnection*, PurpleHttpResponse* response) {
         if (!purple_http_response_is_successful(response)) {
             if (error_cb)
                 error_cb();
@@ -145,27 +192,82 @@ void start_upload(PurpleConnection* gc, const string& upload_url, const char* pa
         vkcom_debug_info("Finished upload\n");
 
         uploaded_cb(root);
-    });
+    }, VK_HTTP_POOL_UPLOAD);
     purple_http_request_unref(request);
-    purple_http_conn_set_progress_watcher(http_conn, progress_watcher, progress_data, -1);
+    purple_http_conn_set_progress_watcher(http_conn, progress_watcher, progress_data.get(), -1);
 }
 
-PurpleHttpRequest* prepare_upload_request(const string& url, const char* partname, const void* contents,
-                                          size_t size, const char* name)
+// Copies the part of str, which lies in the range of the body [offset, offset + length), to buffer.
+// str starts at str_offset in the body.
+void read_upload_string(const string& str, size_t str_offset, char* buffer, size_t offset, size_t length,
+                        size_t& stored)
 {
-    PurpleHttpRequest* request = purple_http_request_new(url.data());
-    purple_http_request_set_method(request, "POST");
+    if (offset + stored >= str_offset + str.size() || offset + length <= str_offset)
+        return;
+    size_t from = offset + stored - str_offset;
+    size_t len = std::min(str.size() - from, length - stored);
+    memcpy(buffer + stored, str.data() + from, len);
+    stored += len;
+}
 
-    string boundary;
-    while (true) {
-        boundary = generate_boundary();
-        // Check if boundary is not present in the contents.
-        if (!g_strstr_len((const char*)contents, size, boundary.data()))
-            break;
+// Copies the part of the contents, which lies in the range of the body [offset, offset + length),
+// to buffer. Returns false if the file could not be read.
+bool read_upload_contents(UploadBody& body, char* buffer, size_t offset, size_t length, size_t& stored)
+{
+    size_t contents_offset = body.header.size();
+    if (offset + stored >= contents_offset + body.contents.size || offset + length <= contents_offset)
+        return true;
+    size_t from = offset + stored - contents_offset;
+    size_t len = std::min(body.contents.size - from, length - stored);
+
+    if (body.contents.data) {
+        memcpy(buffer + stored, body.contents.data + from, len);
+    } else {
+        // The file is read sequentially unless the request is retried.
+        if (body.file_pos != from && fseek(body.file, (long)from, SEEK_SET) != 0)
+            return false;
+        body.file_pos = from;
+        size_t read = fread(buffer + stored, 1, len, body.file);
+        body.file_pos += read;
+        if (read != len) {
+            vkcom_debug_error("Unable to read %s, has it been changed?\n", body.contents.filepath.data());
+            return false;
+        }
     }
+    stored += len;
+    return true;
+}
 
-    purple_http_request_header_set_printf(request, "Content-type", "multipart/form-data; boundary=%s",
-                                          boundary.data());
+// Contents reader for the upload request. The body is read from its parts on the fly.
+void upload_body_reader(PurpleHttpConnection* http_conn, gchar* buffer, size_t offset, size_t length,
+                        gpointer user_data, PurpleHttpContentReaderCb cb)
+{
+    UploadBody& body = *(UploadBody*)user_data;
+    size_t stored = 0;
+    read_upload_string(body.header, 0, buffer, offset, length, stored);
+    bool success = read_upload_contents(body, buffer, offset, length, stored);
+    if (success)
+        read_upload_string(body.footer, body.header.size() + body.contents.size, buffer, offset, length,
+                           stored);
+    cb(http_conn, success, offset + stored >= body.size(), stored);
+}
+
+PurpleHttpRequest* prepare_upload_request(const string& url, const char* partname,
+                                          const UploadContents& contents, const char* name,
+                                          UploadBody& body)
+{
+    body.contents = contents;
+    if (!contents.data) {
+        body.file = g_fopen(contents.filepath.data(), "rb");
+        if (!body.file) {
+            vkcom_debug_error("Unable to open file %s\n", contents.filepath.data());
+            return nullptr;
+        }
+    }
+
+    // We do not check if boundary is present in the contents: the file would have to be read twice
+    // for that, while the chance of 48 random characters matching is negligible.
+    string boundary = generate_boundary();
 
     char* content_type = g_content_type_guess(name, nullptr, 0, nullptr);
     char* mime_type;
@@ -175,33 +277,25 @@ PurpleHttpRequest* prepare_upload_request(const string& url, const char* partnam
         mime_type = g_strdup("application/octet-stream");
     g_free(content_type);
 
-    vkcom_debug_info("Sending file %s with size %zu and mime-type %s to %s\n", name, size,
+    vkcom_debug_info("Sending file %s with size %zu and mime-type %s to %s\n", name, contents.size,
                      mime_type, url.data());
-    string body_header = str_format("--%s\r\n"
-                                    "Content-Disposition: form-data; name=\"%s\"; filename=\"%s\"\r\n"
-                                    "Content-Type: %s\r\n"
-                                    "Content-Length: %zu\r\n"
-                                    "\r\n", boundary.data(), partname, name, mime_type, size);
-    string body_footer = str_format("\r\n--%s--", boundary.data());
+    body.header = str_format("--%s\r\n"
+                             "Content-Disposition: form-data; name=\"%s\"; filename=\"%s\"\r\n"
+                             "Content-Type: %s\r\n"
+                             "Content-Length: %zu\r\n"
+                             "\r\n", boundary.data(), partname, name, mime_type, contents.size);
+    body.footer = str_format("\r\n--%s--", boundary.data());
     g_free(mime_type);
 
-    // Yes, we copy file contents in memory, let's hope again, that user will not be uploading large files.
-    // Anyway, we will have to add compression to zip on-the-fly for most of the file types later.
-    // Another copy happens in set_contents, so it's a good thing we capped the size of the files
-    // to 150mb!
-    //
-    // TODO: Add properly this stuff via purple_http_request_set_contents_reader.
-    vector<char> body;
-    body.reserve(body_header.size() + size + body_footer.size());
-    append(body, body_header);
-    const char* char_contents = (const char*)contents;
-    body.insert(body.end(), char_contents, char_contents + size);
-    append(body, body_footer);
-    body.insert(body.end(), body_footer.begin(), body_footer.end());
-
+    PurpleHttpRequest* request = purple_http_request_new(url.data());
+    purple_http_request_set_method(request, "POST");
+    purple_http_request_header_set_printf(request, "Content-type", "multipart/form-data; boundary=%s",
+                                          boundary.data());
     // Set an hour timeout, so that we never timeout anyway.
     purple_http_request_set_timeout(request, 3600);
-    purple_http_request_set_contents(request, body.data(), body.size());
+    // The body is never copied: the file (or the contents in memory) is read in chunks while
+    // the request is being sent.
+    purple_http_request_set_contents_reader(request, upload_body_reader, (int)body.size(), &body);
 
     return request;
 }
@@ -17,9 +17,9 @@ typedef function_ptr<void(PurpleHttpConnection* http_conn, int processed, int to
 
 // Uploads document via docs.getWallUploadServer which means document will be prepared to be
 // sent as attachment via im. value returned via UploadedCb call is returned from docs.save
-// call.
-// NOTE: contents must be valid until either uploaded_cb or error_cb is called.
-void upload_doc_for_im(PurpleConnection* gc, const char* name, const void* contents, size_t size,
+// call. The file at filepath is read in chunks while it is being uploaded, so it is never loaded
+// in memory as a whole. size must be the size of the file.
+void upload_doc_for_im(PurpleConnection* gc, const char* name, const char* filepath, size_t size,
                        const UploadedCb& uploaded_cb, const ErrorCb& error_cb,
                        const UploadProgressCb& upload_progress_cb = nullptr);
 
@@ -346,7 +346,7 @@ void update_groups_info(PurpleConnection* gc, vector<uint64> group_ids, const Su
                 return;
             }
 
-            uint64 id = v.get("id").get<double>();
+            uint64 id = json_get_uint64(v.get("id"));
             VkGroupInfo& info = get_data(gc).group_infos[id];
             info.name = v.get("name").get<string>();
             info.type = v.get("type").get<string>();
@@ -416,7 +416,7 @@ void resolve_screen_name(PurpleConnection* gc, const char* screen_name, const Re
             return;
         }
 
-        resolved_cb(result.get("type").get<string>(), result.get("object_id").get<double>());
+        resolved_cb(result.get("type").get<string>(), json_get_uint64(result.get("object_id")));
     }, [=](const picojson::value&) {
         resolved_cb("", 0);
     });